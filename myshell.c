@@ -1,268 +1,622 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <signal.h>
+#include <spawn.h>
 #include <sys/wait.h>
 #include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#define MAX_STAGES 64 //commands in one pipeline
+#define MAX_JOBS 64 //background pipelines tracked at once
+
+typedef struct
+{
+	const char * name;
+	int (*run)(char * argv[]); //returns the exit status
+} builtin;
+
+typedef struct
+{
+	pid_t pgid; //0 for a free slot
+	char text[512]; //the command line that started it
+	bool done;
+	bool stopped; //a stage of it is stopped, like a foreground pipeline stopped by ^Z
+} job;
+
 int read_command(char * command, bool print_prompt);
 int parse_command(char * input, char * args[], bool * run_bg);
-int check_meta_chars(char * args[], int token_count);
-void in_redirect(char * args[], int token_count, char * arg_list[]);
-void out_redirect(char * args[], int token_count, char * arg_list[]);
-void pipe_commands(char * args[], int token_count, bool redirect_input, bool redirect_output);
-void signal_handler(int signal);
+int split_pipeline(char * args[], int token_count, char ** stages[], char ** in_file, char ** out_file);
+const builtin * find_builtin(const char * name);
+int run_builtin(const builtin * command, char * argv[], int in, int out);
+void run_stage(char * argv[], int in, int out);
+pid_t launch_stage(char * argv[], int in, int out, pid_t pgid, int terminal, bool use_fork);
+int run_pipeline(char * args[], int token_count, bool run_bg, int pipe_size, bool use_fork, const char * text);
+void reap_jobs();
+int job_slot();
+int add_job(pid_t pgid, const char * text, bool stopped);
+int builtin_cd(char * argv[]);
+int builtin_exit(char * argv[]);
+int builtin_export(char * argv[]);
+int builtin_pwd(char * argv[]);
+int builtin_wait(char * argv[]);
+int builtin_jobs(char * argv[]);
+
+extern char ** environ;
+
+//commands the shell runs itself, looked up before anything is launched
+const builtin builtins[] = {
+	{"cd", builtin_cd},
+	{"exit", builtin_exit},
+	{"export", builtin_export},
+	{"pwd", builtin_pwd},
+	{"wait", builtin_wait},
+	{"jobs", builtin_jobs},
+};
+
+job jobs[MAX_JOBS]; //background pipelines, a job's number is its slot + 1
+int last_status = 0; //exit status of the last foreground command, for exit
 
 int main(int argc, char * argv[])
 {
 	
 	bool print_prompt = true;
 	bool run_bg = false;
+	int pipe_size = 0; //F_SETPIPE_SZ for every pipe, 0 keeps the kernel default
+	bool use_fork = false; //launch every command with fork instead of posix_spawn
 
-	if(argc > 1)
-		if(strcmp(argv[1], "-n") == 0)
+	int i;
+	for(i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "-n") == 0)
 			print_prompt = false;
+		else if(strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+			pipe_size = atoi(argv[++i]); //pipe buffer size in bytes
+		else if(strcmp(argv[i], "-f") == 0)
+			use_fork = true;
+	}
+
+	//pipelines get the terminal while they run, taking it back must not stop the shell
+	signal(SIGTTOU, SIG_IGN);
 	
 	while(1)
 	{
 		char command[512] = "";
-		pid_t pid; //child process ID
-		int status;
 		char * args[512] = {}; //argument list from the command line
-		int in, out;
 
-		int close = read_command(command, print_prompt); //get a command from the user
+		reap_jobs(); //background jobs that finished meanwhile
+
+		if(read_command(command, print_prompt) == -1) //get a command from the user
+			break; //end of input
 	
+		run_bg = false;
 		int token_count = parse_command(command, args, &run_bg); //parse the command and get the number of tokens
-		int meta_number = check_meta_chars(args, token_count); //find any meta characters
+		if(token_count == 0 || args[0][0] == '\0')
+			continue; //blank line
 
-		if((pid = fork()) > 0)
-		{
-			if(run_bg == true)
-			{
-				signal(SIGCHLD, signal_handler);
-			}
-			else
-			{
-				waitpid(pid, &status, 0);
-			}
-		} else {
-			if(meta_number == 0){		
-				execvp(args[0], args);
-			}else if(meta_number == 1){
-				char * arg_list[512] = {};
-				in_redirect(args, token_count, arg_list);
-				execvp(arg_list[0], arg_list);
-			}else if(meta_number == 2){
-				char * arg_list[512] = {};
-				out_redirect(args, token_count, arg_list);
-				execvp(arg_list[0], arg_list);		
-			}else if(meta_number == 3){
-				pipe_commands(args, token_count, false, false);
-			}else if(meta_number == 4){
-				char * arg_list1[512] = {};
-				char * arg_list2[512] = {};
-				in_redirect(args, token_count, arg_list1);
-				out_redirect(args, token_count, arg_list2);
-				execvp(arg_list1[0], arg_list1);
-			}else if(meta_number == 5){
-				pipe_commands(args, token_count, true, false);
-			}else if(meta_number == 6){
-				pipe_commands(args, token_count, false, true);
-			}else if(meta_number == 7){
-				pipe_commands(args, token_count, true, true);
-			}
-		}
+		int status = run_pipeline(args, token_count, run_bg, pipe_size, use_fork, command); //a plain command is a pipeline of one
+		if(run_bg == false)
+			last_status = status;
 	}
+
+	if(print_prompt == true)
+		printf("\n"); //leave the terminal on a fresh line after ^D
+	return last_status;
 }
 
-void signal_handler(int signal)
+const builtin * find_builtin(const char * name)
 {
-	//printf("Caught signal %d\n", signal);
-	if(signal == SIGCHLD)
+	/* Returns the builtin called name, or NULL for a command to launch */
+	int i;
+	for(i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
 	{
-		//printf("child ended\n");
-		wait(NULL);
+		if(strcmp(builtins[i].name, name) == 0)
+			return &builtins[i];
 	}
+	return NULL;
 }
 
-void in_redirect(char * args[], int token_count, char * arg_list[])
-{	
-	//handles input redirection
-	char * filename;
-	char * token;
-	int in;
+int run_builtin(const builtin * command, char * argv[], int in, int out)
+{
+	/* Runs a builtin in the shell process with stdin on in and stdout on out (-1 keeps the shell's), then puts them back */
+	int saved_in = -1, saved_out = -1;
+	if(in != -1)
+	{
+		saved_in = dup(0);
+		dup2(in, 0);
+	}
+	if(out != -1)
+	{
+		fflush(stdout);
+		saved_out = dup(1);
+		dup2(out, 1);
+	}
 
-	int i = 0;
-	for(i = 0; i < token_count; i++)
+	int status = command->run(argv);
+
+	fflush(stdout);
+	if(saved_in != -1)
 	{
-		token = args[i];
-		if(strcmp(token, "<") == 0)
-		{
-			filename = args[i + 1];
-			break;
-		}
-		arg_list[i] = token;
+		dup2(saved_in, 0);
+		close(saved_in);
+	}
+	if(saved_out != -1)
+	{
+		dup2(saved_out, 1);
+		close(saved_out);
+	}
+	return status;
+}
+
+int builtin_cd(char * argv[])
+{
+	/* cd [dir], home without one */
+	const char * dir = argv[1] != NULL ? argv[1] : getenv("HOME");
+	if(dir == NULL)
+	{
+		fprintf(stderr, "cd: HOME not set\n");
+		return 1;
+	}
+	if(chdir(dir) < 0)
+	{
+		perror(dir);
+		return 1;
 	}
 
-	in = open(filename, O_RDONLY);
-	dup2(in, 0);
-	close(in);
+	char cwd[PATH_MAX];
+	if(getcwd(cwd, sizeof(cwd)) != NULL)
+		setenv("PWD", cwd, 1); //commands launched from here see where they are
+	return 0;
 }
 
-void out_redirect(char * args[], int token_count, char * arg_list[])
+int builtin_exit(char * argv[])
 {
-	//handles output redirection
-	char * filename; //file to redirect to
-	char * token; //each token in args
-	int out; //fd for the outfile
+	/* exit [status], the last command's status without one */
+	exit(argv[1] != NULL ? atoi(argv[1]) : last_status);
+}
 
-	int i = 0;
-	for(i = 0; i < token_count; i++)
+int builtin_export(char * argv[])
+{
+	/* export NAME=value ..., or the whole environment without arguments */
+	if(argv[1] == NULL)
+	{
+		char ** variable;
+		for(variable = environ; *variable != NULL; variable++)
+			printf("export %s\n", *variable);
+		return 0;
+	}
+
+	int status = 0;
+	int i;
+	for(i = 1; argv[i] != NULL; i++)
 	{
-		token = args[i]; //token is each token in the args list
-		if(strcmp(token, ">") == 0)
+		char * equals = strchr(argv[i], '=');
+		if(equals == NULL)
+			continue; //already exported if it is set at all
+		*equals = '\0';
+		if(setenv(argv[i], equals + 1, 1) < 0)
 		{
-			filename = args[i + 1]; //get the filename
-			break; //break out of the for loop
+			perror("export");
+			status = 1;
 		}
-		arg_list[i] = token; //collect all argument commands before the ">" into arg_list
+		*equals = '=';
 	}
+	return status;
+}
 
-	//for(i = 0; i < token_count; i++)
-	//		printf("right args: '%s'\n", arg_list[i]);
+int builtin_pwd(char * argv[])
+{
+	/* pwd */
+	char cwd[PATH_MAX];
+	if(getcwd(cwd, sizeof(cwd)) == NULL)
+	{
+		perror("pwd");
+		return 1;
+	}
+	printf("%s\n", cwd);
+	return 0;
+}
+
+int builtin_wait(char * argv[])
+{
+	/* wait [%job ...], every background job without arguments; returns the status of the last one waited for */
+	int status = 0;
+	int i;
+	for(i = 0; i < MAX_JOBS; i++)
+	{
+		if(jobs[i].pgid == 0)
+			continue;
 
-	out = open(filename, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IRGRP | S_IWGRP | S_IWUSR); //open the file to write
-	dup2(out, 1); //change stdout to be the outfile
-	close(out); //close the unused fd for the outfile
+		bool wanted = argv[1] == NULL;
+		int j;
+		for(j = 1; argv[j] != NULL; j++)
+		{
+			if((argv[j][0] == '%' && atoi(argv[j] + 1) == i + 1) || atoi(argv[j]) == jobs[i].pgid)
+				wanted = true;
+		}
+		if(wanted == false || jobs[i].stopped == true)
+			continue;
+
+		//a stopped job would never finish, it stays in the table and wait moves on, here or once a stage stops
+		int child_status;
+		pid_t pid;
+		while((pid = waitpid(-jobs[i].pgid, &child_status, WUNTRACED)) > 0 || (pid < 0 && errno == EINTR))
+		{
+			if(pid > 0 && WIFSTOPPED(child_status))
+			{
+				jobs[i].stopped = true;
+				status = 128 + WSTOPSIG(child_status);
+				break;
+			}
+			if(pid > 0)
+				status = WIFEXITED(child_status) ? WEXITSTATUS(child_status) : 128 + WTERMSIG(child_status);
+		}
+		if(pid < 0)
+			jobs[i].pgid = 0; //waited for, so it is not reported as done later
+	}
+	return status;
 }
 
-void pipe_commands(char * args[], int token_count, bool redirect_input, bool redirect_output)
-{	
-	//handles piping
-	char * token;
+int builtin_jobs(char * argv[])
+{
+	/* jobs, lists the background jobs and forgets the ones that are done */
+	reap_jobs();
+	int i;
+	for(i = 0; i < MAX_JOBS; i++)
+	{
+		if(jobs[i].pgid == 0)
+			continue;
+		printf("[%d] %s\t%s\n", i + 1, jobs[i].done == true ? "Done" : jobs[i].stopped == true ? "Stopped" : "Running", jobs[i].text);
+		if(jobs[i].done == true)
+			jobs[i].pgid = 0;
+	}
+	return 0;
+}
 
-	char * arg_list1[512] = {};
-	char * arg_list2[512] = {};
+void reap_jobs()
+{
+	/* Collects the background jobs' exited processes and notes stops and restarts; a job is done once its group has none left */
+	int i;
+	for(i = 0; i < MAX_JOBS; i++)
+	{
+		if(jobs[i].pgid == 0 || jobs[i].done == true)
+			continue;
 
-	int pipefd[2]; //pipe file descriptors
-	int pid2; //pid of child process
-	pipe(pipefd); //create pipe and store fds
-	pid2 = fork(); //fork to clone the process
+		int status;
+		pid_t pid;
+		while((pid = waitpid(-jobs[i].pgid, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0)
+		{
+			if(WIFSTOPPED(status))
+				jobs[i].stopped = true;
+			else if(WIFCONTINUED(status))
+				jobs[i].stopped = false;
+		}
+		if(pid < 0 && errno == ECHILD)
+			jobs[i].done = true;
+	}
+}
+
+int job_slot()
+{
+	/* Returns a free slot in the job table, or failing that one of a job that is done but was never listed, or -1 when every job is still running */
+	int i;
+	for(i = 0; i < MAX_JOBS; i++)
+	{
+		if(jobs[i].pgid == 0)
+			return i;
+	}
+	reap_jobs();
+	for(i = 0; i < MAX_JOBS; i++)
+	{
+		if(jobs[i].done == true)
+			return i;
+	}
+	return -1;
+}
 
-	if(pid2 != 0)
+int add_job(pid_t pgid, const char * text, bool stopped)
+{
+	/* Puts group pgid in the job table as text; returns its slot, or -1 when the table is full */
+	int i = job_slot();
+	if(i >= 0)
 	{
-		//command on left of pipe
+		jobs[i].pgid = pgid;
+		jobs[i].done = false;
+		jobs[i].stopped = stopped;
+		snprintf(jobs[i].text, sizeof(jobs[i].text), "%s", text);
+	}
+	return i;
+}
 
-		int i = 0;
-		int left_token_count = 0;
-		char * modified_arg_list1[512];
+int split_pipeline(char * args[], int token_count, char ** stages[], char ** in_file, char ** out_file)
+{
+	/* Splits args in place into the commands of a pipeline and returns how many there are, or -1 on a syntax error.
+	   Each stage's argument list ends at the next "|", "<" or ">"; "<" is only allowed on the first stage and ">" on the last */
+	int stage_count = 0;
+	bool stage_open = false; //the current stage has its command
+	bool stage_ended = false; //a redirection ended the current stage's argument list
 
-		for(i = 0; i < token_count; i++)
+	*in_file = NULL;
+	*out_file = NULL;
+
+	int i;
+	for(i = 0; i < token_count; i++)
+	{
+		char * token = args[i];
+		if(strcmp(token, "|") == 0)
+		{
+			if(stage_open == false || *out_file != NULL)
+				break; //empty stage, or output redirected before the end
+			args[i] = NULL; //ends the argument list of the stage before it
+			stage_open = false;
+			stage_ended = false;
+		}
+		else if(strcmp(token, "<") == 0 || strcmp(token, ">") == 0)
 		{
-			
-			token = args[i];
-			if(strcmp(token, "|") == 0)
+			if(stage_open == false || i + 1 >= token_count)
+				break; //no command or no file
+			if(token[0] == '<' && (stage_count > 1 || *in_file != NULL))
+				break; //input can only be redirected on the first stage
+			if(token[0] == '<')
+				*in_file = args[i + 1];
+			else
+				*out_file = args[i + 1];
+			args[i] = NULL;
+			stage_ended = true;
+			i++; //skip the filename
+		}
+		else if(stage_open == false)
+		{
+			if(stage_count == MAX_STAGES)
 				break;
-			arg_list1[i] = token;
-			left_token_count++;
+			stages[stage_count++] = &args[i]; //first word of a new stage
+			stage_open = true;
 		}
-
-		if(redirect_input == true)
+		else if(stage_ended == true)
 		{
-			in_redirect(arg_list1, left_token_count, modified_arg_list1);
+			break; //words after a redirection
 		}
+	}
 
-		close(pipefd[0]);
-		dup2(pipefd[1], 1);
-		close(pipefd[1]);
-
-		if(redirect_input == true)
-			execvp(modified_arg_list1[0], modified_arg_list1);
-		else
-			execvp(arg_list1[0], arg_list1);
-	}else{
-		//command on right of pipee
+	if(i < token_count || stage_open == false)
+	{
+		fprintf(stderr, "myshell: syntax error in pipeline\n");
+		return -1;
+	}
 
+	args[token_count] = NULL; //ends the last stage
+	return stage_count;
+}
 
+void run_stage(char * argv[], int in, int out)
+{
+	/* Runs in a forked child: wires up stdin and stdout and execs the stage, or runs it if it is a builtin; never returns */
+	signal(SIGTTOU, SIG_DFL); //ignored signals stay ignored across exec
 
-		int i, right_token_count = 0;
-		bool second_half = false;
-		char * modified_arg_list2[512];
+	if(in != -1)
+		dup2(in, 0); //replace stdin with the previous pipe or the infile
+	if(out != -1)
+		dup2(out, 1); //replace stdout with the next pipe or the outfile
 
-		for(i = 0; i < token_count; i++)
-		{
-			token = args[i]; //each command
-			if(second_half == true){
-				arg_list2[right_token_count] = token;
-				right_token_count++;
-			}
-			if(strcmp(token, "|") == 0)
-				second_half = true;
-		}
+	const builtin * command = find_builtin(argv[0]);
+	if(command != NULL)
+	{
+		int status = command->run(argv);
+		fflush(stdout);
+		_exit(status);
+	}
 
-		close(pipefd[1]); //close the write fd for the pipe
-		dup2(pipefd[0], 0); //replace stdin with the read for the pipe
-		close(pipefd[0]); //close the read fd for the pip
+	execvp(argv[0], argv);
+	perror(argv[0]);
+	_exit(127); //a failed exec must not go back to reading commands
+}
 
-		if(redirect_output == true)
+pid_t launch_stage(char * argv[], int in, int out, pid_t pgid, int terminal, bool use_fork)
+{
+	/* Starts one stage with stdin on in and stdout on out (-1 keeps the shell's) in process group pgid (0 starts a new one),
+	   handing that group the terminal on fd terminal unless it is -1.
+	   posix_spawn runs the child in the shell's memory until it execs instead of copying the shell's page tables;
+	   fork stays for stages that have to run shell code before the exec. Returns the pid, or -1 */
+	if(use_fork == true)
+	{
+		pid_t pid = fork();
+		if(pid == 0)
 		{
-			out_redirect(arg_list2, right_token_count, modified_arg_list2);
+			//the child sets its group and takes the terminal itself too, so it never runs without them; SIGTTOU is still ignored
+			setpgid(0, pgid);
+			if(terminal != -1)
+				tcsetpgrp(terminal, getpgrp());
+			run_stage(argv, in, out);
 		}
+		if(pid < 0)
+			perror("fork");
+		return pid;
+	}
 
-		if(redirect_output == true)
-			execvp(modified_arg_list2[0], modified_arg_list2);
-		else
-			execvp(arg_list2[0], arg_list2);
+	//the pipe and file fds are close-on-exec, so the child keeps only what is dup'd onto 0 and 1
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35)
+	//the child takes the terminal before the dup2s replace fd 0, older glibcs leave it to the shell alone
+	if(terminal != -1)
+		posix_spawn_file_actions_addtcsetpgrp_np(&actions, terminal);
+#endif
+	if(in != -1)
+		posix_spawn_file_actions_adddup2(&actions, in, 0);
+	if(out != -1)
+		posix_spawn_file_actions_adddup2(&actions, out, 1);
+
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	sigset_t defaults; //the shell ignores SIGTTOU, the stage must not
+	sigemptyset(&defaults);
+	sigaddset(&defaults, SIGTTOU);
+	posix_spawnattr_setsigdefault(&attr, &defaults);
+	posix_spawnattr_setpgroup(&attr, pgid);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF);
+
+	pid_t pid;
+	int error = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+
+	if(error != 0)
+	{
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(error)); //same message as a failed execvp
+		return -1;
 	}
+	return pid;
 }
 
-int check_meta_chars(char * args[], int token_count)
+int run_pipeline(char * args[], int token_count, bool run_bg, int pipe_size, bool use_fork, const char * text)
 {
-	/* This function checks the args array token by token to see if any meta characters are found and then returns a number 0-7 accordingly */
-	bool p;
-	bool in;
-	bool out;
+	/* Runs every stage of the pipeline at once in a process group of its own, connected by N-1 pipes,
+	   and waits for the whole group unless it runs in the background, as job text. Returns the last stage's exit status */
+	char ** stages[MAX_STAGES];
+	char * in_file;
+	char * out_file;
+	int stage_count = split_pipeline(args, token_count, stages, &in_file, &out_file);
+	if(stage_count < 0)
+		return 2; //syntax error
+
+	//the shell opens the files itself, so a bad one is reported before anything runs
+	int in = -1, out = -1;
+	if(in_file != NULL && (in = open(in_file, O_RDONLY | O_CLOEXEC)) < 0)
+	{
+		perror(in_file);
+		return 1;
+	}
+	if(out_file != NULL && (out = open(out_file, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, S_IRUSR | S_IRGRP | S_IWGRP | S_IWUSR)) < 0)
+	{
+		perror(out_file);
+		if(in != -1)
+			close(in);
+		return 1;
+	}
 
-	int i = 0;
-	for(i = 0; i < token_count; i++)
+	//a background job the table has no room for would never be reaped, so it is not started
+	if(run_bg == true && job_slot() < 0)
 	{
-		if(strcmp(args[i], "|") == 0)
+		fprintf(stderr, "myshell: too many jobs\n");
+		if(in != -1)
+			close(in);
+		if(out != -1)
+			close(out);
+		return 1;
+	}
+
+	//a lone builtin in the foreground runs in the shell itself, without a fork or an exec
+	const builtin * command = find_builtin(stages[0][0]);
+	if(stage_count == 1 && command != NULL && run_bg == false)
+	{
+		int status = run_builtin(command, stages[0], in, out);
+		if(in != -1)
+			close(in);
+		if(out != -1)
+			close(out);
+		return status;
+	}
+
+	pid_t pgid = 0; //the first stage's pid names the group
+	pid_t last = 0; //pid of the last stage
+	int previous = in; //read end of the pipe into the next stage
+	//a foreground group gets the terminal from its first stage on, so ^C reaches every stage and none of them is
+	//stopped for reading it
+	int terminal_fd = run_bg == false && isatty(0) ? 0 : -1;
+	bool terminal = false;
+
+	int i;
+	for(i = 0; i < stage_count; i++)
+	{
+		int pipefd[2] = {-1, out};
+		if(i < stage_count - 1)
 		{
-			p = true; //piping character found
+			if(pipe2(pipefd, O_CLOEXEC) < 0)
+			{
+				perror("pipe");
+				break;
+			}
+			if(pipe_size > 0)
+				fcntl(pipefd[1], F_SETPIPE_SZ, pipe_size); //big pipes mean fewer context switches per byte
 		}
-		if(strcmp(args[i], "<") == 0)
+
+		//a stage that fails to start leaves its neighbours EOF and EPIPE, like one that exits at once;
+		//a builtin in a pipeline runs in a forked copy of the shell
+		bool builtin_stage = find_builtin(stages[i][0]) != NULL;
+		pid_t pid = launch_stage(stages[i], previous, pipefd[1], pgid, terminal_fd, use_fork || builtin_stage);
+		if(pid > 0)
 		{
-			in = true; //input redirection character found
+			if(pgid == 0)
+				pgid = pid;
+			setpgid(pid, pgid); //both sides set the group and the terminal, so they hold whichever of them runs first
+			if(terminal_fd != -1 && terminal == false)
+				terminal = tcsetpgrp(terminal_fd, pgid) == 0;
+			if(i == stage_count - 1)
+				last = pid;
 		}
-		if(strcmp(args[i], ">") == 0)
+
+		//the shell keeps no pipe ends, so every reader sees EOF once its writer exits
+		if(previous != -1)
+			close(previous);
+		if(pipefd[1] != -1)
+			close(pipefd[1]);
+		previous = pipefd[0];
+	}
+	if(previous != -1)
+		close(previous);
+	if(i < stage_count && out != -1)
+		close(out);
+
+	if(pgid == 0)
+		return 127;
+
+	if(run_bg == true)
+	{
+		//collected by reap_jobs before each prompt, the slot was checked for before anything was started
+		int slot = add_job(pgid, text, false);
+		if(slot >= 0 && isatty(0))
+			printf("[%d] %d\n", slot + 1, pgid);
+		return 0;
+	}
+
+	int status;
+	int last_stage_status = last == 0 ? 127 << 8 : 0; //as if the last stage had failed its exec
+	int stopped = -1; //job slot of a pipeline that was stopped
+	pid_t pid;
+	while((pid = waitpid(-pgid, &status, WUNTRACED)) > 0 || (pid < 0 && errno == EINTR))
+	{
+		//a stopped stage makes the pipeline a stopped job and the shell reads commands again;
+		//with no free slot to keep it in it is continued instead
+		if(pid > 0 && WIFSTOPPED(status))
 		{
-			out = true; //output redirection character found
-		}		
-	}
-
-	if(p == 0 && in == 0 && out == 0){
-		return 0; //neither of the three
-	} else if (p == 0 && in == 1 && out == 0) {
-		return 1; //input redirection
-	} else if (p == 0 && in == 0 && out == 1) {
-		return 2; //output redirection
-	} else if (p == 1 && in == 0 && out == 0) {
-		return 3; //piping
-	} else if (p == 0 && in == 1 && out == 1) {
-		return 4; //input and output redirection
-	} else if (p == 1 && in == 1 && out == 0) {
-		return 5; //piping and input redirection
-	} else if (p == 1 && in == 0 && out == 1) {
-		return 6; //piping and output redirection
-	} else if (p == 1 && in == 1 && out == 1) {
-		return 7; //all three
+			stopped = add_job(pgid, text, true);
+			if(stopped >= 0)
+			{
+				last_stage_status = status;
+				break;
+			}
+			kill(-pgid, SIGCONT);
+		}
+		else if(pid == last)
+			last_stage_status = status;
+	}
+
+	if(terminal == true)
+		tcsetpgrp(0, getpgrp());
+	if(stopped >= 0)
+	{
+		if(isatty(0))
+			printf("\n[%d] Stopped\t%s\n", stopped + 1, text);
+		return 128 + WSTOPSIG(last_stage_status);
 	}
+	return WIFEXITED(last_stage_status) ? WEXITSTATUS(last_stage_status) : 128 + WTERMSIG(last_stage_status);
 }
 
 int read_command(char * command, bool print_prompt)
@@ -287,6 +641,7 @@ int read_command(char * command, bool print_prompt)
 	}
 
 	strcpy(command, input); //copy the modified input string into the command string
+	return 0;
 }
 
 int parse_command(char * input, char * args[], bool * run_bg)
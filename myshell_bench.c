@@ -0,0 +1,158 @@
+//benchmarks for myshell, driving a running shell through its stdin the way a script would:
+//
+//	gcc -O2 -o myshell myshell.c
+//	gcc -O2 -o myshell_bench myshell_bench.c
+//
+//	./myshell_bench [shell, ./myshell by default] [bytes per pipeline] > shell.json
+//
+//every result is printed as one JSON object per line, like threads_bench.c,
+//{"bench":"pipeline","stages":4,"pipe_size":0,"launch":"spawn","value":2100000000,"unit":"bytes_per_s"}
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+//data pushed through each pipeline, the second argument overrides it
+#define PIPELINE_BYTES (1L << 30)
+//pipe sizes the shell is started with, 0 keeps the kernel default
+#define PIPE_SIZES 2
+const int pipe_sizes[PIPE_SIZES] = {0, 1 << 20};
+//short commands run back to back in the launch benchmark
+#define COMMANDS 5000
+
+//a shell started with its stdin and stdout on pipes to us
+typedef struct
+{
+	pid_t pid;
+	FILE* in;
+	FILE* out;
+}shell;
+
+uint64_t now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void report(const char* bench, int stages, int pipe_size, int use_fork, double value, const char* unit)
+{
+	printf("{\"bench\":\"%s\",\"stages\":%d,\"pipe_size\":%d,\"launch\":\"%s\",\"value\":%.2f,\"unit\":\"%s\"}\n",
+			bench, stages, pipe_size, use_fork ? "fork" : "spawn", value, unit);
+	fflush(stdout);
+}
+
+//use_fork starts the shell with -f, so it launches commands with fork instead of posix_spawn
+int shell_start(shell* sh, const char* path, int pipe_size, int use_fork)
+{
+	int to_shell[2], from_shell[2];
+	if(pipe(to_shell) < 0 || pipe(from_shell) < 0)
+		return -1;
+
+	sh->pid = fork();
+	if(sh->pid == 0)
+	{
+		dup2(to_shell[0], 0);
+		dup2(from_shell[1], 1);
+		close(to_shell[0]);
+		close(to_shell[1]);
+		close(from_shell[0]);
+		close(from_shell[1]);
+
+		char size[32];
+		snprintf(size, sizeof(size), "%d", pipe_size);
+		execl(path, path, "-n", "-p", size, use_fork ? "-f" : (char*) NULL, (char*) NULL);
+		_exit(127);
+	}
+	close(to_shell[0]);
+	close(from_shell[1]);
+	if(sh->pid < 0)
+		return -1;
+
+	sh->in = fdopen(to_shell[1], "w");
+	sh->out = fdopen(from_shell[0], "r");
+	return 0;
+}
+
+void shell_stop(shell* sh)
+{
+	//the shell exits at the end of its input
+	fclose(sh->in);
+	fclose(sh->out);
+	waitpid(sh->pid, NULL, 0);
+}
+
+//runs one command line and waits for the first line it prints, returns the nanoseconds it took or 0 on failure
+uint64_t shell_run(shell* sh, const char* command, char* line, size_t size)
+{
+	uint64_t start = now();
+	fprintf(sh->in, "%s\n", command);
+	fflush(sh->in);
+	if(fgets(line, size, sh->out) == NULL)
+		return 0;
+	return now() - start;
+}
+
+//throughput: zeros from head, through stages - 2 cats, counted by wc
+void bench_pipeline(const char* path, int stages, int pipe_size, long bytes)
+{
+	char command[512];
+	int length = snprintf(command, sizeof(command), "head -c %ld /dev/zero", bytes);
+	int i;
+	for(i = 0; i < stages - 2; i++)
+		length += snprintf(command + length, sizeof(command) - length, " | cat");
+	snprintf(command + length, sizeof(command) - length, " | wc -c");
+
+	shell sh;
+	if(shell_start(&sh, path, pipe_size, 0) < 0)
+		return;
+	char line[64];
+	uint64_t elapsed = shell_run(&sh, command, line, sizeof(line));
+	shell_stop(&sh);
+
+	if(elapsed > 0 && atol(line) == bytes)
+		report("pipeline", stages, pipe_size, 0, bytes * 1e9 / elapsed, "bytes_per_s");
+}
+
+//launch rate: COMMANDS runs of command, then an echo to know when they are all done
+void bench_commands(const char* bench, const char* path, const char* command, int use_fork)
+{
+	shell sh;
+	if(shell_start(&sh, path, 0, use_fork) < 0)
+		return;
+
+	uint64_t start = now();
+	int i;
+	for(i = 0; i < COMMANDS; i++)
+		fprintf(sh.in, "%s\n", command);
+	char line[64];
+	uint64_t elapsed = shell_run(&sh, "echo done", line, sizeof(line));
+	if(elapsed > 0)
+		elapsed = now() - start;
+	shell_stop(&sh);
+
+	if(elapsed > 0 && strcmp(line, "done\n") == 0)
+		report(bench, 1, 0, use_fork, COMMANDS * 1e9 / elapsed, "commands_per_s");
+}
+
+int main(int argc, char** argv)
+{
+	const char* path = argc > 1 ? argv[1] : "./myshell";
+	long bytes = argc > 2 ? atol(argv[2]) : PIPELINE_BYTES;
+
+	bench_commands("commands", path, "true", 0);
+	bench_commands("commands", path, "true", 1);
+	//builtins run in the shell, however it launches commands
+	bench_commands("builtins", path, "cd /", 0);
+
+	int stages, size;
+	for(size = 0; size < PIPE_SIZES; size++)
+		for(stages = 2; stages <= 8; stages *= 2)
+			bench_pipeline(path, stages, pipe_sizes[size], bytes);
+	return 0;
+}
@@ -0,0 +1,167 @@
+//behaviour tests for myshell, each one a script fed to a fresh shell on its stdin:
+//
+//	gcc -O2 -o myshell myshell.c
+//	gcc -O2 -o myshell_test myshell_test.c
+//
+//	./myshell_test [shell, ./myshell by default]
+//
+//every script runs once with commands launched by posix_spawn and once with -f, by fork; a line is printed
+//per run and the exit status is the number of failures
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+//seconds a script gets before the shell is killed as hung
+#define TEST_TIMEOUT 20
+//a command that stops itself, written out by main
+#define STOP_COMMAND "/tmp/myshell_test_stop"
+//as many background jobs as the shell's job table holds
+#define SLEEP_8 "sleep 1 &\nsleep 1 &\nsleep 1 &\nsleep 1 &\nsleep 1 &\nsleep 1 &\nsleep 1 &\nsleep 1 &\n"
+#define SLEEP_64 SLEEP_8 SLEEP_8 SLEEP_8 SLEEP_8 SLEEP_8 SLEEP_8 SLEEP_8 SLEEP_8
+
+typedef struct
+{
+	const char* name;
+	//command lines, one per line
+	const char* script;
+	//everything the shell and its commands print on stdout
+	const char* output;
+	//the shell's exit status
+	int status;
+	//the script is typed on a terminal that is the shell's stdin and controlling terminal, not read from a file
+	int terminal;
+} test;
+
+const test tests[] = {
+	{"command", "echo hello\n", "hello\n", 0},
+	{"exit_status", "false\n", "", 1},
+	{"exit", "exit 3\necho not reached\n", "", 3},
+	{"not_found", "no_such_command_here\necho after\n", "after\n", 0},
+	{"cd_pwd", "cd /tmp\npwd\ncd /\npwd\n", "/tmp\n/\n", 0},
+	{"cd_env", "cd /usr\nprintenv PWD\n", "/usr\n", 0},
+	{"export", "export MYSHELL_TEST=exported\nprintenv MYSHELL_TEST\n", "exported\n", 0},
+	{"pipeline", "seq 1 100 | grep 7 | wc -l\n", "19\n", 0},
+	{"long_pipeline", "seq 1 1000 | cat | cat | cat | cat | cat | cat | tail -n 1\n", "1000\n", 0},
+	{"pipeline_status", "true | false\n", "", 1},
+	{"builtin_in_pipeline", "cd /tmp\npwd | cat\n", "/tmp\n", 0},
+	{"builtin_redirect", "pwd > /tmp/myshell_test_out\ncat < /tmp/myshell_test_out\n", "/\n", 0},
+	{"redirect", "seq 1 3 > /tmp/myshell_test_out\ncat < /tmp/myshell_test_out | wc -l\n", "3\n", 0},
+	{"syntax_error", "echo a |\necho b\n", "b\n", 0},
+	{"background_wait", "sleep 0.1 &\nwait\necho waited\n", "waited\n", 0},
+	{"jobs", "true &\nwait\njobs\nsleep 1 &\njobs\n", "[1] Running\tsleep 1 &\n", 0},
+	{"full_job_table", SLEEP_64 "echo not started &\njobs | wc -l\nwait\ntrue &\nwait\necho started\n", "64\nstarted\n", 0},
+	{"stopped_job", STOP_COMMAND "\nwait\necho after\njobs\n", "after\n[1] Stopped\t" STOP_COMMAND "\n", 0},
+	{"terminal_read", "head -n 1\nfrom the terminal\nexit 0\n", "from the terminal\n", 0, 1},
+};
+
+//runs script in a shell, with -f when use_fork, and checks what it printed and its exit status; returns 1 on a failure
+int run_test(const char* path, const test* t, int use_fork)
+{
+	//the script goes in a file, or is typed ahead on a pseudo-terminal that waits for the shell to read it
+	int script;
+	if(t->terminal)
+	{
+		script = posix_openpt(O_RDWR | O_NOCTTY);
+		if(script < 0 || grantpt(script) < 0 || unlockpt(script) < 0 || write(script, t->script, strlen(t->script)) < 0)
+			return 1;
+	}
+	else
+	{
+		char script_path[] = "/tmp/myshell_test_XXXXXX";
+		script = mkstemp(script_path);
+		if(script < 0 || write(script, t->script, strlen(t->script)) < 0)
+			return 1;
+		lseek(script, 0, SEEK_SET);
+		unlink(script_path);
+	}
+
+	int from_shell[2];
+	if(pipe(from_shell) < 0)
+		return 1;
+	pid_t pid = fork();
+	if(pid == 0)
+	{
+		//a new session, whose controlling terminal the pseudo-terminal becomes as it is opened
+		if(t->terminal)
+		{
+			setsid();
+			int terminal = open(ptsname(script), O_RDWR);
+			if(terminal < 0)
+				_exit(127);
+			close(script);
+			script = terminal;
+		}
+		dup2(script, 0);
+		dup2(from_shell[1], 1);
+		close(from_shell[0]);
+		close(from_shell[1]);
+		//the shell starts out in /, so the scripts know where they are
+		if(chdir("/") < 0)
+			_exit(127);
+		alarm(TEST_TIMEOUT);
+		execl(path, path, "-n", use_fork ? "-f" : (char*) NULL, (char*) NULL);
+		_exit(127);
+	}
+	//closing the pseudo-terminal's master end would hang up the shell's terminal, so that waits until it is done
+	if(!t->terminal)
+		close(script);
+	close(from_shell[1]);
+
+	//a background job left running holds the pipe open until it exits too
+	char output[4096];
+	size_t length = 0;
+	ssize_t done;
+	while(length < sizeof(output) - 1 && (done = read(from_shell[0], output + length, sizeof(output) - 1 - length)) > 0)
+		length += done;
+	output[length] = '\0';
+	close(from_shell[0]);
+	int status;
+	waitpid(pid, &status, 0);
+	if(t->terminal)
+		close(script);
+
+	int exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+	int failed = strcmp(output, t->output) != 0 || exit_status != t->status;
+	if(failed)
+		printf("FAIL %s, %s: exit status %d, output \"%s\"\n", t->name, use_fork ? "fork" : "spawn", exit_status, output);
+	else
+		printf("ok %s, %s\n", t->name, use_fork ? "fork" : "spawn");
+	fflush(stdout);
+	return failed;
+}
+
+int main(int argc, char** argv)
+{
+	const char* path = argc > 1 ? argv[1] : "./myshell";
+	char shell[4096];
+	//the shell runs from /, so a relative path has to be made absolute first
+	if(realpath(path, shell) == NULL)
+	{
+		perror(path);
+		return 1;
+	}
+
+	FILE* stop = fopen(STOP_COMMAND, "w");
+	if(stop == NULL || fprintf(stop, "#!/bin/sh\nkill -STOP $$\n") < 0 || fclose(stop) != 0 || chmod(STOP_COMMAND, 0755) < 0)
+	{
+		perror(STOP_COMMAND);
+		return 1;
+	}
+
+	int failed = 0;
+	unsigned int i;
+	int use_fork;
+	for(use_fork = 0; use_fork <= 1; use_fork++)
+		for(i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+			failed += run_test(shell, &tests[i], use_fork);
+	unlink(STOP_COMMAND);
+	printf("%s, %d failures\n", failed == 0 ? "passed" : "FAILED", failed);
+	return failed;
+}
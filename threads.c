@@ -1,20 +1,56 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <pthread.h>
-#include <setjmp.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <semaphore.h>
+#include <stdint.h>
+#include <time.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <netdb.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <linux/futex.h>
 
-#define JB_BX 0
-#define JB_SI 1
-#define JB_DI 2
-#define JB_BP 3
-#define JB_SP 4
-#define JB_PC 5
+#include "threads.h"
 
-#define MAX_THREADS 128
-#define STACK_SIZE 32767
+//libc declares __errno_location const, so a function that calls it twice may reuse the first address after a
+//switch has moved the thread to another carrier, whose kernel thread has its own errno; in here every access
+//looks the address up again
+int* errno_location() __attribute__((noinline));
+#undef errno
+#define errno (*errno_location())
+
+//a pthread_t holds the thread's slot in its low SLOT_BITS bits and the slot's generation above them
+#define SLOT_BITS 20
+#define MAX_THREADS (1 << SLOT_BITS)
+//the tcb slab grows a chunk at a time so tcb addresses never move
+#define SLAB_CHUNK 1024
+//default stack size, pthread_attr_setstacksize overrides it per thread
+#define STACK_SIZE 32768
+
+//distinct stack sizes the pool keeps free lists for, and how many stacks each list holds
+#define STACK_CLASSES 8
+#define STACK_POOL_MAX 256
+//new stacks of a pooled size are carved out of mappings this large, as many as fit, each with a guard page below it
+#define STACK_CHUNK_BYTES (4 << 20)
+
+//guard regions fault like PROT_NONE pages without splitting the mapping, from Linux 6.13
+#ifndef MADV_GUARD_INSTALL
+#define MADV_GUARD_INSTALL 102
+#endif
 
 #define RUNNING 1
 #define READY 2
@@ -23,516 +59,5154 @@
 
 #define THREAD_CNT 5
 
+//default time slice, 50ms
+#define QUANTUM 50000000L
+//shortest slice accepted, below it the carrier spends its time taking SIGALRM instead of running threads
+#define QUANTUM_MIN 100000L
+
+//number of run queue priority levels, must fit in the bits of ready_bitmap, level 0 is unused
+//since SCHED_OTHER threads are ordered by virtual runtime instead
+#define PRIORITY_LEVELS 32
+#define DEFAULT_PRIORITY 0
+//SCHED_FIFO and SCHED_RR priorities, spread over levels 1 to PRIORITY_LEVELS - 1
+#define RT_PRIORITY_MIN 1
+#define RT_PRIORITY_MAX 99
+
+//virtual runtime advances by run time * FAIR_WEIGHT / weight, SCHED_IDLE threads weigh IDLE_WEIGHT
+#define FAIR_WEIGHT 1024
+#define IDLE_WEIGHT 3
+
+//pthread_key_t values kept in the tcb itself, the rest of the PTHREAD_KEYS_MAX keys live in an array
+//allocated the first time the thread sets one of them
+#define KEYS_INLINE 32
+
+//tasks each pool worker's deque holds, a spawn into a full one runs the task right away
+#define TASK_DEQUE_SIZE 1024
+//stack of a pool worker, larger than the thread default since tasks wait for their subtasks on it
+#define TASK_STACK_SIZE (256 * 1024)
+//tasks a worker runs nested on its stack, each one waiting for its subtasks; past it a spawn runs the task inline
+#define TASK_HELP_DEPTH 8
+//chunks per worker parallel_for and parallel_reduce split a range into when no grain is given
+#define TASK_CHUNKS_PER_WORKER 8
+
+//malloc serves sizes up to ALLOC_SMALL_MAX from size class caches kept per kernel thread, larger ones come from glibc
+#define ALLOC_SMALL_MAX 1024
+#define ALLOC_CLASSES 12
+//objects a cache takes from or gives back to the shared lists at a time, it gives back once it holds two batches
+#define ALLOC_BATCH 32
+//address space reserved for small objects, and the slabs it is committed in, one size class to a slab;
+//a 32-bit address space only has room for a fraction of it
+#if UINTPTR_MAX > 0xffffffffu
+#define ALLOC_REGION ((size_t) 4 << 30)
+#else
+#define ALLOC_REGION ((size_t) 256 << 20)
+#endif
+#define ALLOC_SLAB (256 * 1024)
+
+//kernel threads that green threads can be spread over, see pthread_setconcurrency
+#define MAX_CARRIERS 64
+
+//scheduler tracing: compiled out with -DTRACE=0, switched on at runtime with THREADS_TRACE=<file>
+#ifndef TRACE
+#define TRACE 1
+#endif
+//events kept per carrier, the oldest are overwritten once the ring is full
+#define TRACE_EVENTS 65536
+
+#define TRACE_SWITCH 1
+#define TRACE_BLOCK 2
+#define TRACE_WAKE 3
+#define TRACE_CREATE 4
+#define TRACE_EXIT 5
+#define TRACE_SEM_WAIT 6
+#define TRACE_SEM_POST 7
+
+//thread id recorded for a carrier's idle loop
+#define TRACE_IDLE UINT64_MAX
+
+#define trace(type, thread, arg) do { if(TRACE && trace_enabled) trace_record(type, thread, (uint64_t) (arg)); } while(0)
+
+//how the wrapped I/O calls treat a file descriptor, decided the first time one of them sees it
+#define FD_UNKNOWN 0
+//switched to O_NONBLOCK and registered with the reactor, calls that would block park the thread
+#define FD_GREEN 1
+//already O_NONBLOCK in the application, so EAGAIN is passed through
+#define FD_NONBLOCKING 2
+//epoll cannot watch it (the standard streams), calls that would block go to the offload pool
+#define FD_PLAIN 3
+//regular files and directories, reads the page cache can't answer go to the offload pool
+#define FD_FILE 4
+
+//kernel threads that make the blocking calls green threads hand off
+#define OFFLOAD_THREADS 4
+
+//the task and offload pools start on first use
+#define POOL_STOPPED 0
+#define POOL_STARTING 1
+#define POOL_RUNNING 2
+#define POOL_FAILED 3
+
+//events taken from epoll per call
+#define IO_EVENTS 64
+
+//timing wheel tick of 2^20ns (about 1ms), and WHEEL_LEVELS rings of 2^WHEEL_BITS slots,
+//each level's slots as wide as the whole ring below it, about 4.9 hours in all
+#define WHEEL_TICK_SHIFT 20
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+
+//times a contended mutex is retried before parking, only when another carrier could release it
+#define MUTEX_SPINS 100
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() asm volatile("yield")
+#else
+#define cpu_relax() do {} while(0)
+#endif
+
+typedef struct tcb tcb;
+typedef struct carrier carrier;
+typedef struct thread_queue thread_queue;
+
 void * change(void * ret);
+void ready_enqueue(tcb* thread);
+int ready_splice(thread_queue* waiters);
+void queue_push(thread_queue* queue, tcb* thread);
+tcb* queue_pop(thread_queue* queue);
 void schedule();
+int outranks(tcb* thread, tcb* running);
 void timer();
-void choose_next_thread();
-static int ptr_demangle(int p);
-static int ptr_mangle(int p);
+void timer_start(carrier* self);
+void timer_arm(carrier* self);
+void timer_advance(carrier* self, uint64_t at);
+void timer_disarm(carrier* self);
+int join(pthread_t thread, void ** retval, const struct timespec* abstime);
+int timeout_start(tcb* self, const struct timespec* time, clockid_t clock, int absolute);
+tcb* choose_next_thread(carrier* self);
+void context_switch(void** save_sp, void* load_sp);
+void* initial_frame(void* stack, size_t size, void (*entry)());
+void thread_start();
+void carrier_idle();
+void runtime_init();
+carrier* this_carrier() __attribute__((noinline));
+tcb* current_tcb();
+tcb* foreign_tcb();
+void lock();
+void unlock();
+void runtime_acquire();
+void runtime_drop();
+carrier* runtime_release();
+void spin_acquire(int* flag);
+int spin_try(int* flag);
+void spin_release(int* flag);
+int reschedule(carrier* self, int handoff);
+tcb* preempt_disable();
+void preempt_enable(tcb* self);
+void preempt(carrier* self, int in_handler);
+void trace_record(int type, tcb* thread, uint64_t arg);
+void histogram_add(uint64_t* histogram, uint64_t ns);
+uint64_t trace_id(tcb* thread);
+int reactor_poll(int block);
+void reactor_watch(uint64_t deadline);
+void reactor_kick();
+void run_lock_all();
+void run_unlock_all();
+ssize_t io_blocking(long number, int fd, int writing, void* buf, size_t count, long flags, long address, long length, int mode);
+long offload_syscall(long number, long a, long b, long c, long d, long e, long f);
+void offload_complete();
+void stdio_start();
+int kernel_thread_start(void* (*start_routine)(void*), void* arg);
+void wheel_remove(tcb* thread);
+void timeout_cancel(tcb* thread);
+void wheel_expire();
+uint64_t wheel_next();
+uint64_t wheel_clock();
+uint64_t clock_now();
 void pthread_exit(void *retval);
+void key_destroy_all(tcb* self);
 int pthread_create(pthread_t *thread,
 		const pthread_attr_t *attr,
                 void *(*start_routine)
 		(void *), void *arg);
 
-typedef struct tcb tcb;
-
 struct tcb
 {
 	pthread_t id;
-	jmp_buf registers;
+	//stack pointer saved by context_switch while the thread is switched out
+	void* sp;
+	//errno while the thread is switched out; it lives in the TLS of the carrier's kernel thread while it runs,
+	//so it is carried over when the thread resumes on another carrier, or after others ran on this one
+	int saved_errno;
+	//usable stack memory, above a guard page, and its size
 	void * stack;
+	size_t stack_size;
 	int status;
 	tcb* waiting_on_me;
 	int initialized;
+	//slot in the tcb slab, and how many times the slot has been reused
 	int index;
+	unsigned int generation;
+	//set by pthread_detach or the attr, the slot is reclaimed on exit instead of on join
+	int detached;
 	void* retval;
+	//mutex a pthread_cond_wait caller gets back when it is woken
+	struct mutex* wait_mutex;
+	//pending timeout: deadline in wheel ticks, the wheel slot holding the thread and its links there
+	uint64_t deadline;
+	tcb** timer_slot;
+	tcb* next_timer;
+	tcb* prev_timer;
+	//set when the timeout fired before the thread was woken
+	int timed_out;
+	//during a timed wait, the wait queue or the joined thread the timeout has to take the thread off
+	thread_queue* wait_queue;
+	tcb* join_target;
+	//during a blocking channel_select, the thread's parked cases and the one that completed
+	struct channel_waiter* select_waiters;
+	int select_count;
+	struct channel_waiter* select_fired;
+	//entry point and argument, picked up by thread_start on the first switch in
+	void *(*start_routine)(void *);
+	void* arg;
+	//scheduling policy and priority as set through pthread_setschedparam
+	int policy;
+	int sched_priority;
+	//run queue level of a SCHED_FIFO or SCHED_RR thread
+	int priority;
+	//weighted nanoseconds a fair thread has run, and when it was last switched in
+	uint64_t vruntime;
+	uint64_t run_start;
+	//counters read by pthread_getstats_np, and when the thread last became READY or BLOCKED
+	thread_stats stats;
+	uint64_t state_since;
+	//the links chain the thread into the one queue it is on: a run queue while READY, a wait queue
+	//while BLOCKED and the free slot list while unused; in the fair heap they are the sibling links
+	tcb* next_ready;
+	tcb* prev_ready;
+	//first child while the thread is in the fair heap
+	tcb* heap_child;
+	//index + 1 of the pool worker the thread is, 0 for every other thread
+	int task_worker;
+	//pool tasks running nested on the thread's stack
+	int task_depth;
+	//nesting depth of lock() and preempt_disable() on this thread, ticks only set preempt_pending while it is
+	//non-zero; kept per thread rather than per carrier because only the thread itself ever changes it, so a
+	//tick that moves the thread between reading its carrier and the increment can't split the count
+	volatile int preempt_disabled;
+	//carrier whose run queue holds the thread while it is READY
+	carrier* owner;
+	//set when the tick handler preempted the thread, until it runs again: the code it was interrupted in may hold
+	//the address of its carrier's errno, so it is not stolen by another carrier meanwhile
+	int pinned;
+	//pthread_setspecific values, keys below KEYS_INLINE first
+	void* specific[KEYS_INLINE];
+	void** specific_more;
+};
+
+struct thread_queue
+{
+	tcb* head;
+	tcb* tail;
+};
+
+//one fixed-size binary trace record, written into the running carrier's ring
+typedef struct
+{
+	//nanoseconds on CLOCK_MONOTONIC
+	uint64_t time;
+	//thread the event is about
+	uint64_t thread;
+	//event specific: previous thread for a switch, creator for a create, object address for semaphore ops
+	uint64_t arg;
+	int type;
+}trace_event;
+
+typedef struct
+{
+	//usable size of every stack on this free list, 0 while the class is unused
+	size_t size;
+	//free stacks are chained through their first word
+	void* head;
+	int count;
+	//the part of the last chunk mapped for this size that no stack was carved from yet, and how many still fit
+	char* chunk;
+	long chunk_left;
+}stack_class;
+
+struct carrier
+{
+	int index;
+	//guards the run queue below, current and previous; taken with preemption disabled, after the runtime lock when
+	//both are held, and held across a switch until finish_switch on the thread switched to drops it
+	int lock;
+	//set while the thread switching out holds the runtime lock as well, finish_switch drops that too
+	int handoff;
+	//kernel thread id, target of the carrier's preemption timer
+	pid_t tid;
+	//POSIX timer that preempts this carrier, only armed while a thread is queued behind the running one
+	timer_t timer;
+	int timer_armed;
+	//green thread running on this carrier
+	tcb* current;
+	//thread switched away from, cleaned up by finish_switch once we are off its stack
+	tcb* previous;
+	//context of the carrier's idle loop, switched to when nothing is READY
+	tcb idle;
+	//local run queue, one FIFO of READY real-time threads per priority level
+	thread_queue ready_queues[PRIORITY_LEVELS];
+	//bit i is set while ready_queues[i] is non-empty
+	unsigned int ready_bitmap;
+	//pairing heap of READY fair threads, smallest virtual runtime at the root, which only runs
+	//when no real-time thread is READY
+	tcb* fair_heap;
+	//virtual runtime the carrier has reached, woken and stolen threads are placed relative to it
+	uint64_t min_vruntime;
+	//number of READY threads queued here, used to pick a victim to steal from
+	int ready_count;
+	//set by a tick that came while the running thread had preemption disabled
+	volatile int preempt_pending;
+	//trace ring, only allocated while tracing, and the count of events ever written to it
+	trace_event* trace_ring;
+	uint64_t trace_head;
 };
 
+//the semaphore lives inside the caller's sem_t, so there is no table to search or fill up
 typedef struct
 {
-	int id;
 	int value;
-	int initialized;
-	int num_waiting;
-	tcb* waiting_threads[128];
+	//threads blocked in sem_wait, oldest first
+	thread_queue waiting;
 }semaphore;
 
+_Static_assert(sizeof(semaphore) <= sizeof(sem_t), "semaphore must fit in sem_t");
+
+//mutexes and condition variables live inside the pthread types the same way,
+//and the all-zero static initializers are valid unlocked/empty states
+typedef struct mutex
+{
+	//0 unlocked, 1 locked, 2 locked and threads may be queued in waiting
+	int locked;
+	//PTHREAD_MUTEX_NORMAL, RECURSIVE or ERRORCHECK from the mutexattr
+	int type;
+	//owner and lock depth, only tracked for recursive and errorcheck mutexes
+	int count;
+	tcb* owner;
+	//threads parked on the mutex, oldest first
+	thread_queue waiting;
+}mutex;
+
+typedef struct
+{
+	//threads blocked in pthread_cond_wait, oldest first
+	thread_queue waiting;
+	//timed waiters that may still be queued here, a broadcast only looks for their wheel entries when there are any
+	int timed;
+	//clock pthread_cond_timedwait deadlines are measured on, from the condattr
+	clockid_t clock;
+}condition;
+
+typedef struct
+{
+	//readers holding the lock, or the writer holding it
+	int readers;
+	tcb* writer;
+	//threads parked for reading and for writing, oldest first; a queued writer holds new readers back
+	thread_queue read_waiting;
+	thread_queue write_waiting;
+}rwlock;
+
+typedef struct
+{
+	//threads that have to arrive before any is let go, and how many of this round have
+	unsigned int count;
+	unsigned int arrived;
+	thread_queue waiting;
+}barrier;
+
+_Static_assert(sizeof(rwlock) <= sizeof(pthread_rwlock_t), "rwlock must fit in pthread_rwlock_t");
+_Static_assert(sizeof(barrier) <= sizeof(pthread_barrier_t), "barrier must fit in pthread_barrier_t");
+
+//a task_group, inside the caller's task_group like the semaphore inside sem_t
+typedef struct
+{
+	//tasks spawned into the group that have not finished, it only drops to 0 under lock()
+	long pending;
+	//threads in task_wait with nothing left to help with
+	thread_queue waiting;
+}group;
+
+_Static_assert(sizeof(group) <= sizeof(task_group), "group must fit in task_group");
+
+//a spawned task, copied by value through the deques so spawning allocates nothing
+typedef struct
+{
+	void (*fn)(void*);
+	void* arg;
+	group* owner;
+}task;
+
+//one per pool worker: the worker pushes and pops at the bottom, thieves take the oldest from the top, and
+//threads outside the pool push at the top so their tasks never sit between a worker's nested ones;
+//top can go below 0, the ring is indexed unsigned
+typedef struct
+{
+	//spinlock taken with preemption disabled, so a holder is never switched out
+	int lock;
+	long top;
+	long bottom;
+	task ring[TASK_DEQUE_SIZE];
+}task_deque;
+
+//free objects of one size class, linked through their first word
+typedef struct
+{
+	void* head;
+	int count;
+}alloc_cache;
+
+//one case of a thread parked in channel_select, on the thread's stack and linked into the
+//channel's senders or receivers; a thread in a select is parked on every channel at once
+typedef struct channel_waiter
+{
+	tcb* thread;
+	channel* ch;
+	int op;
+	//index of the case in the select, and its result once it completed
+	int index;
+	int result;
+	//value a sender reads from or a receiver writes to, owned by the parked thread
+	void* value;
+	struct channel_waiter* next;
+	struct channel_waiter* prev;
+}channel_waiter;
+
+typedef struct
+{
+	channel_waiter* head;
+	channel_waiter* tail;
+}waiter_queue;
+
+struct channel
+{
+	size_t elem_size;
+	size_t capacity;
+	//ring of capacity values, count of them filled from head on
+	char* buffer;
+	size_t head;
+	size_t count;
+	int closed;
+	//parked senders and receivers, oldest first; receivers only park on an empty buffer
+	//and senders only on a full one
+	waiter_queue senders;
+	waiter_queue receivers;
+};
+
+//a call handed to the offload pool, on the stack of the thread parked until it is done
+typedef struct offload_request
+{
+	long (*call)(struct offload_request* request);
+	long args[7];
+	long result;
+	int error;
+	tcb* thread;
+	struct offload_request* next;
+}offload_request;
+
+//what the reactor knows about a file descriptor
+typedef struct
+{
+	int mode;
+	//threads parked until the fd is readable or writable
+	thread_queue readers;
+	thread_queue writers;
+	//edges epoll reported while nobody was parked, the next wait retries the call straight away
+	int ready_in;
+	int ready_out;
+}io_fd;
+
+_Static_assert(sizeof(mutex) <= sizeof(pthread_mutex_t), "mutex must fit in pthread_mutex_t");
+_Static_assert(sizeof(condition) <= sizeof(pthread_cond_t), "condition must fit in pthread_cond_t");
+
 //first pthread call is true
 int first = 1;
-//global array of all thread control blocks
-tcb threads[MAX_THREADS];
+//pthread_key_create'd keys and the destructors to run on their values at pthread_exit
+typedef struct
+{
+	int used;
+	void (*destructor)(void*);
+}key_info;
+key_info keys[PTHREAD_KEYS_MAX];
+//case channel_select tries first, advanced on every call
+unsigned int select_rotor = 0;
+//task pool: its POOL_ state, its workers' deques, and pool workers parked
+//for lack of tasks; tasks spawned from outside the pool are dealt out to the deques in turn
+int task_pool_state = POOL_STOPPED;
+task_deque* task_deques;
+int task_workers = 0;
+thread_queue task_idle;
+int task_idle_count = 0;
+unsigned int task_next_deque = 0;
+//small object allocator: size of each class, full batches given back by the caches (chained through their first
+//object's second word), the slab each class carves new batches from, and the region the slabs are committed in
+const size_t alloc_sizes[ALLOC_CLASSES] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024};
+int alloc_lock = 0;
+void* alloc_batches[ALLOC_CLASSES];
+char* alloc_carve[ALLOC_CLASSES];
+char* alloc_carve_end[ALLOC_CLASSES];
+char* alloc_region;
+size_t alloc_used = 0;
+unsigned char alloc_slab_class[ALLOC_REGION / ALLOC_SLAB];
+//all thread control blocks, allocated SLAB_CHUNK at a time
+tcb* slab[MAX_THREADS / SLAB_CHUNK];
+//slots handed out so far, every slot below this has a tcb
+int slab_size = 0;
+//slots of joined and detached threads waiting to be reused
+tcb* free_slots = NULL;
 
-//thread IDs
-pthread_t thread_id = 1;
 //current number of threads
 int thread_count = 0;
-//next available index in the threads array
-int next_available = 0;
-//index of currently running thread
-int current_thread = 0;
 
-//global array of sem_t and semaphores
-sem_t sem_ts[128];
-semaphore semaphores[128];
+//log2 histograms of READY to RUNNING latency and of time blocked in sem_wait, see runtime_getstats_np
+uint64_t sched_latency[STATS_BUCKETS];
+uint64_t sem_wait_time[STATS_BUCKETS];
 
-//semaphore count
-int sem_count = 0;
-//semaphore IDs
-int sem_id = 0;
+//kernel threads running green threads, carrier 0 is the process's original thread
+carrier carriers[MAX_CARRIERS];
+//number of carriers started
+int carrier_count = 1;
+//number of carriers asked for through pthread_setconcurrency
+int concurrency = 1;
+//time slice in nanoseconds, set with pthread_setquantum_np
+long quantum = QUANTUM;
+//carrier of the calling kernel thread, NULL on kernel threads the runtime did not start
+__thread carrier* local_carrier;
+//on an offload helper, the parked green thread whose call it is making, which the call runs as
+__thread tcb* offload_caller;
+//on any other kernel thread the runtime did not start, what stands in for a green thread, so pthread_self and
+//thread-specific data work there; its id counts down from the top, where no green thread's id can be
+__thread tcb foreign_thread;
+pthread_t foreign_ids = 0;
+//size class caches of the calling kernel thread, which for a green thread is its carrier's
+__thread alloc_cache local_caches[ALLOC_CLASSES];
 
-int index_from_align(sem_t* sem)
-{
-	//get the index of the semaphore from the __align variable in corresponding sem_t
-	int id = sem->__align;
-	int i = 0;
-	for(i = 0; i < 128; i++)
-		if(semaphores[i].id == id)
-			return i;
-}
+//spinlock guarding the synchronization objects, thread states other than READY and RUNNING, the reactor, the timing
+//wheel and the tables shared by all carriers; the run queues have locks of their own, see carrier
+volatile int runtime_lock = 0;
+//bumped whenever work is queued so carriers parked on it wake up
+volatile unsigned int work_seq = 0;
+//carriers parked in their idle loop, updated atomically since queuers only hold a run queue lock
+int idle_carriers = 0;
+
+//epoll instance shared by all carriers, and an eventfd in it that interrupts epoll_wait
+int reactor_fd = -1;
+int reactor_wake_fd = -1;
+//per fd reactor state, indexed by fd
+io_fd* io_fds = NULL;
+int io_fd_count = 0;
+//threads parked on a fd
+int io_waiting = 0;
+//set while an idle carrier is blocked in epoll_wait, and once it has been sent a wakeup
+int poller_active = 0;
+int poller_kicked = 0;
+//tick the poller sleeps until, UINT64_MAX when it waits for I/O only
+uint64_t poller_deadline;
+
+//offload pool: calls waiting for a helper, bumped on every submission so idle helpers wake, and finished
+//calls the reactor hands back to their threads when the eventfd fires
+int offload_state = POOL_STOPPED;
+int offload_lock = 0;
+struct offload_request* offload_head;
+struct offload_request* offload_tail;
+volatile unsigned int offload_seq = 0;
+struct offload_request* offload_done;
+int offload_fd = -1;
+
+//timing wheel of threads with a pending timeout, one list per slot
+tcb* wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+//bit i of a level is set while its slot i is non-empty
+uint64_t wheel_bitmap[WHEEL_LEVELS];
+//last tick the wheel has been run up to, and the number of threads in it
+uint64_t wheel_now;
+int wheel_count = 0;
+
+//set when THREADS_TRACE names a file, the trace is exported there at exit
+int trace_enabled = 0;
+char* trace_path = NULL;
+//time the trace started, event times are exported relative to it
+uint64_t trace_epoch;
 
-int sem_find()
+//free lists of stacks left behind by exited threads, one per stack size
+stack_class stack_pool[STACK_CLASSES];
+size_t page_size;
+
+semaphore* sem_state(sem_t* sem)
 {
-	int i = 0;
-	for(i = 0; i < 128; i++)
-		if(semaphores[i].initialized == 0)
-			return i;
+	return (semaphore*) sem;
 }
 
-void sem_pop(semaphore* sem)
+int sem_init(sem_t* sem, int pshared, unsigned value)
 {
-	int i = 0;
-	for(i = 0; i < 128; i++)
+	//initialize unnamed semaphore, nothing can be waiting on it yet so no lock is needed
+	if(value > SEM_VALUE_MAX)
 	{
-		if(i == 0)
-		{
-			sem->waiting_threads[0]->status = READY;
-			sem->waiting_threads[i] = sem->waiting_threads[i + 1];
-		} else if (i != 127) {
-			sem->waiting_threads[i] = NULL;
-		}
+		errno = EINVAL;
+		return -1;
 	}
-}
 
-void sem_push(semaphore* sem, tcb* thread)
-{
-	int i = 127;
-	for(i = 127; i >= 0; i--)
-	{
-		if(i != 0)
-		{
-			sem->waiting_threads[i] = sem->waiting_threads[i - 1];
+	semaphore* state = sem_state(sem);
+	//initial value
+	state->value = value;
+	state->waiting.head = NULL;
+	state->waiting.tail = NULL;
 
-		} else {
-			sem->waiting_threads[i] = thread;
-		}
-	}
+	return 0;
 }
 
-int sem_init(sem_t* sem, int pshared, unsigned value)
+void sem_wait_record(tcb* self, uint64_t blocked)
 {
-	//initialize unnamed semaphore
-	//semaphores[sem_count].id = sem_id;
-	//sem_id++;
+	//the wait is the time spent BLOCKED plus the READY time from the wakeup to the switch in,
+	//both already measured by the scheduler, so no clock is read here
+	histogram_add(sem_wait_time, self->stats.blocked_ns - blocked + self->run_start - self->state_since);
+}
 
-	//find an index in the semaphore table
-	int index = sem_find();
-	//set sem pointer to reference the created semaphore
-	sem = &sem_ts[index];
-	//sem_t references the semaphore that will be created at that index
-	sem->__align = index;
+int sem_wait(sem_t* sem)
+{
+	lock();
 
-	//semaphore id
-	semaphores[index].id = sem_id;
-	//initial value
-	semaphores[index].value = value;
+	//sem_wait will decrement the semaphore referred to by sem
+	semaphore* state = sem_state(sem);
 
-	semaphores[index].num_waiting = 0;
-	//semaphore has been initialized
-	semaphores[index].initialized = 1;
+	//if the semaphores value is greater than zero the decrement proceeds and the function returns immediately
+	if(state->value > 0)
+	{
+		state->value--;
+		unlock();
+		return 0;
+	}
 
-	//one more semaphore has been created
-	sem_count++;
+	//if the semaphore currently has the value 0 then the call blocks until sem_post hands it a unit
+	tcb* self = current_tcb();
+	trace(TRACE_SEM_WAIT, self, sem);
+	self->status = BLOCKED;
+	queue_push(&state->waiting, self);
+	uint64_t blocked = self->stats.blocked_ns;
+	schedule();
+	sem_wait_record(self, blocked);
+	//sem_post handed its unit straight to us, so there is nothing left to decrement
+	unlock();
+	return 0;
 }
 
-int sem_wait(sem_t* sem)
+int sem_timedwait(sem_t* sem, const struct timespec* abstime)
 {
-	//sem_wait will decrement the semaphore referred to by sem
-	int index = index_from_align(sem);
+	if(abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000)
+	{
+		errno = EINVAL;
+		return -1;
+	}
 
-	//if the semaphores value is greater than zero the decrement proceeds and the function returns immediately
-	if(semaphores[index].value > 0)
+	lock();
+
+	semaphore* state = sem_state(sem);
+	if(state->value > 0)
 	{
-		semaphores[index].value--;
+		state->value--;
+		unlock();
 		return 0;
 	}
 
-	//if the semaphore currently has the value 0
-	else if(semaphores[index].value == 0)
+	//like sem_wait, except the thread gives up once the CLOCK_REALTIME deadline passes
+	tcb* self = current_tcb();
+	if(timeout_start(self, abstime, CLOCK_REALTIME, 1) < 0)
 	{
-		//then the call blocks until it becomes possible to perform the decrement
-		threads[current_thread].status = BLOCKED;
-		sem_push(&semaphores[index], &threads[current_thread]);
-		semaphores[index].num_waiting++;
-		schedule();
-		semaphores[index].value--;
+		unlock();
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	trace(TRACE_SEM_WAIT, self, sem);
+	self->status = BLOCKED;
+	queue_push(&state->waiting, self);
+	self->wait_queue = &state->waiting;
+	uint64_t blocked = self->stats.blocked_ns;
+	schedule();
+	sem_wait_record(self, blocked);
+	unlock();
+
+	//a timeout took the thread off the queue, so no unit was handed to it
+	if(self->timed_out)
+	{
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	return 0;
+}
+int sem_trywait(sem_t* sem)
+{
+	lock();
+
+	//same as sem_wait, except that a zero value fails instead of blocking
+	semaphore* state = sem_state(sem);
+	if(state->value > 0)
+	{
+		state->value--;
+		unlock();
 		return 0;
 	}
-	//for this project the value of the semaphore never falls below zero
+
+	unlock();
+	errno = EAGAIN;
+	return -1;
 }
 
 int sem_post(sem_t* sem)
 {
+	lock();
+
 	//sem_post increments the semaphore pointed to by sem.
-	int index = index_from_align(sem);
-	semaphores[index].value++;
-	//if the semaphores value consequently becomes greater then 0
-	if(semaphores[index].num_waiting > 0)
+	semaphore* state = sem_state(sem);
+	trace(TRACE_SEM_POST, current_tcb(), sem);
+	tcb* waiter = queue_pop(&state->waiting);
+	if(waiter != NULL)
 	{
 		//then another thread blocked in a sem_wait call will be woken up and proceeds to lock the semaphore
-		sem_pop(&semaphores[index]);
-		semaphores[index].num_waiting--;
-		schedule();
+		//the unit goes straight to it so no thread on another carrier can take it first
+		ready_enqueue(waiter);
+		//the poster keeps its slice unless the waiter outranks it, a producer posting a batch switches once at most
+		if(outranks(waiter, current_tcb()))
+			schedule();
+	} else if(state->value == SEM_VALUE_MAX) {
+		unlock();
+		errno = EOVERFLOW;
+		return -1;
 	} else {
-		//then another thread blocked in a sem_wait call will be woken up and proceeds to lock the semaphore
-		//sem_pop(&semaphores[index]);
-		schedule();
+		//nobody is waiting, so the value goes up
+		state->value++;
 	}
 	//note that when a thread is woken up and takes the lock as part of sem_post, the value of the semaphore will remain zero
+
+	unlock();
+	return 0;
+}
+
+int sem_getvalue(sem_t* sem, int* sval)
+{
+	//waiters are not counted, the value of a semaphore with threads blocked on it is 0
+	*sval = __atomic_load_n(&sem_state(sem)->value, __ATOMIC_RELAXED);
+	return 0;
 }
 
 int sem_destroy(sem_t* sem)
 {
-	int index = index_from_align(sem);
+	//sem_destroy destroys the semaphore specified at the address pointed to by sem
+	//destroying a semaphore that other threads are currently blocked on fails instead of stranding them
+	lock();
 
-	semaphores[index].id = 0;
-	semaphores[index].value = 0;
-	semaphores[index].initialized = 0;
+	semaphore* state = sem_state(sem);
+	if(state->waiting.head != NULL)
+	{
+		unlock();
+		errno = EBUSY;
+		return -1;
+	}
+	state->value = 0;
 
-	int i = 0;
-	for(i = 0; i < 128; i++)
-		sem_pop(&semaphores[index]);
-	//sem_destroy destroys the semaphore specified at the address pointed to by sem 
-	//which means that only a semaphore that has been initialized by sem_init should be destroyed using sem_destroy
-	//destroying a semaphore that other threads are currently blocked on (in sem_wait) produces undefined results
-	//until the semaphore has been reinitialized using sem_init
+	unlock();
+	return 0;
 }
 
-void sig_handler(int signo)
+mutex* mutex_state(pthread_mutex_t* m)
 {
-	fprintf(stderr, "SIGNAL HANDLER TRIGGERED\n");
-	schedule();
+	return (mutex*) m;
 }
 
-void timer()
+condition* cond_state(pthread_cond_t* c)
 {
-	struct sigaction action;
-	action.sa_handler = sig_handler;
-	action.sa_flags = SA_NODEFER;
-	sigaction(SIGALRM, &action, NULL);
+	return (condition*) c;
+}
+
+int pthread_mutex_init(pthread_mutex_t* m, const pthread_mutexattr_t* attr)
+{
+	mutex* state = mutex_state(m);
+	memset(state, 0, sizeof(mutex));
 
-	ualarm(50000, 50000);
+	if(attr != NULL)
+		pthread_mutexattr_gettype(attr, &state->type);
 
-	//printf("TIMER INITIALIZED\n");
+	return 0;
 }
 
-void lock()
+int pthread_mutex_destroy(pthread_mutex_t* m)
 {
-        sigset_t sig;
-        sigemptyset(&sig);
-        sigaddset(&sig, SIGALRM);
-        sigprocmask(SIG_BLOCK, &sig, NULL);
+	//a locked mutex or one with waiters can't be destroyed
+	if(mutex_state(m)->locked != 0)
+		return EBUSY;
+
+	return 0;
 }
 
-void unlock()
+int mutex_acquired(mutex* state, tcb* self)
 {
-        sigset_t sig;
-        sigemptyset(&sig);
-        sigaddset(&sig, SIGALRM);
-        sigprocmask(SIG_UNBLOCK, &sig, NULL);
+	//bookkeeping done once the calling thread holds the mutex
+	state->owner = self;
+	state->count = 1;
+	return 0;
 }
 
-int index_from_thread_id(pthread_t tid)
+int mutex_lock_slow(mutex* state)
 {
-	fprintf(stderr, "SEARCHING\n");
-	int i;
-	for(i = 0; i < MAX_THREADS; i++)
+	tcb* self = current_tcb();
+	int expected;
+
+	//relocking a mutex we already hold
+	if(state->type != PTHREAD_MUTEX_NORMAL && state->owner == self)
+	{
+		if(state->type == PTHREAD_MUTEX_ERRORCHECK)
+			return EDEADLK;
+		state->count++;
+		return 0;
+	}
+
+	//an offload helper has no carrier to park on, it waits in the kernel until the mutex is free
+	if(this_carrier() == NULL)
 	{
-		fprintf(stderr, "tid: %d, threads[i].id: %d, threads[i].index: %d\n", tid, threads[i].id, threads[i].index);
-		if(threads[i].id == tid)
+		expected = 0;
+		while(!__atomic_compare_exchange_n(&state->locked, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
 		{
-			//fprintf(stderr, "tid: %d, threads[i].id: %d, threads[i].index: %d\n", tid, threads[i].id, threads[i].index);
-			return threads[i].index;
+			syscall(SYS_sched_yield);
+			expected = 0;
 		}
+		return mutex_acquired(state, self);
 	}
-	return -1;
-}
 
-void print_threads()
-{
-	printf("\nthreads\n-------\n");
+	//the owner may be running on another carrier and about to release it, so spin a little before parking
 	int i;
-	for(i = 0; i < MAX_THREADS; i++)
+	int spins = carrier_count > 1 ? MUTEX_SPINS : 1;
+	for(i = 0; i < spins; i++)
 	{
-
-		if(threads[i].status == READY)
-			printf("[id: %d, index: %d, state: READY, waiting_on_me: %x]\n", threads[i].id, threads[i].index, threads[i].waiting_on_me);
-		else if(threads[i].status == BLOCKED)
-			if(threads[i].waiting_on_me != 0)
-				printf("[id: %d, index: %d, state: BLOCKED, waiting_on_me: %x, thread: %d]\n", threads[i].id, threads[i].index, threads[i].waiting_on_me, threads[i].waiting_on_me->id);
-			else
-				printf("[id: %d, index: %d, state: BLOCKED, waiting_on_me: %x]\n", threads[i].id, threads[i].index, threads[i].waiting_on_me);
-		else if(threads[i].status == RUNNING)
-			printf("[id: %d, index: %d, state: RUNNING, waiting_on_me: %x]\n", threads[i].id, threads[i].index, threads[i].waiting_on_me);
-		else if(threads[i].status == EXITED)
-			printf("[id: %d, index: %d, state: EXITED, waiting_on_me: %x]\n", threads[i].id, threads[i].index, threads[i].waiting_on_me);
+		expected = 0;
+		if(__atomic_load_n(&state->locked, __ATOMIC_RELAXED) == 0
+			&& __atomic_compare_exchange_n(&state->locked, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return mutex_acquired(state, self);
+		cpu_relax();
 	}
-	printf("\n");
-}
 
-void print_threads_stderr()
-{
-	fprintf(stderr, "\nthreads\n-------\n");
-	int i;
-	for(i = 0; i < MAX_THREADS; i++)
+	lock();
+
+	//marking the mutex contended forces the owner's unlock into the slow path, which hands it to us
+	if(__atomic_exchange_n(&state->locked, 2, __ATOMIC_ACQUIRE) != 0)
 	{
-		if(threads[i].status == READY)
-			fprintf(stderr, "[id: %d, index: %d, state: READY, waiting_on_me: %x]\n", threads[i].id, threads[i].index, threads[i].waiting_on_me);
-		else if(threads[i].status == BLOCKED)
-			fprintf(stderr, "[id: %d, index: %d, state: BLOCKED, waiting_on_me: %x, thread: %d]\n", threads[i].id, threads[i].index, threads[i].waiting_on_me, threads[i].waiting_on_me->id);
-		else if(threads[i].status == RUNNING)
-			fprintf(stderr, "[id: %d, index: %d, state: RUNNING, waiting_on_me: %x]\n", threads[i].id, threads[i].index, threads[i].waiting_on_me);
-		else if(threads[i].status == EXITED)
-			fprintf(stderr, "[id: %d, index: %d, state: EXITED, waiting_on_me: %x]\n", threads[i].id, threads[i].index, threads[i].waiting_on_me);
+		self->status = BLOCKED;
+		queue_push(&state->waiting, self);
+		schedule();
+		//mutex_handoff made us the owner before waking us
 	}
-	fprintf(stderr, "\n");
+
+	mutex_acquired(state, self);
+	unlock();
+	return 0;
 }
 
-void choose_next_thread()
+int pthread_mutex_lock(pthread_mutex_t* m)
 {
-	//check each potential next thread starting from current + 1
-	int i, potential_next;
-	potential_next = current_thread + 1;
+	mutex* state = mutex_state(m);
 
-	//loop through the array of threads
-	for(i = 0; i < MAX_THREADS; i++)
-	{
-		//if we've hit the last thread, start searching at 0
-		if(potential_next == MAX_THREADS)
-			potential_next = 0;
+	//uncontended case: a single compare-and-swap, no runtime lock and no scheduler
+	int expected = 0;
+	if(state->type == PTHREAD_MUTEX_NORMAL
+		&& __atomic_compare_exchange_n(&state->locked, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return 0;
 
-		//if the thread is READY then make it the current_thread and exit the checking loop
-		if(threads[potential_next].status == READY)
-		{
-			current_thread = potential_next;
-			break;
-		}
+	return mutex_lock_slow(state);
+}
+
+int pthread_mutex_trylock(pthread_mutex_t* m)
+{
+	mutex* state = mutex_state(m);
 
-		//check the next index
-		potential_next++;
+	if(state->type == PTHREAD_MUTEX_RECURSIVE && state->owner == current_tcb())
+	{
+		state->count++;
+		return 0;
 	}
 
-	//next thread is set to RUNNING
-	threads[current_thread].status = RUNNING;
+	int expected = 0;
+	if(!__atomic_compare_exchange_n(&state->locked, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return EBUSY;
+
+	if(state->type != PTHREAD_MUTEX_NORMAL)
+		mutex_acquired(state, current_tcb());
+	return 0;
 }
 
-void schedule()
+void mutex_handoff(mutex* state)
 {
-	fprintf(stderr, "\n--------------THIS IS THE SCHEDULER--------------\n");
-	print_threads();
+	//called with lock() held by the owner giving the mutex up
+	tcb* next = queue_pop(&state->waiting);
 
-	//save context of thread we just came out of
-	if(setjmp(threads[current_thread].registers) != 0)
+	if(next == NULL)
+	{
+		state->owner = NULL;
+		__atomic_store_n(&state->locked, 0, __ATOMIC_RELEASE);
 		return;
+	}
 
-	//if the thread we just came out of hasn't exited and isn't blocked then set it from running to ready
-	if(threads[current_thread].status != EXITED && threads[current_thread].status != BLOCKED)
-		threads[current_thread].status = READY;
-
-	printf("PREVIOUS THREAD INDEX: %d\n", current_thread);
-	//print_threads_stderr();
-	choose_next_thread();
-	printf("NEXT THREAD INDEX: %d\n", current_thread);
-
-	//fprintf(stderr, "Scheduling thread #%d\n", current_thread);
-	print_threads();
-	//switch context to next thread
-	longjmp(threads[current_thread].registers, 1);
+	//the mutex never passes through unlocked, so nothing can barge in ahead of the waiter
+	state->owner = next;
+	state->count = 1;
+	__atomic_store_n(&state->locked, state->waiting.head != NULL ? 2 : 1, __ATOMIC_RELEASE);
+	ready_enqueue(next);
 }
 
-int pthread_join(pthread_t thread, void ** retval)
+int pthread_mutex_unlock(pthread_mutex_t* m)
 {
-	fprintf(stderr, "\n    PTHREAD JOIN, current_thread: %d, target_thread: %d\n", current_thread, thread);
-	//find the index of the thread that we're going to wait for
-	int index = index_from_thread_id(thread);
+	mutex* state = mutex_state(m);
 
-	//if thread index is valid
-	if(index != -1)
+	if(state->type != PTHREAD_MUTEX_NORMAL)
 	{
-		fprintf(stderr, "target index = %d\n", index);
-
-		if(threads[index].status == EXITED && retval != NULL)
-		{
-			*retval = threads[thread].retval;
+		if(state->owner != current_tcb())
+			return EPERM;
+		//a recursive mutex is only released by the outermost unlock
+		if(--state->count > 0)
 			return 0;
-		}
+		state->owner = NULL;
+	}
 
-		//make the current thread block on thread
-		threads[current_thread].status = BLOCKED;
+	//nobody queued: a single compare-and-swap back to unlocked
+	int expected = 1;
+	if(__atomic_compare_exchange_n(&state->locked, &expected, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		return 0;
 
-		//when pthread_exit is called, it can refer to this pointer to set this thread back to READY
-		threads[index].waiting_on_me = &threads[current_thread];
-		schedule();
-		if(retval != NULL)
-		{
-			printf("RETVAL IS NOT NULL\n");
-			*retval = threads[index].retval;
-		}
-	}
+	//contended: hand the mutex straight to the oldest waiter
+	lock();
+	mutex_handoff(state);
+	unlock();
+	return 0;
+}
 
+int pthread_cond_init(pthread_cond_t* c, const pthread_condattr_t* attr)
+{
+	condition* state = cond_state(c);
+	memset(state, 0, sizeof(condition));
+	state->clock = CLOCK_REALTIME;
+	if(attr != NULL)
+		pthread_condattr_getclock(attr, &state->clock);
 	return 0;
 }
 
-void pthread_exit(void* retval)
+int pthread_cond_destroy(pthread_cond_t* c)
 {
-	//mark the thread as EXITED
-	threads[current_thread].status = EXITED;
-	threads[current_thread].retval = retval;
+	if(cond_state(c)->waiting.head != NULL)
+		return EBUSY;
 
-	//free the allocated stack space
-	free(threads[current_thread].stack);
+	return 0;
+}
 
-	//if the waiting on me pointer isn't null then there's a thread blocked on this one
-	if(threads[current_thread].waiting_on_me != NULL)
-	{
-		fprintf(stderr, "Changed blocking thread to READY\n");
-		//so set that one equal to READY because this thread is exiting
-		threads[current_thread].waiting_on_me->status = READY;
-		threads[current_thread].waiting_on_me = NULL;
-	}
+int pthread_cond_wait(pthread_cond_t* c, pthread_mutex_t* m)
+{
+	lock();
 
-	//change the thread_count
-	thread_count--;
+	//queue on the condition and give up the mutex in one step under the runtime lock,
+	//so a signal sent right after the unlock can't be missed
+	tcb* self = current_tcb();
+	self->status = BLOCKED;
+	self->wait_mutex = mutex_state(m);
+	queue_push(&cond_state(c)->waiting, self);
+	mutex_handoff(mutex_state(m));
+	schedule();
+
+	//the signaller passed the mutex on to us before we were woken
+	self->wait_mutex = NULL;
+	unlock();
+	return 0;
+}
+int pthread_cond_timedwait(pthread_cond_t* c, pthread_mutex_t* m, const struct timespec* abstime)
+{
+	if(abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000)
+		return EINVAL;
 
-	printf("PTHREAD_EXIT FOR THREAD #%d\n", current_thread);
+	lock();
 
+	condition* state = cond_state(c);
+	tcb* self = current_tcb();
+	//a deadline that already passed returns with the mutex still held
+	if(timeout_start(self, abstime, state->clock, 1) < 0)
+	{
+		unlock();
+		return ETIMEDOUT;
+	}
+
+	self->status = BLOCKED;
+	self->wait_mutex = mutex_state(m);
+	queue_push(&state->waiting, self);
+	self->wait_queue = &state->waiting;
+	state->timed++;
+	mutex_handoff(mutex_state(m));
 	schedule();
 
-	__builtin_unreachable();
+	//a timeout moves the thread on to wait for the mutex, so either way it holds it again now
+	self->wait_mutex = NULL;
+	state->timed--;
+	unlock();
+	return self->timed_out ? ETIMEDOUT : 0;
 }
 
-void pthread_exit_wrapper()
+void cond_wake(tcb* waiter)
 {
-	unsigned int res;
-	asm("movl %%eax, %0\n":"=r"(res));
-	pthread_exit((void *) res);
+	//give a woken waiter its mutex right away if it is free, otherwise move it onto the
+	//mutex's queue, it stays BLOCKED and runs once the owner hands the mutex over
+	mutex* state = waiter->wait_mutex;
+	timeout_cancel(waiter);
+
+	if(__atomic_exchange_n(&state->locked, 2, __ATOMIC_ACQUIRE) == 0)
+	{
+		state->owner = waiter;
+		state->count = 1;
+		ready_enqueue(waiter);
+	}
+	else
+	{
+		queue_push(&state->waiting, waiter);
+	}
 }
 
-pthread_t pthread_self()
+int pthread_cond_signal(pthread_cond_t* c)
 {
-	return threads[current_thread].id;
+	lock();
+
+	tcb* waiter = queue_pop(&cond_state(c)->waiting);
+	if(waiter != NULL)
+		cond_wake(waiter);
+
+	unlock();
+	return 0;
 }
 
-int pthread_create(pthread_t *thread,
-		const pthread_attr_t *attr,
-                void *(*start_routine) (void *), 
-                void *arg)
+int pthread_cond_broadcast(pthread_cond_t* c)
 {
-	//create main thread upon first run
-	if(first)
-	{
-		first = 0;
-		//initialize timer for thread preemption
-		timer();
+	lock();
 
-		//main thread id assigned
-		threads[next_available].id = 0;
+	condition* state = cond_state(c);
+	tcb* first = queue_pop(&state->waiting);
 
-		if(setjmp(threads[next_available].registers) != 0)
-			return 0;
+	if(first != NULL)
+	{
+		//only the first waiter can get the mutex, the rest are spliced onto the mutex's
+		//queue in one step instead of being woken just to block on it again
+		cond_wake(first);
 
-		threads[next_available].status = READY;
-		threads[next_available].initialized = 1;
-		threads[next_available].index = next_available;
+		//a waiter with a wheel entry is spliced along with the rest once its timeout is cancelled
+		tcb* waiter;
+		if(state->timed > 0)
+			for(waiter = state->waiting.head; waiter != NULL; waiter = waiter->next_ready)
+				if(waiter->timer_slot != NULL)
+					timeout_cancel(waiter);
 
-		thread_count++;
-		//printf("MAIN THREAD CREATED\n");
-	}
-	if(thread_count < MAX_THREADS)
-	{
-		//parse the threads array to find an empty spot indexed by next_available
-		int i;
-		for(i = 0; i < MAX_THREADS; i++)
-			if(threads[i].status == 0 /*|| threads[i].status == EXITED*/)
+		if(state->waiting.head != NULL)
+		{
+			mutex* target = first->wait_mutex;
+			state->waiting.head->prev_ready = target->waiting.tail;
+			if(target->waiting.tail != NULL)
+				target->waiting.tail->next_ready = state->waiting.head;
+			else
+				target->waiting.head = state->waiting.head;
+			target->waiting.tail = state->waiting.tail;
+
+			state->waiting.head = NULL;
+			state->waiting.tail = NULL;
+		}
+	}
+
+	unlock();
+	return 0;
+}
+
+rwlock* rwlock_state(pthread_rwlock_t* rw)
+{
+	return (rwlock*) rw;
+}
+
+barrier* barrier_state(pthread_barrier_t* b)
+{
+	return (barrier*) b;
+}
+
+int pthread_rwlock_init(pthread_rwlock_t* rw, const pthread_rwlockattr_t* attr)
+{
+	//writers are always preferred, so the attr's kind is not looked at
+	memset(rwlock_state(rw), 0, sizeof(rwlock));
+	return 0;
+}
+
+int pthread_rwlock_destroy(pthread_rwlock_t* rw)
+{
+	rwlock* state = rwlock_state(rw);
+	if(state->readers > 0 || state->writer != NULL || state->read_waiting.head != NULL || state->write_waiting.head != NULL)
+		return EBUSY;
+
+	return 0;
+}
+
+int rwlock_admit_readers(rwlock* state)
+{
+	//every parked reader gets the lock at once
+	tcb* reader;
+	for(reader = state->read_waiting.head; reader != NULL; reader = reader->next_ready)
+		state->readers++;
+	return ready_splice(&state->read_waiting);
+}
+
+int rwlock_release(rwlock* state)
+{
+	//called with lock() held once the lock is free: the oldest writer gets it, or else every parked reader;
+	//returns whether a woken thread outranks the caller
+	tcb* writer = queue_pop(&state->write_waiting);
+	if(writer != NULL)
+	{
+		state->writer = writer;
+		ready_enqueue(writer);
+		return outranks(writer, current_tcb());
+	}
+
+	return rwlock_admit_readers(state);
+}
+
+int rwlock_lock(pthread_rwlock_t* rw, int writing, const struct timespec* abstime, clockid_t clock)
+{
+	if(abstime != NULL && (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000))
+		return EINVAL;
+
+	lock();
+
+	rwlock* state = rwlock_state(rw);
+	tcb* self = current_tcb();
+	if(state->writer == self)
+	{
+		unlock();
+		return EDEADLK;
+	}
+
+	//readers share the lock unless a writer holds it or is queued for it, so writers can't starve;
+	//a thread already reading that asks again while a writer is queued deadlocks, as in glibc's
+	//PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP
+	if(writing ? state->writer == NULL && state->readers == 0 : state->writer == NULL && state->write_waiting.head == NULL)
+	{
+		if(writing)
+			state->writer = self;
+		else
+			state->readers++;
+		unlock();
+		return 0;
+	}
+
+	if(abstime != NULL && timeout_start(self, abstime, clock, 1) < 0)
+	{
+		unlock();
+		return ETIMEDOUT;
+	}
+
+	//whoever releases the lock takes it for us before we are woken
+	thread_queue* queue = writing ? &state->write_waiting : &state->read_waiting;
+	self->status = BLOCKED;
+	queue_push(queue, self);
+	if(abstime != NULL)
+		self->wait_queue = queue;
+	schedule();
+
+	//a writer that gave up while readers held the lock may have been all that kept the queued readers out
+	if(self->timed_out && writing && state->writer == NULL && state->write_waiting.head == NULL && rwlock_admit_readers(state))
+		schedule();
+
+	unlock();
+	return self->timed_out ? ETIMEDOUT : 0;
+}
+
+int pthread_rwlock_rdlock(pthread_rwlock_t* rw)
+{
+	return rwlock_lock(rw, 0, NULL, CLOCK_REALTIME);
+}
+
+int pthread_rwlock_wrlock(pthread_rwlock_t* rw)
+{
+	return rwlock_lock(rw, 1, NULL, CLOCK_REALTIME);
+}
+
+int pthread_rwlock_timedrdlock(pthread_rwlock_t* rw, const struct timespec* abstime)
+{
+	return rwlock_lock(rw, 0, abstime, CLOCK_REALTIME);
+}
+
+int pthread_rwlock_timedwrlock(pthread_rwlock_t* rw, const struct timespec* abstime)
+{
+	return rwlock_lock(rw, 1, abstime, CLOCK_REALTIME);
+}
+
+int pthread_rwlock_clockrdlock(pthread_rwlock_t* rw, clockid_t clock, const struct timespec* abstime)
+{
+	return rwlock_lock(rw, 0, abstime, clock);
+}
+
+int pthread_rwlock_clockwrlock(pthread_rwlock_t* rw, clockid_t clock, const struct timespec* abstime)
+{
+	return rwlock_lock(rw, 1, abstime, clock);
+}
+
+int pthread_rwlock_tryrdlock(pthread_rwlock_t* rw)
+{
+	lock();
+	rwlock* state = rwlock_state(rw);
+	int error = state->writer == NULL && state->write_waiting.head == NULL ? 0 : EBUSY;
+	if(error == 0)
+		state->readers++;
+	unlock();
+	return error;
+}
+
+int pthread_rwlock_trywrlock(pthread_rwlock_t* rw)
+{
+	lock();
+	rwlock* state = rwlock_state(rw);
+	int error = state->writer == NULL && state->readers == 0 ? 0 : EBUSY;
+	if(error == 0)
+		state->writer = current_tcb();
+	unlock();
+	return error;
+}
+
+int pthread_rwlock_unlock(pthread_rwlock_t* rw)
+{
+	lock();
+
+	rwlock* state = rwlock_state(rw);
+	if(state->writer == current_tcb())
+		state->writer = NULL;
+	else if(state->readers > 0)
+		state->readers--;
+	else
+	{
+		unlock();
+		return EPERM;
+	}
+
+	//the last one out passes the lock on, like sem_post the caller keeps the carrier unless that outranks it
+	if(state->writer == NULL && state->readers == 0 && rwlock_release(state))
+		schedule();
+
+	unlock();
+	return 0;
+}
+
+int pthread_barrier_init(pthread_barrier_t* b, const pthread_barrierattr_t* attr, unsigned int count)
+{
+	if(count == 0)
+		return EINVAL;
+
+	barrier* state = barrier_state(b);
+	memset(state, 0, sizeof(barrier));
+	state->count = count;
+	return 0;
+}
+
+int pthread_barrier_destroy(pthread_barrier_t* b)
+{
+	if(barrier_state(b)->waiting.head != NULL)
+		return EBUSY;
+
+	return 0;
+}
+
+int pthread_barrier_wait(pthread_barrier_t* b)
+{
+	lock();
+
+	barrier* state = barrier_state(b);
+
+	//the last thread to arrive releases the round in one splice and keeps running
+	if(++state->arrived == state->count)
+	{
+		state->arrived = 0;
+		if(ready_splice(&state->waiting))
+			schedule();
+		unlock();
+		return PTHREAD_BARRIER_SERIAL_THREAD;
+	}
+
+	tcb* self = current_tcb();
+	self->status = BLOCKED;
+	queue_push(&state->waiting, self);
+	schedule();
+
+	unlock();
+	return 0;
+}
+
+channel* channel_create(size_t elem_size, size_t capacity)
+{
+	channel* ch = calloc(1, sizeof(channel));
+	if(ch == NULL)
+		return NULL;
+
+	ch->elem_size = elem_size;
+	ch->capacity = capacity;
+	//an unbuffered channel has no ring, every value goes straight from sender to receiver
+	if(capacity > 0 && (ch->buffer = calloc(capacity, elem_size > 0 ? elem_size : 1)) == NULL)
+	{
+		free(ch);
+		return NULL;
+	}
+
+	return ch;
+}
+
+int channel_destroy(channel* ch)
+{
+	lock();
+	if(ch->senders.head != NULL || ch->receivers.head != NULL)
+	{
+		unlock();
+		return EBUSY;
+	}
+	unlock();
+
+	free(ch->buffer);
+	free(ch);
+	return 0;
+}
+
+void waiter_push(waiter_queue* queue, channel_waiter* waiter)
+{
+	waiter->next = NULL;
+	waiter->prev = queue->tail;
+	if(queue->tail != NULL)
+		queue->tail->next = waiter;
+	else
+		queue->head = waiter;
+	queue->tail = waiter;
+}
+
+void waiter_remove(waiter_queue* queue, channel_waiter* waiter)
+{
+	if(waiter->prev != NULL)
+		waiter->prev->next = waiter->next;
+	else
+		queue->head = waiter->next;
+	if(waiter->next != NULL)
+		waiter->next->prev = waiter->prev;
+	else
+		queue->tail = waiter->prev;
+}
+
+tcb* channel_fire(channel_waiter* fired, int result)
+{
+	//called with lock() held: the case completes, so the thread comes off every channel it is parked on
+	tcb* thread = fired->thread;
+	int i;
+	for(i = 0; i < thread->select_count; i++)
+	{
+		channel_waiter* waiter = &thread->select_waiters[i];
+		waiter_remove(waiter->op == CHANNEL_SEND ? &waiter->ch->senders : &waiter->ch->receivers, waiter);
+	}
+
+	fired->result = result;
+	thread->select_fired = fired;
+	ready_enqueue(thread);
+	return thread;
+}
+
+char* channel_slot(channel* ch, size_t position)
+{
+	return ch->buffer + (ch->head + position) % ch->capacity * ch->elem_size;
+}
+
+int channel_try(channel_case* c, tcb** woken)
+{
+	//called with lock() held, completes the case if it can without waiting
+	channel* ch = c->ch;
+	c->result = 0;
+
+	if(c->op == CHANNEL_SEND)
+	{
+		if(ch->closed)
+		{
+			c->result = EPIPE;
+			return 1;
+		}
+
+		//a parked receiver gets the value copied straight into its destination, the buffer is empty anyway
+		channel_waiter* receiver = ch->receivers.head;
+		if(receiver != NULL)
+		{
+			memcpy(receiver->value, c->value, ch->elem_size);
+			*woken = channel_fire(receiver, 0);
+			return 1;
+		}
+
+		if(ch->count < ch->capacity)
+		{
+			memcpy(channel_slot(ch, ch->count), c->value, ch->elem_size);
+			ch->count++;
+			return 1;
+		}
+
+		return 0;
+	}
+
+	channel_waiter* sender = ch->senders.head;
+	if(ch->count > 0)
+	{
+		memcpy(c->value, channel_slot(ch, 0), ch->elem_size);
+		ch->head = (ch->head + 1) % ch->capacity;
+		ch->count--;
+
+		//that made room, so the oldest parked sender's value moves into the buffer and the sender goes on
+		if(sender != NULL)
+		{
+			memcpy(channel_slot(ch, ch->count), sender->value, ch->elem_size);
+			ch->count++;
+			*woken = channel_fire(sender, 0);
+		}
+		return 1;
+	}
+
+	//unbuffered, or buffered with a zero capacity: take the value straight from the sender
+	if(sender != NULL)
+	{
+		memcpy(c->value, sender->value, ch->elem_size);
+		*woken = channel_fire(sender, 0);
+		return 1;
+	}
+
+	//closed and drained, receivers get a zeroed value
+	if(ch->closed)
+	{
+		memset(c->value, 0, ch->elem_size);
+		c->result = EPIPE;
+		return 1;
+	}
+
+	return 0;
+}
+
+int channel_select(channel_case* cases, int count, int block)
+{
+	lock();
+
+	//start at a different case each time so one busy channel can't starve the others
+	tcb* self = current_tcb();
+	int start = count > 0 ? select_rotor++ % count : 0;
+	int i;
+	for(i = 0; i < count; i++)
+	{
+		int index = (start + i) % count;
+		tcb* woken = NULL;
+		if(channel_try(&cases[index], &woken))
+		{
+			//like sem_post, the caller keeps the carrier unless the thread it woke outranks it
+			if(woken != NULL && outranks(woken, self))
+				schedule();
+			unlock();
+			return index;
+		}
+	}
+
+	if(!block || count == 0)
+	{
+		unlock();
+		return -1;
+	}
+
+	//nothing is ready, park on every case until another thread completes one of them
+	channel_waiter waiters[count];
+	for(i = 0; i < count; i++)
+	{
+		channel_waiter* waiter = &waiters[i];
+		waiter->thread = self;
+		waiter->ch = cases[i].ch;
+		waiter->op = cases[i].op;
+		waiter->index = i;
+		waiter->value = cases[i].value;
+		waiter_push(waiter->op == CHANNEL_SEND ? &waiter->ch->senders : &waiter->ch->receivers, waiter);
+	}
+	self->select_waiters = waiters;
+	self->select_count = count;
+	self->select_fired = NULL;
+	self->status = BLOCKED;
+	schedule();
+
+	//channel_fire already took the other cases off their channels
+	channel_waiter* fired = self->select_fired;
+	self->select_waiters = NULL;
+	self->select_count = 0;
+	cases[fired->index].result = fired->result;
+
+	unlock();
+	return fired->index;
+}
+
+int channel_send(channel* ch, const void* value)
+{
+	channel_case send = {ch, CHANNEL_SEND, (void*) value, 0};
+	channel_select(&send, 1, 1);
+	return send.result;
+}
+
+int channel_recv(channel* ch, void* value)
+{
+	channel_case recv = {ch, CHANNEL_RECV, value, 0};
+	channel_select(&recv, 1, 1);
+	return recv.result;
+}
+
+int channel_close(channel* ch)
+{
+	lock();
+
+	if(ch->closed)
+	{
+		unlock();
+		return EPIPE;
+	}
+	ch->closed = 1;
+
+	//whatever is still buffered can be received, parked threads can't complete anymore
+	int switch_needed = 0;
+	tcb* self = current_tcb();
+	while(ch->receivers.head != NULL)
+	{
+		memset(ch->receivers.head->value, 0, ch->elem_size);
+		switch_needed |= outranks(channel_fire(ch->receivers.head, EPIPE), self);
+	}
+	while(ch->senders.head != NULL)
+		switch_needed |= outranks(channel_fire(ch->senders.head, EPIPE), self);
+
+	if(switch_needed)
+		schedule();
+
+	unlock();
+	return 0;
+}
+
+void spin_acquire(int* flag)
+{
+	//for locks held only with preemption disabled, so the holder is running on some carrier
+	while(__atomic_exchange_n(flag, 1, __ATOMIC_ACQUIRE))
+		while(__atomic_load_n(flag, __ATOMIC_RELAXED))
+			cpu_relax();
+}
+
+int spin_try(int* flag)
+{
+	return !__atomic_load_n(flag, __ATOMIC_RELAXED) && !__atomic_exchange_n(flag, 1, __ATOMIC_ACQUIRE);
+}
+
+void spin_release(int* flag)
+{
+	__atomic_store_n(flag, 0, __ATOMIC_RELEASE);
+}
+
+tcb* deque_lock(task_deque* deque)
+{
+	tcb* self = preempt_disable();
+	spin_acquire(&deque->lock);
+	return self;
+}
+
+void deque_unlock(task_deque* deque, tcb* self)
+{
+	spin_release(&deque->lock);
+	preempt_enable(self);
+}
+
+int deque_push(task_deque* deque, task* t, int at_top)
+{
+	tcb* self = deque_lock(deque);
+	int pushed = deque->bottom - deque->top < TASK_DEQUE_SIZE;
+	if(pushed)
+		deque->ring[(unsigned long)(at_top ? --deque->top : deque->bottom++) % TASK_DEQUE_SIZE] = *t;
+	deque_unlock(deque, self);
+	return pushed;
+}
+
+int deque_take(task_deque* deque, task* t, int steal, group* only)
+{
+	//the owner takes its newest task, a thief the oldest, which is the biggest part of a split range;
+	//with only set, nothing unless that task belongs to the group
+	if(__atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) == __atomic_load_n(&deque->top, __ATOMIC_RELAXED))
+		return 0;
+
+	tcb* self = deque_lock(deque);
+	int taken = deque->bottom > deque->top;
+	if(taken)
+	{
+		long end = steal ? deque->top : deque->bottom - 1;
+		task* next = &deque->ring[(unsigned long) end % TASK_DEQUE_SIZE];
+		taken = only == NULL || next->owner == only;
+		if(taken)
+		{
+			*t = *next;
+			if(steal)
+				deque->top++;
+			else
+				deque->bottom--;
+		}
+	}
+	deque_unlock(deque, self);
+	return taken;
+}
+
+int task_find(int worker, task* t, group* only)
+{
+	//a worker's own deque first, then the others' starting from a different one each time
+	if(worker >= 0 && deque_take(&task_deques[worker], t, 0, only))
+		return 1;
+
+	int start = __atomic_fetch_add(&task_next_deque, 1, __ATOMIC_RELAXED);
+	int i;
+	for(i = 0; i < task_workers; i++)
+	{
+		int victim = (start + i) % task_workers;
+		if(victim != worker && deque_take(&task_deques[victim], t, 1, only))
+			return 1;
+	}
+	return 0;
+}
+
+int task_available()
+{
+	int i;
+	for(i = 0; i < task_workers; i++)
+		if(__atomic_load_n(&task_deques[i].bottom, __ATOMIC_SEQ_CST) != __atomic_load_n(&task_deques[i].top, __ATOMIC_SEQ_CST))
+			return 1;
+	return 0;
+}
+
+void task_done(group* g)
+{
+	//every completion but the group's last is one compare-and-swap; the last happens under lock(), so a
+	//task_wait that finds the count at 0 under lock() knows no task touches the group anymore
+	long left = __atomic_load_n(&g->pending, __ATOMIC_RELAXED);
+	while(left > 1)
+		if(__atomic_compare_exchange_n(&g->pending, &left, left - 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+
+	lock();
+	if(__atomic_sub_fetch(&g->pending, 1, __ATOMIC_ACQ_REL) == 0 && ready_splice(&g->waiting))
+		schedule();
+	unlock();
+}
+
+void task_run(task* t)
+{
+	tcb* self = current_tcb();
+	self->task_depth++;
+	t->fn(t->arg);
+	self->task_depth--;
+	task_done(t->owner);
+}
+
+void* task_worker_main(void* arg)
+{
+	//pool workers run tasks for good, parking whenever no deque has any
+	int worker = (int)(long) arg;
+	tcb* self = current_tcb();
+	self->task_worker = worker + 1;
+
+	task t;
+	while(1)
+	{
+		if(task_find(worker, &t, NULL))
+		{
+			task_run(&t);
+			continue;
+		}
+
+		//counted idle before the deques are checked again, a spawner pushes before it checks the count,
+		//so either the push is seen here or the spawner sees us and wakes us
+		lock();
+		__atomic_add_fetch(&task_idle_count, 1, __ATOMIC_SEQ_CST);
+		if(task_available())
+		{
+			__atomic_sub_fetch(&task_idle_count, 1, __ATOMIC_SEQ_CST);
+			unlock();
+			continue;
+		}
+		self->status = BLOCKED;
+		queue_push(&task_idle, self);
+		schedule();
+		unlock();
+	}
+	return NULL;
+}
+
+void task_wake_worker()
+{
+	//a parked worker is woken for the task just pushed, the caller keeps running
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&task_idle_count, __ATOMIC_RELAXED) == 0)
+		return;
+
+	lock();
+	tcb* worker = queue_pop(&task_idle);
+	if(worker != NULL)
+	{
+		__atomic_sub_fetch(&task_idle_count, 1, __ATOMIC_SEQ_CST);
+		ready_enqueue(worker);
+	}
+	unlock();
+}
+
+int task_pool_start()
+{
+	//the first spawn starts one worker per carrier, anyone else spawning meanwhile waits for it
+	int state = __atomic_load_n(&task_pool_state, __ATOMIC_ACQUIRE);
+	if(state == POOL_RUNNING)
+		return 0;
+	if(state == POOL_STOPPED && __atomic_compare_exchange_n(&task_pool_state, &state, POOL_STARTING, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	{
+		int count = pthread_getconcurrency();
+		if(count < 1)
+			count = 1;
+		task_deques = calloc(count, sizeof(task_deque));
+
+		//a worker that fails to start leaves its deque to the thieves
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		pthread_attr_setstacksize(&attr, TASK_STACK_SIZE);
+		task_workers = task_deques != NULL ? count : 0;
+		int started = 0;
+		int i;
+		for(i = 0; i < task_workers; i++)
+		{
+			pthread_t worker;
+			started += pthread_create(&worker, &attr, task_worker_main, (void*)(long) i) == 0;
+		}
+		pthread_attr_destroy(&attr);
+
+		__atomic_store_n(&task_pool_state, started > 0 ? POOL_RUNNING : POOL_FAILED, __ATOMIC_RELEASE);
+	}
+
+	while((state = __atomic_load_n(&task_pool_state, __ATOMIC_ACQUIRE)) == POOL_STARTING)
+		sched_yield();
+	return state == POOL_RUNNING ? 0 : EAGAIN;
+}
+
+int task_spawn(task_group* tasks, void (*fn)(void*), void* arg)
+{
+	if(task_pool_start() != 0)
+		return EAGAIN;
+
+	group* g = (group*) tasks;
+	__atomic_add_fetch(&g->pending, 1, __ATOMIC_RELAXED);
+	task t = {fn, arg, g};
+
+	//a worker keeps what it spawns, others deal tasks out to the workers in turn; a worker already
+	//TASK_HELP_DEPTH tasks deep runs it right away, so a full stack still makes progress without helping
+	tcb* self = current_tcb();
+	int worker = self->task_worker - 1;
+	if(worker >= 0 && self->task_depth >= TASK_HELP_DEPTH)
+	{
+		task_run(&t);
+		return 0;
+	}
+	int outside = worker < 0;
+	if(outside)
+		worker = __atomic_fetch_add(&task_next_deque, 1, __ATOMIC_RELAXED) % task_workers;
+
+	if(!deque_push(&task_deques[worker], &t, outside))
+	{
+		task_run(&t);
+		return 0;
+	}
+	task_wake_worker();
+	return 0;
+}
+
+void task_wait(task_group* tasks)
+{
+	//a pool worker helps with the group's own tasks while it has some outstanding, up to TASK_HELP_DEPTH
+	//tasks deep; a task of another group could run for long and nest arbitrarily deep on this stack, and a
+	//thread outside the pool may have a stack too small for any task, so those park right away
+	group* g = (group*) tasks;
+	tcb* self = current_tcb();
+	task t;
+	if(self->task_worker > 0)
+		while(__atomic_load_n(&g->pending, __ATOMIC_ACQUIRE) > 0 && self->task_depth < TASK_HELP_DEPTH &&
+				task_find(self->task_worker - 1, &t, g))
+			task_run(&t);
+
+	//the rest are running elsewhere, the last one to finish wakes us
+	lock();
+	if(__atomic_load_n(&g->pending, __ATOMIC_ACQUIRE) > 0)
+	{
+		self->status = BLOCKED;
+		queue_push(&g->waiting, self);
+		schedule();
+	}
+	unlock();
+}
+
+//a parallel_for or parallel_reduce call, split into chunks of grain iterations
+typedef struct
+{
+	long begin;
+	long end;
+	long grain;
+	void (*body)(long begin, long end, void* arg);
+	//parallel_reduce: one partial result of size bytes per chunk
+	void (*reduce_body)(long begin, long end, void* partial, void* arg);
+	char* partials;
+	size_t size;
+	void* arg;
+	task_group tasks;
+	//descriptors for the halves split off as tasks, at most one per chunk
+	struct range* ranges;
+	long next_range;
+}loop;
+
+typedef struct range
+{
+	loop* l;
+	//chunks first up to last
+	long first;
+	long last;
+}range;
+
+void range_run(void* arg)
+{
+	range* r = arg;
+	loop* l = r->l;
+	long first = r->first;
+	long last = r->last;
+
+	//split off the upper half as a task until one chunk is left, thieves take the big halves first
+	while(last - first > 1)
+	{
+		long middle = first + (last - first) / 2;
+		range* half = &l->ranges[__atomic_fetch_add(&l->next_range, 1, __ATOMIC_RELAXED)];
+		half->l = l;
+		half->first = middle;
+		half->last = last;
+		if(task_spawn(&l->tasks, range_run, half) != 0)
+			range_run(half);
+		last = middle;
+	}
+
+	long begin = l->begin + first * l->grain;
+	long end = l->end - begin > l->grain ? begin + l->grain : l->end;
+	if(l->partials != NULL)
+		l->reduce_body(begin, end, l->partials + first * l->size, l->arg);
+	else
+		l->body(begin, end, l->arg);
+}
+
+long loop_run(loop* l)
+{
+	//returns the number of chunks run, or -1 when there was no memory for the split descriptors
+	if(l->end <= l->begin)
+		return 0;
+
+	//with no grain, a few chunks per worker so the thieves have something to balance
+	if(l->grain <= 0)
+	{
+		long workers = task_pool_start() == 0 ? task_workers : 1;
+		long chunks = workers * TASK_CHUNKS_PER_WORKER;
+		l->grain = (l->end - l->begin + chunks - 1) / chunks;
+	}
+	long chunks = (l->end - l->begin + l->grain - 1) / l->grain;
+
+	l->ranges = malloc(chunks * sizeof(range));
+	if(l->ranges == NULL)
+		return -1;
+	memset(&l->tasks, 0, sizeof(task_group));
+	l->next_range = 0;
+
+	//the caller splits the range and runs the first chunk itself, the pool runs the rest
+	range all = {l, 0, chunks};
+	range_run(&all);
+	task_wait(&l->tasks);
+
+	free(l->ranges);
+	return chunks;
+}
+
+void parallel_for(long begin, long end, long grain, void (*body)(long begin, long end, void* arg), void* arg)
+{
+	loop l;
+	memset(&l, 0, sizeof(loop));
+	l.begin = begin;
+	l.end = end;
+	l.grain = grain;
+	l.body = body;
+	l.arg = arg;
+
+	//out of memory, the range still gets done
+	if(loop_run(&l) < 0)
+		body(begin, end, arg);
+}
+
+void parallel_reduce(long begin, long end, long grain, void* result, size_t size,
+		void (*body)(long begin, long end, void* partial, void* arg),
+		void (*combine)(void* result, const void* partial, void* arg), void* arg)
+{
+	loop l;
+	memset(&l, 0, sizeof(loop));
+	l.begin = begin;
+	l.end = end;
+	l.grain = grain;
+	l.reduce_body = body;
+	l.size = size;
+	l.arg = arg;
+
+	//every chunk's partial starts out as the identity the caller left in result
+	if(end <= begin)
+		return;
+	if(grain <= 0)
+	{
+		long workers = task_pool_start() == 0 ? task_workers : 1;
+		long chunks = workers * TASK_CHUNKS_PER_WORKER;
+		l.grain = (end - begin + chunks - 1) / chunks;
+	}
+	long chunks = (end - begin + l.grain - 1) / l.grain;
+	l.partials = malloc(chunks * size);
+	if(l.partials == NULL)
+	{
+		body(begin, end, result, arg);
+		return;
+	}
+	long i;
+	for(i = 0; i < chunks; i++)
+		memcpy(l.partials + i * size, result, size);
+
+	if(loop_run(&l) < 0)
+	{
+		free(l.partials);
+		body(begin, end, result, arg);
+		return;
+	}
+
+	//combined in chunk order, so the result doesn't depend on which worker ran what
+	for(i = 0; i < chunks; i++)
+		combine(result, l.partials + i * size, arg);
+	free(l.partials);
+}
+
+alloc_cache* this_caches()
+{
+	//never inlined for the same reason as this_carrier
+	asm volatile("");
+	return local_caches;
+}
+
+int alloc_class(size_t size)
+{
+	//16 byte steps up to 64, then two classes per power of two
+	if(size <= 64)
+		return size <= 16 ? 0 : (size - 1) >> 4;
+	int bits = 63 - __builtin_clzl(size - 1);
+	return 4 + (bits - 6) * 2 + (((size - 1) >> (bits - 1)) & 1);
+}
+
+void* alloc_refill(alloc_cache* cache, int class)
+{
+	//called with preemption disabled on an empty cache, returns one object and caches the rest of a batch
+	size_t size = alloc_sizes[class];
+	char* carved = NULL;
+	spin_acquire(&alloc_lock);
+	void** batch = alloc_batches[class];
+	if(batch != NULL)
+		alloc_batches[class] = batch[1];
+	else
+	{
+		if(alloc_carve_end[class] - alloc_carve[class] < (long)(ALLOC_BATCH * size))
+		{
+			//the region is reserved on first use and committed a slab at a time
+			if(alloc_region == NULL)
+			{
+				char* region = mmap(NULL, ALLOC_REGION, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+				//free and realloc on other carriers read it without the lock
+				__atomic_store_n(&alloc_region, region != MAP_FAILED ? region : NULL, __ATOMIC_RELEASE);
+			}
+			if(alloc_region == NULL || alloc_used == ALLOC_REGION
+					|| mprotect(alloc_region + alloc_used, ALLOC_SLAB, PROT_READ | PROT_WRITE) != 0)
+			{
+				spin_release(&alloc_lock);
+				return NULL;
+			}
+			alloc_slab_class[alloc_used / ALLOC_SLAB] = class;
+			alloc_carve[class] = alloc_region + alloc_used;
+			alloc_carve_end[class] = alloc_carve[class] + ALLOC_SLAB;
+			__atomic_store_n(&alloc_used, alloc_used + ALLOC_SLAB, __ATOMIC_RELEASE);
+		}
+		carved = alloc_carve[class];
+		alloc_carve[class] += ALLOC_BATCH * size;
+	}
+	spin_release(&alloc_lock);
+
+	//a fresh batch is linked up outside the lock
+	if(carved != NULL)
+	{
+		int i;
+		for(i = 0; i < ALLOC_BATCH - 1; i++)
+			*(void**)(carved + i * size) = carved + (i + 1) * size;
+		*(void**)(carved + i * size) = NULL;
+		batch = (void**) carved;
+	}
+
+	cache->head = batch[0];
+	cache->count = ALLOC_BATCH - 1;
+	return batch;
+}
+
+void alloc_flush(alloc_cache* cache, int class)
+{
+	//hand the first batch of a cache holding two back to the shared list
+	void** batch = cache->head;
+	void** last = batch;
+	int i;
+	for(i = 1; i < ALLOC_BATCH; i++)
+		last = *last;
+	cache->head = *last;
+	cache->count -= ALLOC_BATCH;
+	*last = NULL;
+
+	spin_acquire(&alloc_lock);
+	batch[1] = alloc_batches[class];
+	alloc_batches[class] = batch;
+	spin_release(&alloc_lock);
+}
+
+int alloc_owns(void* ptr)
+{
+	//alloc_used only grows past 0 after alloc_region is stored, so once it is loaded the region read after it is set
+	size_t used = __atomic_load_n(&alloc_used, __ATOMIC_ACQUIRE);
+	return (uintptr_t) ptr - (uintptr_t) __atomic_load_n(&alloc_region, __ATOMIC_ACQUIRE) < used;
+}
+
+//glibc's allocator, which everything below ends up in for large sizes and is only entered with preemption
+//disabled: a thread switched out inside it would leave the kernel thread's arena and tcache half updated
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* ptr);
+
+void* alloc_small(size_t size)
+{
+	//called with preemption disabled, so nothing else touches this kernel thread's cache meanwhile;
+	//NULL once the region is used up
+	int class = alloc_class(size);
+	alloc_cache* cache = &this_caches()[class];
+	void* ptr = cache->head;
+	if(ptr == NULL)
+		return alloc_refill(cache, class);
+	cache->head = *(void**) ptr;
+	cache->count--;
+	return ptr;
+}
+
+void* malloc(size_t size)
+{
+	tcb* self = preempt_disable();
+	void* ptr = size <= ALLOC_SMALL_MAX ? alloc_small(size) : NULL;
+	if(ptr == NULL)
+		ptr = __libc_malloc(size);
+	preempt_enable(self);
+	return ptr;
+}
+
+void free(void* ptr)
+{
+	if(ptr == NULL)
+		return;
+
+	tcb* self = preempt_disable();
+	if(alloc_owns(ptr))
+	{
+		int class = alloc_slab_class[((char*) ptr - alloc_region) / ALLOC_SLAB];
+		alloc_cache* cache = &this_caches()[class];
+		*(void**) ptr = cache->head;
+		cache->head = ptr;
+		if(++cache->count >= 2 * ALLOC_BATCH)
+			alloc_flush(cache, class);
+	}
+	else
+		__libc_free(ptr);
+	preempt_enable(self);
+}
+
+void* calloc(size_t count, size_t size)
+{
+	size_t total;
+	if(__builtin_mul_overflow(count, size, &total))
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	//not malloc and memset, which the compiler would fold back into a call to calloc
+	tcb* self = preempt_disable();
+	void* ptr = total <= ALLOC_SMALL_MAX ? alloc_small(total) : NULL;
+	if(ptr != NULL)
+		memset(ptr, 0, total);
+	else
+		ptr = __libc_calloc(count, size);
+	preempt_enable(self);
+	return ptr;
+}
+
+void* realloc(void* ptr, size_t size)
+{
+	if(ptr == NULL)
+		return malloc(size);
+	if(size == 0)
+	{
+		free(ptr);
+		return NULL;
+	}
+
+	//a small object stays put while the size keeps its class, otherwise it moves
+	if(alloc_owns(ptr))
+	{
+		int class = alloc_slab_class[((char*) ptr - alloc_region) / ALLOC_SLAB];
+		size_t old = alloc_sizes[class];
+		if(size <= ALLOC_SMALL_MAX && alloc_class(size) == class)
+			return ptr;
+		void* moved = malloc(size);
+		if(moved != NULL)
+		{
+			memcpy(moved, ptr, size < old ? size : old);
+			free(ptr);
+		}
+		return moved;
+	}
+
+	tcb* self = preempt_disable();
+	void* moved = __libc_realloc(ptr, size);
+	preempt_enable(self);
+	return moved;
+}
+
+void* memalign(size_t alignment, size_t size)
+{
+	tcb* self = preempt_disable();
+	void* ptr = __libc_memalign(alignment, size);
+	preempt_enable(self);
+	return ptr;
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+	return memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+	if(alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0)
+		return EINVAL;
+	void* aligned = memalign(alignment, size);
+	if(aligned == NULL)
+		return ENOMEM;
+	*ptr = aligned;
+	return 0;
+}
+
+size_t malloc_usable_size(void* ptr)
+{
+	//glibc's answer for its own chunks, the size class for ours
+	static size_t (*libc_usable_size)(void*);
+	if(ptr == NULL)
+		return 0;
+	if(alloc_owns(ptr))
+		return alloc_sizes[alloc_slab_class[((char*) ptr - alloc_region) / ALLOC_SLAB]];
+	if(libc_usable_size == NULL)
+		libc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+	return libc_usable_size(ptr);
+}
+
+int* errno_location()
+{
+	//never inlined for the same reason as this_carrier
+	asm volatile("");
+	return __errno_location();
+}
+void sig_handler(int signo)
+{
+	//each carrier's timer signals that carrier's own kernel thread
+	carrier* self = this_carrier();
+	if(self == NULL)
+		return;
+
+	//inside the runtime the switch is held back until unlock()
+	if(self->current->preempt_disabled)
+	{
+		self->preempt_pending = 1;
+		return;
+	}
+
+	preempt(self, 1);
+}
+void preempt(carrier* self, int in_handler)
+{
+	//a tick, taken in the handler or deferred to unlock()
+	self->preempt_pending = 0;
+
+	//the idle loop has nothing to give way
+	if(self->current == &self->idle)
+	{
+		timer_disarm(self);
+		return;
+	}
+
+	//the interrupted thread may be about to read errno
+	int saved_errno = errno;
+
+	tcb* thread = preempt_disable();
+	//the kernel blocked SIGALRM for the handler; the counter covers us from here, and whatever runs next on this
+	//carrier needs its ticks
+	sigset_t alarm;
+	sigemptyset(&alarm);
+	sigaddset(&alarm, SIGALRM);
+	if(in_handler)
+		sigprocmask(SIG_UNBLOCK, &alarm, NULL);
+	//with no carrier idle in epoll_wait, parked I/O and timeouts are only noticed on the busy carriers' ticks
+	if((io_waiting > 0 || wheel_count > 0) && !poller_active)
+	{
+		runtime_acquire();
+		reactor_poll(0);
+		runtime_drop();
+	}
+
+	//a switch between threads on one carrier only takes its run queue lock
+	spin_acquire(&self->lock);
+	//nothing is queued behind the running thread and nobody else has to look for I/O, so stop ticking until something is
+	if(self->ready_count == 0 && ((io_waiting == 0 && wheel_count == 0) || poller_active))
+	{
+		timer_disarm(self);
+		spin_release(&self->lock);
+	}
+	else
+	{
+		thread->pinned = in_handler;
+		reschedule(self, 0);
+	}
+	//blocked again until sigreturn restores the interrupted mask, so no tick nests another frame on this stack
+	if(in_handler)
+		sigprocmask(SIG_BLOCK, &alarm, NULL);
+	thread->preempt_disabled--;
+
+	errno = saved_errno;
+}
+
+void timer()
+{
+	struct sigaction action;
+	action.sa_handler = sig_handler;
+	action.sa_flags = 0;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGALRM, &action, NULL);
+}
+
+void timer_start(carrier* self)
+{
+	//a CLOCK_MONOTONIC timer per carrier, delivered to the carrier's kernel thread only
+	struct sigevent event;
+	memset(&event, 0, sizeof(event));
+	event.sigev_notify = SIGEV_THREAD_ID;
+	event.sigev_signo = SIGALRM;
+	event._sigev_un._tid = self->tid;
+	timer_create(CLOCK_MONOTONIC, &event, &self->timer);
+}
+
+void timer_arm(carrier* self)
+{
+	struct itimerspec slice;
+	slice.it_value.tv_sec = quantum / 1000000000;
+	slice.it_value.tv_nsec = quantum % 1000000000;
+	slice.it_interval = slice.it_value;
+	timer_settime(self->timer, 0, &slice, NULL);
+	self->timer_armed = 1;
+}
+
+void timer_advance(carrier* self, uint64_t at)
+{
+	//brings the next tick forward to at, CLOCK_MONOTONIC nanoseconds, if it would come later; ticks go on a slice apart from there
+	struct itimerspec next;
+	timer_gettime(self->timer, &next);
+	uint64_t now = clock_now();
+	uint64_t due = now + (uint64_t) next.it_value.tv_sec * 1000000000 + next.it_value.tv_nsec;
+	if(at >= due)
+		return;
+
+	//a zero it_value would disarm the timer
+	uint64_t wait = at > now ? at - now : 1;
+	next.it_value.tv_sec = wait / 1000000000;
+	next.it_value.tv_nsec = wait % 1000000000;
+	next.it_interval.tv_sec = quantum / 1000000000;
+	next.it_interval.tv_nsec = quantum % 1000000000;
+	timer_settime(self->timer, 0, &next, NULL);
+}
+
+void timer_disarm(carrier* self)
+{
+	struct itimerspec off;
+	memset(&off, 0, sizeof(off));
+	timer_settime(self->timer, 0, &off, NULL);
+	self->timer_armed = 0;
+}
+
+int pthread_setquantum_np(const struct timespec* slice)
+{
+	long length = slice->tv_sec * 1000000000L + slice->tv_nsec;
+	if(length < QUANTUM_MIN)
+		return EINVAL;
+
+	lock();
+
+	//timers are process wide objects, so every armed carrier switches to the new slice right away
+	quantum = length;
+	int i;
+	for(i = 0; i < carrier_count; i++)
+	{
+		spin_acquire(&carriers[i].lock);
+		if(carriers[i].timer_armed)
+			timer_arm(&carriers[i]);
+		spin_release(&carriers[i].lock);
+	}
+
+	unlock();
+	return 0;
+}
+
+int pthread_getquantum_np(struct timespec* slice)
+{
+	slice->tv_sec = quantum / 1000000000;
+	slice->tv_nsec = quantum % 1000000000;
+	return 0;
+}
+
+void lock()
+{
+	//the first call into the library sets up the runtime
+	if(first)
+		runtime_init();
+
+	//hold back the preemption tick so the handler cannot re-enter the scheduler on this carrier
+	preempt_disable();
+
+	//then take the runtime lock shared by all carriers
+	runtime_acquire();
+}
+
+void runtime_acquire()
+{
+	int spins = 0;
+	while(__atomic_exchange_n(&runtime_lock, 1, __ATOMIC_ACQUIRE))
+	{
+		while(__atomic_load_n(&runtime_lock, __ATOMIC_RELAXED))
+		{
+			//the holder may have been descheduled by the kernel, give it the core back
+			if(++spins % 1024 == 0)
+				syscall(SYS_sched_yield);
+			cpu_relax();
+		}
+	}
+}
+
+void runtime_drop()
+{
+	//the bare lock, for callers that keep preemption disabled themselves
+	__atomic_store_n(&runtime_lock, 0, __ATOMIC_RELEASE);
+}
+
+tcb* preempt_disable()
+{
+	//kernel threads the runtime did not start get no ticks
+	if(this_carrier() == NULL)
+		return NULL;
+
+	tcb* self = current_tcb();
+	self->preempt_disabled++;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	return self;
+}
+
+void preempt_enable(tcb* self)
+{
+	//self is what preempt_disable returned, a tick that arrived in between is taken now
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	if(self != NULL && --self->preempt_disabled == 0 && this_carrier()->preempt_pending)
+		preempt(this_carrier(), 0);
+}
+
+carrier* runtime_release()
+{
+	//drop the runtime lock and re-enable ticks on the carrier we are on now, which after a switch
+	//is not always the one lock() was called on
+	runtime_drop();
+
+	carrier* self = this_carrier();
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	if(self != NULL)
+		self->current->preempt_disabled--;
+	return self;
+}
+void unlock()
+{
+	//a tick that arrived inside the critical section is taken now
+	carrier* self = runtime_release();
+	if(self != NULL && self->preempt_pending && self->current->preempt_disabled == 0)
+		preempt(self, 0);
+}
+
+carrier* this_carrier()
+{
+	//never inlined: a green thread can resume on another kernel thread, so the
+	//TLS address must not be cached across a switch by the caller
+	asm volatile("");
+	return local_carrier;
+}
+
+tcb* foreign_tcb()
+{
+	//set up on the kernel thread's first call, for its lifetime
+	tcb* thread = &foreign_thread;
+	if(thread->id == 0)
+	{
+		thread->id = __atomic_sub_fetch(&foreign_ids, 1, __ATOMIC_RELAXED);
+		thread->status = RUNNING;
+	}
+	return thread;
+}
+
+tcb* current_tcb()
+{
+	//outside lock() a tick can move the thread to another carrier between the two loads,
+	//the carrier only names us if it is still the one we run on afterwards
+	carrier* self;
+	tcb* current;
+	do
+	{
+		self = this_carrier();
+		if(self == NULL)
+			return offload_caller != NULL ? offload_caller : foreign_tcb();
+		current = self->current;
+	}
+	while(self != this_carrier());
+	return current;
+}
+
+carrier* waking_carrier(tcb* thread)
+{
+	//threads woken from an offload helper go back to the carrier they last ran on
+	carrier* self = this_carrier();
+	return self != NULL ? self : thread->owner != NULL ? thread->owner : &carriers[0];
+}
+
+void futex_wait(volatile unsigned int* address, unsigned int value)
+{
+	syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+void futex_wake(volatile unsigned int* address, int count)
+{
+	syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+void wake_idle_carrier()
+{
+	//only needed when some carrier is parked waiting for work; the fence orders the work just queued before the
+	//check, against the idle loop counting itself before its last look at the queues
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int idle = __atomic_load_n(&idle_carriers, __ATOMIC_RELAXED);
+	if(idle == 0)
+		return;
+
+	//carriers parked on the futex go first, the one in epoll_wait is only interrupted when it is the last idle one
+	if(idle > poller_active)
+	{
+		__atomic_add_fetch(&work_seq, 1, __ATOMIC_SEQ_CST);
+		futex_wake(&work_seq, 1);
+	}
+	else
+		reactor_kick();
+}
+void reactor_kick()
+{
+	//interrupt the carrier waiting in epoll_wait, once until it wakes up
+	if(__atomic_exchange_n(&poller_kicked, 1, __ATOMIC_RELAXED))
+		return;
+
+	uint64_t one = 1;
+	syscall(SYS_write, reactor_wake_fd, &one, sizeof(one));
+}
+
+tcb* slot_tcb(int slot)
+{
+	return &slab[slot / SLAB_CHUNK][slot % SLAB_CHUNK];
+}
+
+tcb* slot_alloc()
+{
+	//reuse the slot of a joined or detached thread first
+	tcb* thread = free_slots;
+	if(thread != NULL)
+	{
+		free_slots = thread->next_ready;
+	}
+	else
+	{
+		if(slab_size == MAX_THREADS)
+			return NULL;
+
+		//the table is full, grow it by a chunk
+		if(slab_size % SLAB_CHUNK == 0)
+		{
+			tcb* chunk = calloc(SLAB_CHUNK, sizeof(tcb));
+			if(chunk == NULL)
+				return NULL;
+			slab[slab_size / SLAB_CHUNK] = chunk;
+		}
+
+		thread = slot_tcb(slab_size);
+		thread->index = slab_size;
+		slab_size++;
+	}
+
+	//everything but the slot's position and generation starts out zeroed
+	int index = thread->index;
+	unsigned int generation = thread->generation;
+	memset(thread, 0, sizeof(tcb));
+	thread->index = index;
+	thread->generation = generation;
+	thread->id = ((pthread_t) generation << SLOT_BITS) | index;
+
+	return thread;
+}
+
+void slot_release(tcb* thread)
+{
+	//a new generation makes every pthread_t still naming this slot stale
+	thread->generation++;
+	thread->status = 0;
+	thread->next_ready = free_slots;
+	free_slots = thread;
+}
+
+tcb* tcb_from_id(pthread_t tid)
+{
+	//the slot comes straight out of the id, the id check rejects stale generations
+	size_t slot = tid & (MAX_THREADS - 1);
+	if(slot >= slab_size)
+		return NULL;
+
+	tcb* thread = slot_tcb(slot);
+	if(thread->status == 0 || thread->id != tid)
+		return NULL;
+
+	return thread;
+}
+
+void queue_push(thread_queue* queue, tcb* thread)
+{
+	//append the thread to the tail of the queue
+	thread->next_ready = NULL;
+	thread->prev_ready = queue->tail;
+
+	if(queue->tail != NULL)
+		queue->tail->next_ready = thread;
+	else
+		queue->head = thread;
+	queue->tail = thread;
+}
+
+void queue_remove(thread_queue* queue, tcb* thread)
+{
+	//unlink the thread from wherever it sits in the queue
+	if(thread->prev_ready != NULL)
+		thread->prev_ready->next_ready = thread->next_ready;
+	else
+		queue->head = thread->next_ready;
+
+	if(thread->next_ready != NULL)
+		thread->next_ready->prev_ready = thread->prev_ready;
+	else
+		queue->tail = thread->prev_ready;
+
+	thread->next_ready = NULL;
+	thread->prev_ready = NULL;
+}
+
+tcb* queue_pop(thread_queue* queue)
+{
+	//take the thread at the head, NULL if the queue is empty
+	tcb* thread = queue->head;
+	if(thread != NULL)
+		queue_remove(queue, thread);
+	return thread;
+}
+
+int realtime(int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+int outranks(tcb* thread, tcb* running)
+{
+	//real-time threads preempt fair ones and lower real-time levels, fair threads only preempt SCHED_IDLE ones
+	if(realtime(thread->policy))
+		return !realtime(running->policy) || thread->priority > running->priority;
+	return running->policy == SCHED_IDLE && thread->policy != SCHED_IDLE;
+}
+int rt_level(int priority)
+{
+	//spread the 99 real-time priorities over the run queue levels above 0
+	return 1 + (priority - RT_PRIORITY_MIN) * (PRIORITY_LEVELS - 2) / (RT_PRIORITY_MAX - RT_PRIORITY_MIN);
+}
+tcb* heap_meld(tcb* a, tcb* b)
+{
+	//the root with the larger virtual runtime becomes the first child of the other, a wins ties
+	if(a == NULL)
+		return b;
+	if(b == NULL)
+		return a;
+	if(b->vruntime < a->vruntime)
+	{
+		tcb* swap = a;
+		a = b;
+		b = swap;
+	}
+
+	b->prev_ready = a;
+	b->next_ready = a->heap_child;
+	if(a->heap_child != NULL)
+		a->heap_child->prev_ready = b;
+	a->heap_child = b;
+	return a;
+}
+tcb* heap_merge_pairs(tcb* first)
+{
+	//meld a list of siblings into one heap: pairwise left to right, then the pairs right to left
+	tcb* pairs = NULL;
+	while(first != NULL)
+	{
+		tcb* a = first;
+		tcb* b = a->next_ready;
+		first = b != NULL ? b->next_ready : NULL;
+
+		a->next_ready = a->prev_ready = NULL;
+		if(b != NULL)
+			b->next_ready = b->prev_ready = NULL;
+
+		tcb* pair = heap_meld(a, b);
+		pair->next_ready = pairs;
+		pairs = pair;
+	}
+
+	tcb* root = NULL;
+	while(pairs != NULL)
+	{
+		tcb* next = pairs->next_ready;
+		pairs->next_ready = NULL;
+		root = heap_meld(root, pairs);
+		pairs = next;
+	}
+	return root;
+}
+void heap_remove(carrier* owner, tcb* thread)
+{
+	//cut the thread's subtree out of the heap, then meld its children back in
+	if(thread == owner->fair_heap)
+		owner->fair_heap = NULL;
+	else
+	{
+		if(thread->prev_ready->heap_child == thread)
+			thread->prev_ready->heap_child = thread->next_ready;
+		else
+			thread->prev_ready->next_ready = thread->next_ready;
+		if(thread->next_ready != NULL)
+			thread->next_ready->prev_ready = thread->prev_ready;
+	}
+
+	tcb* children = heap_merge_pairs(thread->heap_child);
+	owner->fair_heap = heap_meld(owner->fair_heap, children);
+
+	thread->heap_child = NULL;
+	thread->next_ready = NULL;
+	thread->prev_ready = NULL;
+}
+void fair_place(carrier* owner, tcb* thread)
+{
+	//a woken thread comes back within a slice of the carrier's virtual runtime: a sleeper gets up to
+	//half a slice of credit, but neither banks the time it slept nor carries a lead from another carrier
+	uint64_t credit = quantum / 2;
+	uint64_t low = owner->min_vruntime > credit ? owner->min_vruntime - credit : 0;
+	uint64_t high = owner->min_vruntime + quantum;
+	if(thread->vruntime < low)
+		thread->vruntime = low;
+	else if(thread->vruntime > high)
+		thread->vruntime = high;
+}
+void charge(tcb* thread, uint64_t now)
+{
+	//add the time since the thread was switched in to its CPU time, and weighted to its virtual runtime
+	if(thread->index < 0)
+		return;
+
+	uint64_t ran = now - thread->run_start;
+	thread->run_start = now;
+	thread->stats.cpu_ns += ran;
+
+	if(!realtime(thread->policy))
+	{
+		uint64_t weight = thread->policy == SCHED_IDLE ? IDLE_WEIGHT : FAIR_WEIGHT;
+		thread->vruntime += ran * FAIR_WEIGHT / weight;
+	}
+}
+void queue_thread(carrier* owner, tcb* thread)
+{
+	//called with the owner's run queue lock held
+	thread->status = READY;
+	thread->owner = owner;
+
+	//real-time threads go to the tail of the queue for their priority level,
+	//everything else into the heap ordered by virtual runtime
+	if(realtime(thread->policy))
+	{
+		queue_push(&owner->ready_queues[thread->priority], thread);
+		owner->ready_bitmap |= 1u << thread->priority;
+	}
+	else
+	{
+		thread->next_ready = NULL;
+		thread->prev_ready = NULL;
+		thread->heap_child = NULL;
+		owner->fair_heap = heap_meld(owner->fair_heap, thread);
+	}
+
+	owner->ready_count++;
+
+	//something is waiting for the carrier now, so the running thread needs a time slice
+	if(!owner->timer_armed)
+		timer_arm(owner);
+}
+
+void ready_enqueue(tcb* thread)
+{
+	//woken and new threads go on the calling carrier's queue, idle carriers steal from there
+	timeout_cancel(thread);
+	trace(TRACE_WAKE, thread, 0);
+
+	//time spent BLOCKED ends here and time spent READY starts
+	uint64_t now = clock_now();
+	if(thread->status == BLOCKED)
+		thread->stats.blocked_ns += now - thread->state_since;
+	thread->state_since = now;
+
+	carrier* owner = waking_carrier(thread);
+	spin_acquire(&owner->lock);
+	if(!realtime(thread->policy))
+		fair_place(owner, thread);
+	queue_thread(owner, thread);
+	spin_release(&owner->lock);
+	wake_idle_carrier();
+}
+
+int ready_splice(thread_queue* waiters)
+{
+	//makes a whole wait queue READY on the calling carrier with one clock read, one pairing pass and meld
+	//for the fair threads and one idle carrier wakeup, returns whether any of them outranks the caller
+	if(waiters->head == NULL)
+		return 0;
+	carrier* owner = waking_carrier(waiters->head);
+	spin_acquire(&owner->lock);
+	//nothing to switch away from on an offload helper
+	tcb* self = this_carrier() != NULL ? owner->current : NULL;
+	uint64_t now = clock_now();
+	tcb* fair = NULL;
+	int count = 0;
+	int switch_needed = 0;
+
+	tcb* thread = waiters->head;
+	while(thread != NULL)
+	{
+		tcb* next = thread->next_ready;
+		timeout_cancel(thread);
+		trace(TRACE_WAKE, thread, 0);
+		thread->stats.blocked_ns += now - thread->state_since;
+		thread->state_since = now;
+		thread->status = READY;
+		thread->owner = owner;
+		switch_needed |= self != NULL && outranks(thread, self);
+
+		if(realtime(thread->policy))
+		{
+			queue_push(&owner->ready_queues[thread->priority], thread);
+			owner->ready_bitmap |= 1u << thread->priority;
+		}
+		else
+		{
+			//the fair ones are collected as a sibling list for heap_merge_pairs
+			fair_place(owner, thread);
+			thread->heap_child = NULL;
+			thread->next_ready = fair;
+			fair = thread;
+		}
+
+		count++;
+		thread = next;
+	}
+	waiters->head = NULL;
+	waiters->tail = NULL;
+
+	owner->fair_heap = heap_meld(owner->fair_heap, heap_merge_pairs(fair));
+	owner->ready_count += count;
+	if(!owner->timer_armed)
+		timer_arm(owner);
+	spin_release(&owner->lock);
+	wake_idle_carrier();
+	return switch_needed;
+}
+
+void ready_remove(tcb* thread)
+{
+	//unlink a READY thread from wherever it sits in its owner's queue
+	carrier* owner = thread->owner;
+	thread->owner = NULL;
+	owner->ready_count--;
+
+	if(!realtime(thread->policy))
+	{
+		heap_remove(owner, thread);
+		return;
+	}
+
+	thread_queue* queue = &owner->ready_queues[thread->priority];
+	queue_remove(queue, thread);
+
+	//the level is empty now so clear its bit
+	if(queue->head == NULL)
+		owner->ready_bitmap &= ~(1u << thread->priority);
+}
+
+tcb* ready_dequeue(carrier* owner)
+{
+	//called with the owner's run queue lock held
+	//the highest set bit is the highest non-empty real-time priority level
+	if(owner->ready_bitmap != 0)
+	{
+		int level = 31 - __builtin_clz(owner->ready_bitmap);
+		tcb* thread = owner->ready_queues[level].head;
+		ready_remove(thread);
+		return thread;
+	}
+
+	//otherwise the fair thread that has run the least
+	tcb* thread = owner->fair_heap;
+	if(thread == NULL)
+		return NULL;
+
+	ready_remove(thread);
+	return thread;
+}
+
+tcb* steal_work(carrier* thief)
+{
+	//called with the thief's run queue lock held; pick the carrier with the most READY threads waiting, the counts
+	//are read without their locks and only pick the victim
+	carrier* victim = NULL;
+	int i;
+	for(i = 0; i < carrier_count; i++)
+		if(&carriers[i] != thief && carriers[i].ready_count > (victim != NULL ? victim->ready_count : 0))
+			victim = &carriers[i];
+
+	//two carriers stealing from each other would each wait for the other's lock, so a busy one is passed over;
+	//whoever holds it wakes an idle carrier again if it leaves threads queued
+	if(victim == NULL || !spin_try(&victim->lock))
+		return NULL;
+
+	//take half of its queue, highest priority first; the first thread taken runs right away
+	int count = (victim->ready_count + 1) / 2;
+	tcb* next = NULL;
+	tcb* pinned = NULL;
+	while(count > 0 && victim->ready_count > 0)
+	{
+		tcb* thread = ready_dequeue(victim);
+		if(thread->pinned)
+		{
+			thread->next_ready = pinned;
+			pinned = thread;
+			continue;
+		}
+
+		//a fair thread keeps its lead or lag relative to the carrier it moves to
+		if(!realtime(thread->policy))
+			thread->vruntime = thread->vruntime - victim->min_vruntime + thief->min_vruntime;
+		if(next == NULL)
+			next = thread;
+		else
+			queue_thread(thief, thread);
+		count--;
+	}
+
+	//pinned threads go back where they were
+	while(pinned != NULL)
+	{
+		tcb* thread = pinned;
+		pinned = thread->next_ready;
+		queue_thread(victim, thread);
+	}
+
+	spin_release(&victim->lock);
+	return next;
+}
+
+void run_lock_all()
+{
+	//in carrier order, the only order two run queue locks are ever waited for in
+	int i;
+	for(i = 0; i < carrier_count; i++)
+		spin_acquire(&carriers[i].lock);
+}
+void run_unlock_all()
+{
+	int i;
+	for(i = 0; i < carrier_count; i++)
+		spin_release(&carriers[i].lock);
+}
+
+void histogram_add(uint64_t* histogram, uint64_t ns)
+{
+	//bucket i counts samples from 2^i up to 2^(i+1) nanoseconds, 0 goes in bucket 0; carriers switching under
+	//their own run queue locks add to the same histogram
+	__atomic_add_fetch(&histogram[ns > 0 ? 63 - __builtin_clzll(ns) : 0], 1, __ATOMIC_RELAXED);
+}
+void switch_in(carrier* self, tcb* next, uint64_t now)
+{
+	//time spent READY ends when the thread gets the carrier
+	if(next != self->current && next->index >= 0)
+	{
+		next->stats.ready_ns += now - next->state_since;
+		histogram_add(sched_latency, now - next->state_since);
+	}
+
+	//the carrier's virtual runtime follows the fair threads it runs
+	next->run_start = now;
+	next->pinned = 0;
+	if(!realtime(next->policy) && next->vruntime > self->min_vruntime)
+		self->min_vruntime = next->vruntime;
+}
+tcb* choose_next_thread(carrier* self)
+{
+	//called with the carrier's run queue lock held
+	//take the thread at the head of the highest non-empty local priority level
+	tcb* next = ready_dequeue(self);
+
+	//the local queue is empty so try to take work from a busier carrier
+	if(next == NULL && carrier_count > 1)
+		next = steal_work(self);
+
+	//nothing is READY anywhere, the carrier parks in its idle loop
+	if(next == NULL)
+		next = &self->idle;
+
+	//next thread is set to RUNNING
+	next->status = RUNNING;
+	return next;
+}
+
+io_fd* io_state(int fd)
+{
+	//called with lock() held, grows the table to cover the fd
+	if(fd >= io_fd_count)
+	{
+		int count = io_fd_count > 0 ? io_fd_count : 64;
+		while(count <= fd)
+			count *= 2;
+
+		io_fd* table = realloc(io_fds, count * sizeof(io_fd));
+		if(table == NULL)
+			return NULL;
+		memset(table + io_fd_count, 0, (count - io_fd_count) * sizeof(io_fd));
+		io_fds = table;
+		io_fd_count = count;
+	}
+	return &io_fds[fd];
+}
+int io_register(int fd, io_fd* state)
+{
+	//edge triggered in both directions, so the fd is added once and never re-armed
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	event.data.fd = fd;
+	if(epoll_ctl(reactor_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+		return -1;
+
+	state->mode = FD_GREEN;
+	state->ready_in = 0;
+	state->ready_out = 0;
+	return 0;
+}
+int io_mode(int fd)
+{
+	//nothing is switched to O_NONBLOCK before the runtime is up
+	if(first || fd < 0)
+		return FD_PLAIN;
+
+	int saved_errno = errno;
+	lock();
+	io_fd* state = io_state(fd);
+	int mode = FD_PLAIN;
+	if(state != NULL)
+	{
+		if(state->mode == FD_UNKNOWN)
+		{
+			int flags = fcntl(fd, F_GETFL);
+			//a bad fd is left for the call itself to report
+			if(flags < 0)
+				state = NULL;
+			//the standard streams are shared with the parent, so they keep blocking
+			else if(fd <= STDERR_FILENO)
+				state->mode = FD_PLAIN;
+			else if(flags & O_NONBLOCK)
+				state->mode = FD_NONBLOCKING;
+			//epoll refuses regular files and directories
+			else if(io_register(fd, state) < 0)
+				state->mode = errno == EPERM ? FD_FILE : FD_PLAIN;
+			else
+				fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+		}
+		if(state != NULL)
+			mode = state->mode;
+	}
+	unlock();
+	errno = saved_errno;
+	return mode;
+}
+void io_adopt(int fd)
+{
+	//a fd the runtime made non-blocking itself, like an accepted connection
+	lock();
+	io_fd* state = io_state(fd);
+	if(state != NULL && io_register(fd, state) < 0)
+		state->mode = FD_PLAIN;
+	unlock();
+}
+void io_wait(int fd, int writing)
+{
+	//kernel threads the runtime did not start cannot park, they sleep in poll instead
+	if(this_carrier() == NULL)
+	{
+		struct pollfd wait = {fd, writing ? POLLOUT : POLLIN, 0};
+		poll(&wait, 1, -1);
+		return;
+	}
+
+	lock();
+	io_fd* state = &io_fds[fd];
+	int* ready = writing ? &state->ready_out : &state->ready_in;
+
+	//an edge arrived between the call failing with EAGAIN and here, so just retry the call
+	if(*ready)
+	{
+		*ready = 0;
+		unlock();
+		return;
+	}
+
+	tcb* self = current_tcb();
+	self->status = BLOCKED;
+	queue_push(writing ? &state->writers : &state->readers, self);
+	io_waiting++;
+
+	reactor_watch(UINT64_MAX);
+	schedule();
+	unlock();
+}
+void io_wake(thread_queue* waiters, int* ready)
+{
+	//called with lock() held, parked threads retry their call, with none the edge is kept for the next one
+	if(waiters->head == NULL)
+	{
+		*ready = 1;
+		return;
+	}
+
+	tcb* thread;
+	while((thread = queue_pop(waiters)) != NULL)
+	{
+		io_waiting--;
+		ready_enqueue(thread);
+	}
+}
+void reactor_watch(uint64_t deadline)
+{
+	//called with lock() held when a thread parks on I/O or a timeout, somebody has to look out for it:
+	//an idle carrier becomes the poller, a busy one checks on its ticks
+	if(!poller_active)
+		wake_idle_carrier();
+	//the poller is asleep until a later deadline, so it has to start over
+	else if(deadline < poller_deadline)
+		reactor_kick();
+
+	carrier* owner = this_carrier();
+	spin_acquire(&owner->lock);
+	if(!owner->timer_armed)
+		timer_arm(owner);
+	//with no carrier left to poll, a timeout due before the next tick would wait for it, whatever the woken
+	//thread's policy; the tick comes at the deadline instead
+	if(__atomic_load_n(&idle_carriers, __ATOMIC_RELAXED) == 0 && deadline != UINT64_MAX)
+		timer_advance(owner, deadline << WHEEL_TICK_SHIFT);
+	spin_release(&owner->lock);
+}
+int reactor_poll(int block)
+{
+	//called with lock() held, wakes the threads parked on fds epoll reports ready and
+	//the ones whose timeout passed, blocking until the next deadline when asked to
+	struct epoll_event events[IO_EVENTS];
+	int timeout = 0;
+	if(block)
+	{
+		poller_deadline = wheel_next();
+		timeout = -1;
+		if(poller_deadline != UINT64_MAX)
+		{
+			uint64_t now = wheel_clock();
+			timeout = poller_deadline > now ? (((poller_deadline - now) << WHEEL_TICK_SHIFT) + 999999) / 1000000 : 0;
+		}
+	}
+
+	int count;
+	if(timeout == 0)
+		count = epoll_wait(reactor_fd, events, IO_EVENTS, 0);
+	else
+	{
+		//an idle carrier waits in the kernel, with the lock dropped so other carriers keep going
+		poller_active = 1;
+		__atomic_add_fetch(&idle_carriers, 1, __ATOMIC_SEQ_CST);
+		unlock();
+		count = epoll_wait(reactor_fd, events, IO_EVENTS, timeout);
+		lock();
+		__atomic_sub_fetch(&idle_carriers, 1, __ATOMIC_SEQ_CST);
+		poller_active = 0;
+		__atomic_store_n(&poller_kicked, 0, __ATOMIC_RELAXED);
+	}
+
+	for(int i = 0; i < count; i++)
+	{
+		int fd = events[i].data.fd;
+		if(fd == reactor_wake_fd)
+		{
+			uint64_t value;
+			syscall(SYS_read, reactor_wake_fd, &value, sizeof(value));
+			continue;
+		}
+		if(fd == offload_fd)
+		{
+			offload_complete();
+			continue;
+		}
+
+		io_fd* state = &io_fds[fd];
+		if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+			io_wake(&state->readers, &state->ready_in);
+		if(events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+			io_wake(&state->writers, &state->ready_out);
+	}
+
+	wheel_expire();
+	return count;
+}
+ssize_t io_call(long number, int fd, int writing, void* buf, size_t count, long flags, long address, long length)
+{
+	//runs a read or write style syscall, parking the thread whenever a blocking fd would have blocked
+	int mode = io_mode(fd);
+	if(mode == FD_PLAIN || mode == FD_FILE)
+		return io_blocking(number, fd, writing, buf, count, flags, address, length, mode);
+	size_t total = 0;
+	while(1)
+	{
+		ssize_t done = syscall(number, fd, (char*) buf + total, count - total, flags, address, length);
+		if(mode != FD_GREEN)
+			return done;
+
+		if(done >= 0)
+		{
+			total += done;
+			//a blocking read returns whatever arrived, a blocking write only once all of it went out
+			if(!writing || total == count || done == 0)
+				return total;
+		}
+		else if(errno != EAGAIN)
+			return total > 0 ? (ssize_t) total : -1;
+
+		io_wait(fd, writing);
+	}
+}
+ssize_t io_blocking(long number, int fd, int writing, void* buf, size_t count, long flags, long address, long length, int mode)
+{
+	//a blocking fd epoll can't watch: calls that won't wait go straight to the kernel, the rest to the offload pool
+	if(first || this_carrier() == NULL)
+		return syscall(number, fd, buf, count, flags, address, length);
+
+	if(mode == FD_FILE)
+	{
+		//writes to a file only wait for the page cache, reads ask it first
+		if(writing)
+			return syscall(number, fd, buf, count, flags, address, length);
+		if(number == SYS_read)
+		{
+			struct iovec vector = {buf, count};
+			ssize_t done = preadv2(fd, &vector, 1, -1, RWF_NOWAIT);
+			if(done >= 0 || (errno != EAGAIN && errno != EOPNOTSUPP))
+				return done;
+		}
+	}
+	else
+	{
+		struct pollfd check = {fd, writing ? POLLOUT : POLLIN, 0};
+		if(poll(&check, 1, 0) != 0)
+			return syscall(number, fd, buf, count, flags, address, length);
+	}
+	return offload_syscall(number, fd, (long) buf, count, flags, address, length);
+}
+ssize_t read(int fd, void* buf, size_t count)
+{
+	return io_call(SYS_read, fd, 0, buf, count, 0, 0, 0);
+}
+ssize_t write(int fd, const void* buf, size_t count)
+{
+	return io_call(SYS_write, fd, 1, (void*) buf, count, 0, 0, 0);
+}
+ssize_t recvfrom(int fd, void* buf, size_t count, int flags, struct sockaddr* address, socklen_t* length)
+{
+	//MSG_DONTWAIT asks for EAGAIN, so the call is not parked
+	if(flags & MSG_DONTWAIT)
+		return syscall(SYS_recvfrom, fd, buf, count, flags, address, length);
+	return io_call(SYS_recvfrom, fd, 0, buf, count, flags, (long) address, (long) length);
+}
+ssize_t recv(int fd, void* buf, size_t count, int flags)
+{
+	return recvfrom(fd, buf, count, flags, NULL, NULL);
+}
+ssize_t sendto(int fd, const void* buf, size_t count, int flags, const struct sockaddr* address, socklen_t length)
+{
+	if(flags & MSG_DONTWAIT)
+		return syscall(SYS_sendto, fd, buf, count, flags, address, length);
+	return io_call(SYS_sendto, fd, 1, (void*) buf, count, flags, (long) address, length);
+}
+ssize_t send(int fd, const void* buf, size_t count, int flags)
+{
+	return sendto(fd, buf, count, flags, NULL, 0);
+}
+int accept4(int fd, struct sockaddr* address, socklen_t* length, int flags)
+{
+	int mode = io_mode(fd);
+	while(1)
+	{
+		//connections accepted on a blocking listener are blocking to the application, non-blocking underneath
+		int client = syscall(SYS_accept4, fd, address, length, mode == FD_GREEN ? flags | SOCK_NONBLOCK : flags);
+		if(client >= 0)
+		{
+			if(mode == FD_GREEN && !(flags & SOCK_NONBLOCK))
+				io_adopt(client);
+			return client;
+		}
+		if(errno != EAGAIN || mode != FD_GREEN)
+			return -1;
+
+		io_wait(fd, 0);
+	}
+}
+int accept(int fd, struct sockaddr* address, socklen_t* length)
+{
+	return accept4(fd, address, length, 0);
+}
+int connect(int fd, const struct sockaddr* address, socklen_t length)
+{
+	int mode = io_mode(fd);
+	int result = syscall(SYS_connect, fd, address, length);
+	if(result == 0 || errno != EINPROGRESS || mode != FD_GREEN)
+		return result;
+
+	//the handshake finishes in the background and the fd turns writable, SO_ERROR then says how it went;
+	//connecting again to find out would start a new attempt once a refused one has failed
+	while(1)
+	{
+		io_wait(fd, 1);
+
+		struct pollfd check = {fd, POLLOUT, 0};
+		if(poll(&check, 1, 0) == 0)
+			continue;
+
+		int error;
+		socklen_t size = sizeof(error);
+		if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) < 0)
+			return -1;
+		if(error != 0)
+		{
+			errno = error;
+			return -1;
+		}
+		return 0;
+	}
+}
+int close(int fd)
+{
+	if(first || fd < 0)
+		return syscall(SYS_close, fd);
+
+	int mode = FD_UNKNOWN;
+	lock();
+	if(fd < io_fd_count)
+	{
+		//threads still parked on the fd retry their call, and get EBADF once it is closed
+		io_fd* state = &io_fds[fd];
+		mode = state->mode;
+		if(this_carrier() != NULL)
+		{
+			io_wake(&state->readers, &state->ready_in);
+			io_wake(&state->writers, &state->ready_out);
+		}
+		//the number can be handed out again as soon as the kernel closes it, forget everything about it first
+		memset(state, 0, sizeof(io_fd));
+	}
+	unlock();
+
+	//closing a file may flush it to a disk or a remote filesystem, which blocks the carrier
+	if(mode == FD_FILE)
+		return offload_syscall(SYS_close, fd, 0, 0, 0, 0, 0);
+	return syscall(SYS_close, fd);
+}
+void* offload_main(void* arg)
+{
+	//helper kernel thread, makes the calls green threads hand off and signals the reactor as each one finishes
+	while(1)
+	{
+		spin_acquire(&offload_lock);
+		offload_request* request = offload_head;
+		if(request == NULL)
+		{
+			unsigned int seq = offload_seq;
+			spin_release(&offload_lock);
+			futex_wait(&offload_seq, seq);
+			continue;
+		}
+		offload_head = request->next;
+		if(offload_head == NULL)
+			offload_tail = NULL;
+		spin_release(&offload_lock);
+
+		errno = 0;
+		offload_caller = request->thread;
+		request->result = request->call(request);
+		offload_caller = NULL;
+		request->error = errno;
+
+		request->next = __atomic_load_n(&offload_done, __ATOMIC_RELAXED);
+		while(!__atomic_compare_exchange_n(&offload_done, &request->next, request, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		uint64_t one = 1;
+		syscall(SYS_write, offload_fd, &one, sizeof(one));
+	}
+	return NULL;
+}
+
+int offload_start()
+{
+	//the helpers and their eventfd are set up on the first call handed off
+	int state = __atomic_load_n(&offload_state, __ATOMIC_ACQUIRE);
+	if(state == POOL_RUNNING)
+		return 0;
+	if(state == POOL_STOPPED && __atomic_compare_exchange_n(&offload_state, &state, POOL_STARTING, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	{
+		int started = 0;
+		offload_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		struct epoll_event done;
+		done.events = EPOLLIN;
+		done.data.fd = offload_fd;
+		if(offload_fd >= 0 && epoll_ctl(reactor_fd, EPOLL_CTL_ADD, offload_fd, &done) == 0)
+		{
+			int i;
+			for(i = 0; i < OFFLOAD_THREADS; i++)
+				started += kernel_thread_start(offload_main, NULL) == 0;
+		}
+		__atomic_store_n(&offload_state, started > 0 ? POOL_RUNNING : POOL_FAILED, __ATOMIC_RELEASE);
+	}
+
+	while((state = __atomic_load_n(&offload_state, __ATOMIC_ACQUIRE)) == POOL_STARTING)
+		sched_yield();
+	return state == POOL_RUNNING ? 0 : EAGAIN;
+}
+
+void offload_complete()
+{
+	//called with lock() held when the eventfd fires, the threads whose calls finished are READY again
+	uint64_t value;
+	syscall(SYS_read, offload_fd, &value, sizeof(value));
+
+	offload_request* request = __atomic_exchange_n(&offload_done, NULL, __ATOMIC_ACQUIRE);
+	while(request != NULL)
+	{
+		offload_request* next = request->next;
+		io_waiting--;
+		ready_enqueue(request->thread);
+		request = next;
+	}
+}
+
+long offload_run(offload_request* request)
+{
+	//kernel threads the runtime did not start, and everything before it is up, make the call themselves
+	if(first || this_carrier() == NULL || offload_start() != 0)
+		return request->call(request);
+
+	//parked like a thread waiting on a fd, so a carrier keeps polling the reactor for the completion
+	lock();
+	tcb* self = current_tcb();
+	request->thread = self;
+	self->status = BLOCKED;
+	io_waiting++;
+	reactor_watch(UINT64_MAX);
+
+	request->next = NULL;
+	spin_acquire(&offload_lock);
+	if(offload_tail != NULL)
+		offload_tail->next = request;
+	else
+		offload_head = request;
+	offload_tail = request;
+	offload_seq++;
+	spin_release(&offload_lock);
+	futex_wake(&offload_seq, 1);
+
+	schedule();
+	unlock();
+	errno = request->error;
+	return request->result;
+}
+
+long offload_do_syscall(offload_request* request)
+{
+	long* args = request->args;
+	return syscall(args[0], args[1], args[2], args[3], args[4], args[5], args[6]);
+}
+
+long offload_syscall(long number, long a, long b, long c, long d, long e, long f)
+{
+	offload_request request = {offload_do_syscall, {number, a, b, c, d, e, f}};
+	return offload_run(&request);
+}
+
+long offload_do_call(offload_request* request)
+{
+	long (*fn)(void*) = (long (*)(void*)) request->args[0];
+	return fn((void*) request->args[1]);
+}
+
+long offload_call(long (*fn)(void* arg), void* arg)
+{
+	offload_request request = {offload_do_call, {(long) fn, (long) arg}};
+	return offload_run(&request);
+}
+
+//file calls that can wait on a disk or a remote filesystem, made on an offload helper
+int open(const char* path, int flags, ...)
+{
+	mode_t mode = 0;
+	//O_TMPFILE shares bits with O_DIRECTORY, only all of them together pass a mode
+	if((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE)
+	{
+		va_list args;
+		va_start(args, flags);
+		mode = va_arg(args, int);
+		va_end(args);
+	}
+	return offload_syscall(SYS_openat, AT_FDCWD, (long) path, flags, mode, 0, 0);
+}
+
+int openat(int dirfd, const char* path, int flags, ...)
+{
+	mode_t mode = 0;
+	//O_TMPFILE shares bits with O_DIRECTORY, only all of them together pass a mode
+	if((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE)
+	{
+		va_list args;
+		va_start(args, flags);
+		mode = va_arg(args, int);
+		va_end(args);
+	}
+	return offload_syscall(SYS_openat, dirfd, (long) path, flags, mode, 0, 0);
+}
+
+int creat(const char* path, mode_t mode)
+{
+	return open(path, O_CREAT | O_WRONLY | O_TRUNC, mode);
+}
+
+//the same calls under the names large file builds and _FORTIFY_SOURCE use, a fortified open only has a mode with O_CREAT
+//or O_TMPFILE, where it calls open itself
+int open64(const char* path, int flags, ...) __attribute__((alias("open")));
+int openat64(int dirfd, const char* path, int flags, ...) __attribute__((alias("openat")));
+
+int __open_2(const char* path, int flags)
+{
+	return offload_syscall(SYS_openat, AT_FDCWD, (long) path, flags, 0, 0, 0);
+}
+
+int __open64_2(const char* path, int flags) __attribute__((alias("__open_2")));
+
+int __openat_2(int dirfd, const char* path, int flags)
+{
+	return offload_syscall(SYS_openat, dirfd, (long) path, flags, 0, 0, 0);
+}
+
+int __openat64_2(int dirfd, const char* path, int flags) __attribute__((alias("__openat_2")));
+
+//stdio opens, reads and writes through libc internals that never reach the wrappers above, so the FILEs the
+//runtime hands out (fopen's, and stdin once it is up) are cookie streams whose I/O calls them instead
+ssize_t stdio_read(void* cookie, char* buf, size_t size)
+{
+	return read((int)(long) cookie, buf, size);
+}
+
+ssize_t stdio_write(void* cookie, const char* buf, size_t size)
+{
+	return write((int)(long) cookie, buf, size);
+}
+
+int stdio_seek(void* cookie, off64_t* offset, int whence)
+{
+	off64_t at = lseek64((int)(long) cookie, *offset, whence);
+	if(at < 0)
+		return -1;
+	*offset = at;
+	return 0;
+}
+
+int stdio_close(void* cookie)
+{
+	return close((int)(long) cookie);
+}
+
+FILE* stdio_wrap(int fd, const char* mode)
+{
+	cookie_io_functions_t calls = {stdio_read, stdio_write, stdio_seek, stdio_close};
+	FILE* stream = fopencookie((void*)(long) fd, mode, calls);
+	if(stream == NULL)
+		return NULL;
+
+	//fileno, and isatty(fileno(stream)) with it, still see the fd; a terminal is line buffered as libc would have it
+	stream->_fileno = fd;
+	if(isatty(fd))
+		setvbuf(stream, NULL, _IOLBF, BUFSIZ);
+	return stream;
+}
+
+int stdio_flags(const char* mode)
+{
+	//the open flags of an fopen mode, -1 for one fopen would refuse
+	int flags;
+	if(mode[0] == 'r')
+		flags = O_RDONLY;
+	else if(mode[0] == 'w')
+		flags = O_WRONLY | O_CREAT | O_TRUNC;
+	else if(mode[0] == 'a')
+		flags = O_WRONLY | O_CREAT | O_APPEND;
+	else
+		return -1;
+
+	//glibc reads at most 6 more characters, up to a ",ccs=" suffix
+	int i;
+	for(i = 1; i < 7 && mode[i] != 0 && mode[i] != ','; i++)
+	{
+		if(mode[i] == '+')
+			flags = (flags & ~O_ACCMODE) | O_RDWR;
+		else if(mode[i] == 'e')
+			flags |= O_CLOEXEC;
+		else if(mode[i] == 'x')
+			flags |= O_EXCL;
+	}
+	return flags;
+}
+
+FILE* fopen(const char* path, const char* mode)
+{
+	int flags = stdio_flags(mode);
+	if(flags < 0)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	int fd = open(path, flags, 0666);
+	if(fd < 0)
+		return NULL;
+	FILE* stream = stdio_wrap(fd, mode);
+	if(stream == NULL)
+	{
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+	}
+	return stream;
+}
+
+FILE* fopen64(const char* path, const char* mode) __attribute__((alias("fopen")));
+
+void stdio_start()
+{
+	//stdin is swapped for a cookie stream on the same fd, unless it already buffered input the new one would lose
+	if(stdin->_IO_read_ptr != stdin->_IO_read_end)
+		return;
+	FILE* stream = stdio_wrap(STDIN_FILENO, "r");
+	if(stream != NULL)
+		stdin = stream;
+}
+
+#ifndef SYS_newfstatat
+long offload_fstatat(offload_request* request)
+{
+	//32-bit targets have only fstatat64, whose struct is not the caller's struct stat, so libc converts
+	static int (*libc_fstatat)(int, const char*, struct stat*, int);
+	if(libc_fstatat == NULL)
+		libc_fstatat = dlsym(RTLD_NEXT, "fstatat");
+	long* args = request->args;
+	return libc_fstatat(args[0], (const char*) args[1], (struct stat*) args[2], args[3]);
+}
+#endif
+
+int fstatat(int dirfd, const char* path, struct stat* buf, int flags)
+{
+#ifdef SYS_newfstatat
+	return offload_syscall(SYS_newfstatat, dirfd, (long) path, (long) buf, flags, 0, 0);
+#else
+	offload_request request = {offload_fstatat, {dirfd, (long) path, (long) buf, flags}};
+	return offload_run(&request);
+#endif
+}
+
+int stat(const char* path, struct stat* buf)
+{
+	return fstatat(AT_FDCWD, path, buf, 0);
+}
+
+int lstat(const char* path, struct stat* buf)
+{
+	return fstatat(AT_FDCWD, path, buf, AT_SYMLINK_NOFOLLOW);
+}
+
+int access(const char* path, int mode)
+{
+	return offload_syscall(SYS_faccessat, AT_FDCWD, (long) path, mode, 0, 0, 0);
+}
+
+int fsync(int fd)
+{
+	return offload_syscall(SYS_fsync, fd, 0, 0, 0, 0, 0);
+}
+
+int fdatasync(int fd)
+{
+	return offload_syscall(SYS_fdatasync, fd, 0, 0, 0, 0, 0);
+}
+
+int unlink(const char* path)
+{
+	return offload_syscall(SYS_unlinkat, AT_FDCWD, (long) path, 0, 0, 0, 0);
+}
+
+int rmdir(const char* path)
+{
+	return offload_syscall(SYS_unlinkat, AT_FDCWD, (long) path, AT_REMOVEDIR, 0, 0, 0);
+}
+
+int mkdir(const char* path, mode_t mode)
+{
+	return offload_syscall(SYS_mkdirat, AT_FDCWD, (long) path, mode, 0, 0, 0);
+}
+
+int rename(const char* from, const char* to)
+{
+	return offload_syscall(SYS_renameat2, AT_FDCWD, (long) from, AT_FDCWD, (long) to, 0, 0);
+}
+
+ssize_t pread(int fd, void* buf, size_t count, off_t offset)
+{
+	//served from the page cache in place when it can be
+	if(!first && this_carrier() != NULL)
+	{
+		struct iovec vector = {buf, count};
+		ssize_t done = preadv2(fd, &vector, 1, offset, RWF_NOWAIT);
+		if(done >= 0 || (errno != EAGAIN && errno != EOPNOTSUPP))
+			return done;
+	}
+	return offload_syscall(SYS_pread64, fd, (long) buf, count, offset, 0, 0);
+}
+
+long offload_getaddrinfo(offload_request* request)
+{
+	static int (*libc_getaddrinfo)(const char*, const char*, const struct addrinfo*, struct addrinfo**);
+	if(libc_getaddrinfo == NULL)
+		libc_getaddrinfo = dlsym(RTLD_NEXT, "getaddrinfo");
+	long* args = request->args;
+	return libc_getaddrinfo((const char*) args[0], (const char*) args[1], (const struct addrinfo*) args[2], (struct addrinfo**) args[3]);
+}
+
+int getaddrinfo(const char* node, const char* service, const struct addrinfo* hints, struct addrinfo** result)
+{
+	//name lookups read files and wait on DNS servers
+	offload_request request = {offload_getaddrinfo, {(long) node, (long) service, (long) hints, (long) result}};
+	return offload_run(&request);
+}
+
+uint64_t clock_now()
+{
+	//CLOCK_MONOTONIC in nanoseconds, for run time accounting, timeouts and trace timestamps
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+uint64_t wheel_clock()
+{
+	//current time in wheel ticks
+	return clock_now() >> WHEEL_TICK_SHIFT;
+}
+void wheel_insert(tcb* thread, uint64_t deadline)
+{
+	//called with lock() held, files the thread in the lowest level whose ring still reaches the deadline
+	int level = 0;
+	while(level < WHEEL_LEVELS - 1 && (deadline >> (level * WHEEL_BITS)) - (wheel_now >> (level * WHEEL_BITS)) >= WHEEL_SLOTS)
+		level++;
+
+	//beyond the top ring it waits in the furthest slot and is filed again when that slot cascades
+	uint64_t span = deadline >> (level * WHEEL_BITS);
+	uint64_t furthest = (wheel_now >> (level * WHEEL_BITS)) + WHEEL_SLOTS;
+	if(span > furthest)
+		span = furthest;
+
+	int slot = span & WHEEL_MASK;
+	tcb** head = &wheel[level][slot];
+	thread->deadline = deadline;
+	thread->timer_slot = head;
+	thread->prev_timer = NULL;
+	thread->next_timer = *head;
+	if(*head != NULL)
+		(*head)->prev_timer = thread;
+	*head = thread;
+
+	wheel_bitmap[level] |= 1ull << slot;
+	wheel_count++;
+}
+void wheel_remove(tcb* thread)
+{
+	//called with lock() held, does nothing when no timeout is pending
+	tcb** head = thread->timer_slot;
+	if(head == NULL)
+		return;
+
+	if(thread->prev_timer != NULL)
+		thread->prev_timer->next_timer = thread->next_timer;
+	else
+		*head = thread->next_timer;
+	if(thread->next_timer != NULL)
+		thread->next_timer->prev_timer = thread->prev_timer;
+
+	if(*head == NULL)
+	{
+		int index = head - &wheel[0][0];
+		wheel_bitmap[index / WHEEL_SLOTS] &= ~(1ull << (index % WHEEL_SLOTS));
+	}
+
+	thread->timer_slot = NULL;
+	thread->next_timer = NULL;
+	thread->prev_timer = NULL;
+	wheel_count--;
+}
+uint64_t wheel_next()
+{
+	//earliest tick anything in the wheel can be due, UINT64_MAX when it is empty, exact for the
+	//lowest level and the start of the slot's span above it, where it cascades
+	uint64_t next = UINT64_MAX;
+	for(int level = 0; level < WHEEL_LEVELS; level++)
+	{
+		uint64_t bits = wheel_bitmap[level];
+		if(bits == 0)
+			continue;
+
+		//rotate so the slot after the current one is bit 0, the distance to it is then the first set bit
+		uint64_t span = wheel_now >> (level * WHEEL_BITS);
+		int shift = (span + 1) & WHEEL_MASK;
+		if(shift != 0)
+			bits = (bits >> shift) | (bits << (WHEEL_SLOTS - shift));
+
+		uint64_t due = (span + 1 + __builtin_ctzll(bits)) << (level * WHEEL_BITS);
+		if(due < next)
+			next = due;
+	}
+	return next;
+}
+void timeout_fire(tcb* thread)
+{
+	//take the thread off whatever it waits on and let it run, it sees timed_out set
+	thread->timed_out = 1;
+	if(thread->wait_queue != NULL)
+		queue_remove(thread->wait_queue, thread);
+	if(thread->join_target != NULL)
+		thread->join_target->waiting_on_me = NULL;
+	thread->wait_queue = NULL;
+	thread->join_target = NULL;
+
+	//a condition variable waiter still has to get its mutex back first
+	if(thread->wait_mutex != NULL)
+		cond_wake(thread);
+	else
+		ready_enqueue(thread);
+}
+void wheel_expire()
+{
+	//called with lock() held, runs the wheel up to the current tick, firing every timeout that passed
+	uint64_t now = wheel_clock();
+	while(wheel_now < now)
+	{
+		//skip straight to the next tick something is filed at
+		uint64_t next = wheel_next();
+		if(next > now)
+		{
+			wheel_now = now;
+			break;
+		}
+		wheel_now = next;
+
+		//a slot in a higher level is spread over the levels below as its span starts, highest first
+		for(int level = WHEEL_LEVELS - 1; level > 0; level--)
+		{
+			if((wheel_now & ((1ull << (level * WHEEL_BITS)) - 1)) != 0)
+				continue;
+
+			int slot = (wheel_now >> (level * WHEEL_BITS)) & WHEEL_MASK;
+			tcb* thread = wheel[level][slot];
+			while(thread != NULL)
+			{
+				tcb* later = thread->next_timer;
+				wheel_remove(thread);
+				wheel_insert(thread, thread->deadline);
+				thread = later;
+			}
+		}
+
+		tcb* thread;
+		while((thread = wheel[0][wheel_now & WHEEL_MASK]) != NULL)
+		{
+			wheel_remove(thread);
+			timeout_fire(thread);
+		}
+	}
+}
+int timeout_start(tcb* self, const struct timespec* time, clockid_t clock, int absolute)
+{
+	//called with lock() held, puts the thread on the wheel before it blocks, -1 if the time already passed
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t monotonic = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+	int64_t deadline = (int64_t) time->tv_sec * 1000000000 + time->tv_nsec;
+
+	//deadlines on other clocks are moved onto CLOCK_MONOTONIC as of now
+	if(!absolute)
+		deadline += monotonic;
+	else if(clock != CLOCK_MONOTONIC)
+	{
+		struct timespec other;
+		if(clock_gettime(clock, &other) == 0)
+			deadline += monotonic - ((int64_t) other.tv_sec * 1000000000 + other.tv_nsec);
+	}
+	if(deadline <= monotonic)
+		return -1;
+
+	//rounded up, so a timeout never fires early
+	uint64_t tick = ((uint64_t) deadline + (1 << WHEEL_TICK_SHIFT) - 1) >> WHEEL_TICK_SHIFT;
+	self->timed_out = 0;
+	wheel_insert(self, tick);
+	reactor_watch(tick);
+	return 0;
+}
+void timeout_cancel(tcb* thread)
+{
+	//the thread was woken before its timeout, called with lock() held
+	wheel_remove(thread);
+	thread->wait_queue = NULL;
+	thread->join_target = NULL;
+}
+int clock_nanosleep(clockid_t clock, int flags, const struct timespec* request, struct timespec* remaining)
+{
+	if(request->tv_nsec < 0 || request->tv_nsec >= 1000000000)
+		return EINVAL;
+
+	//before the runtime is up, and on kernel threads it did not start, the kernel does the sleeping
+	if(first || this_carrier() == NULL)
+	{
+		int saved_errno = errno;
+		int result = syscall(SYS_clock_nanosleep, clock, flags, request, remaining) < 0 ? errno : 0;
+		errno = saved_errno;
+		return result;
+	}
+
+	lock();
+	tcb* self = current_tcb();
+	if(timeout_start(self, request, clock, flags & TIMER_ABSTIME) == 0)
+	{
+		self->status = BLOCKED;
+		schedule();
+	}
+	unlock();
+
+	//a green sleep is never interrupted, there is nothing left of it
+	if(remaining != NULL && !(flags & TIMER_ABSTIME))
+	{
+		remaining->tv_sec = 0;
+		remaining->tv_nsec = 0;
+	}
+	return 0;
+}
+int nanosleep(const struct timespec* request, struct timespec* remaining)
+{
+	int error = clock_nanosleep(CLOCK_MONOTONIC, 0, request, remaining);
+	if(error != 0)
+	{
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+int usleep(useconds_t usec)
+{
+	struct timespec request = {usec / 1000000, (usec % 1000000) * 1000};
+	return nanosleep(&request, NULL);
+}
+unsigned int sleep(unsigned int seconds)
+{
+	struct timespec request = {seconds, 0};
+	nanosleep(&request, NULL);
+	return 0;
+}
+
+uint64_t trace_id(tcb* thread)
+{
+	return thread->index < 0 ? TRACE_IDLE : thread->id;
+}
+
+void trace_record(int type, tcb* thread, uint64_t arg)
+{
+	//called with lock() held, so only this carrier writes its ring and nothing preempts the write
+	carrier* self = this_carrier();
+	if(self == NULL || self->trace_ring == NULL)
+		return;
+
+	trace_event* event = &self->trace_ring[self->trace_head % TRACE_EVENTS];
+	event->time = clock_now();
+	event->type = type;
+	event->thread = trace_id(thread);
+	event->arg = arg;
+	self->trace_head++;
+}
+
+void trace_print_name(FILE* out, uint64_t thread)
+{
+	if(thread == TRACE_IDLE)
+		fprintf(out, "idle");
+	else
+		fprintf(out, "thread %llu", (unsigned long long) thread);
+}
+
+int trace_export(const char* path)
+{
+	//writes every carrier's ring as Chrome/Perfetto trace JSON: one track per carrier with a slice
+	//for each stretch a thread ran, and instant events for blocks, wakes, creates, exits and semaphore ops
+	static const char* names[] = {"", "switch", "block", "wake", "create", "exit", "sem_wait", "sem_post"};
+
+	//a stream of libc's own, fopen's would write through write() and so take the lock again
+	int fd = syscall(SYS_openat, AT_FDCWD, path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	FILE* out = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if(out == NULL)
+	{
+		if(fd >= 0)
+			syscall(SYS_close, fd);
+		return -1;
+	}
+
+	lock();
+
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf(out, "{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\",\"args\":{\"name\":\"green threads\"}}");
+
+	int i;
+	for(i = 0; i < carrier_count; i++)
+	{
+		carrier* c = &carriers[i];
+		if(c->trace_ring == NULL)
+			continue;
+
+		fprintf(out, ",\n{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":\"carrier %d\"}}", i, i);
+
+		//oldest surviving event first
+		uint64_t first = c->trace_head > TRACE_EVENTS ? c->trace_head - TRACE_EVENTS : 0;
+		uint64_t slice_start = 0;
+		uint64_t running = 0;
+		int in_slice = 0;
+		uint64_t n;
+
+		for(n = first; n < c->trace_head; n++)
+		{
+			trace_event* event = &c->trace_ring[n % TRACE_EVENTS];
+			double time = (event->time - trace_epoch) / 1000.0;
+
+			if(event->type == TRACE_SWITCH)
+			{
+				//a switch ends the running thread's slice and starts the next one
+				if(in_slice && running != TRACE_IDLE)
+				{
+					fprintf(out, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"name\":\"", i, (slice_start - trace_epoch) / 1000.0, (event->time - slice_start) / 1000.0);
+					trace_print_name(out, running);
+					fprintf(out, "\"}");
+				}
+				running = event->thread;
+				slice_start = event->time;
+				in_slice = 1;
+				continue;
+			}
+
+			fprintf(out, ",\n{\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"name\":\"%s\",\"args\":{\"thread\":\"", i, time, names[event->type]);
+			trace_print_name(out, event->thread);
+			fprintf(out, "\",\"arg\":\"0x%llx\"}}", (unsigned long long) event->arg);
+		}
+	}
+
+	fprintf(out, "\n]}\n");
+
+	unlock();
+
+	return fclose(out);
+}
+
+void trace_export_at_exit()
+{
+	trace_export(trace_path);
+}
+
+size_t stack_size_from_attr(const pthread_attr_t* attr)
+{
+	//no attributes means the default size
+	size_t size = STACK_SIZE;
+
+	if(attr != NULL)
+	{
+		//an attr where no size was set reports libc's default, so only a size other than that counts as asked for;
+		//an explicit request for exactly the default can't be told apart and gets the runtime's default too
+		pthread_attr_t defaults;
+		size_t default_size = 0;
+		if(pthread_getattr_default_np(&defaults) == 0)
+		{
+			pthread_attr_getstacksize(&defaults, &default_size);
+			pthread_attr_destroy(&defaults);
+		}
+		pthread_attr_getstacksize(attr, &size);
+		if(size == default_size)
+			size = STACK_SIZE;
+	}
+
+	//stacks are mapped in whole pages
+	return (size + page_size - 1) & ~(page_size - 1);
+}
+
+int stack_guard(char* guard)
+{
+	//each guard page would be a mapping of its own with mprotect, two per stack against vm.max_map_count, which
+	//stops the process short of 33k threads by default; only older kernels without guard regions fall back to it
+	if(madvise(guard, page_size, MADV_GUARD_INSTALL) == 0)
+		return 0;
+	return mprotect(guard, page_size, PROT_NONE);
+}
+
+stack_class* stack_class_for(size_t size)
+{
+	//the class for this size, or an unused one to claim, NULL when every class is taken by other sizes
+	int i;
+	stack_class* pool = NULL;
+	for(i = 0; i < STACK_CLASSES; i++)
+	{
+		if(stack_pool[i].size == size)
+			return &stack_pool[i];
+		if(pool == NULL && stack_pool[i].size == 0)
+			pool = &stack_pool[i];
+	}
+	return pool;
+}
+
+void* stack_alloc(size_t size)
+{
+	stack_class* pool = stack_class_for(size);
+
+	//reuse a stack of the same size if an exited thread left one behind
+	if(pool != NULL && pool->head != NULL)
+	{
+		void* stack = pool->head;
+		pool->head = *(void**) stack;
+		pool->count--;
+		return stack;
+	}
+
+	//otherwise carve a new one out of the class's chunk, mapping the next chunk when that one is used up
+	size_t span = size + page_size;
+	if(pool != NULL && pool->chunk_left == 0)
+	{
+		long fit = STACK_CHUNK_BYTES / span > 0 ? STACK_CHUNK_BYTES / span : 1;
+		char* chunk = mmap(NULL, fit * span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+		if(chunk == MAP_FAILED)
+			return NULL;
+		pool->size = size;
+		pool->chunk = chunk;
+		pool->chunk_left = fit;
+	}
+
+	//a PROT_NONE guard page below every stack, so an overflow faults instead of running into the stack underneath;
+	//with every class taken by other sizes the stack gets a mapping of its own
+	char* mapping;
+	if(pool != NULL)
+		mapping = pool->chunk;
+	else if((mapping = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0)) == MAP_FAILED)
+		return NULL;
+
+	if(stack_guard(mapping) != 0)
+	{
+		if(pool == NULL)
+			munmap(mapping, span);
+		return NULL;
+	}
+	if(pool != NULL)
+	{
+		pool->chunk += span;
+		pool->chunk_left--;
+	}
+	return mapping + page_size;
+}
+
+void stack_release(void* stack, size_t size)
+{
+	stack_class* pool = stack_class_for(size);
+
+	//keep the stack for the next pthread_create, unless the pool is already full
+	if(pool != NULL && pool->count < STACK_POOL_MAX)
+	{
+		pool->size = size;
+		*(void**) stack = pool->head;
+		pool->head = stack;
+		pool->count++;
+		return;
+	}
+
+	//a stack carved out of a chunk leaves a hole in it, the rest of the chunk stays mapped
+	munmap((char*) stack - page_size, size + page_size);
+}
+
+void finish_switch()
+{
+	//runs on the new thread right after a switch, once the previous thread is off its stack, and drops the locks
+	//the switch was made under
+	carrier* self = this_carrier();
+	tcb* previous = self->previous;
+	self->previous = NULL;
+
+	//an exited thread's stack can only go back to the pool now that nothing is running on it; it switched out
+	//from pthread_exit, so the runtime lock is still held
+	if(previous != NULL && previous->status == EXITED && previous->stack != NULL)
+	{
+		stack_release(previous->stack, previous->stack_size);
+		previous->stack = NULL;
+
+		//nobody will join a detached thread, so its slot is free as soon as it is off the stack
+		if(previous->detached)
+			slot_release(previous);
+	}
+
+	//a thread that blocked can be woken, and so queued on another carrier, only once it is off its stack
+	if(self->handoff)
+	{
+		self->handoff = 0;
+		runtime_drop();
+	}
+	spin_release(&self->lock);
+}
+
+void schedule()
+{
+	//called with lock() held, returns with it still held, possibly on another carrier
+	carrier* self = this_carrier();
+	if(self == NULL)
+	{
+		//an offloaded call tried to wait on the runtime, which only green threads can do
+		static const char message[] = "threads: offload_call fn waited on a runtime object, see threads.h\n";
+		syscall(SYS_write, 2, message, sizeof(message) - 1);
+		abort();
+	}
+
+	//the runtime lock is handed over with a switch and taken again once the thread is back
+	spin_acquire(&self->lock);
+	if(reschedule(self, 1))
+		runtime_acquire();
+}
+
+int reschedule(carrier* self, int handoff)
+{
+	//called with the carrier's run queue lock held, and with the runtime lock as well when handoff is set; drops
+	//the run queue lock, and returns 1 with the runtime lock dropped too when it switched away and back, 0 with it
+	//still held when the thread kept running
+	tcb* previous = self->current;
+
+	//nothing else is READY here, so a thread that can keep running just does
+	if(previous->status == RUNNING && self->ready_count == 0)
+	{
+		spin_release(&self->lock);
+		return 0;
+	}
+
+	//a SCHED_FIFO thread keeps the carrier until it blocks or a higher level is READY
+	if(previous->status == RUNNING && previous->policy == SCHED_FIFO && (self->ready_bitmap >> previous->priority >> 1) == 0)
+	{
+		spin_release(&self->lock);
+		return 0;
+	}
+
+	uint64_t now = clock_now();
+	charge(previous, now);
+	//a thread still RUNNING is being preempted, any other gave up the carrier itself
+	int preempted = previous->status == RUNNING;
+	previous->state_since = now;
+
+	//if the thread we just came out of hasn't exited and isn't blocked then put it back on the run queue
+	if(previous->status != EXITED && previous->status != BLOCKED)
+		queue_thread(self, previous);
+
+	if(previous->status == BLOCKED)
+		trace(TRACE_BLOCK, previous, 0);
+
+	tcb* next = choose_next_thread(self);
+	if(next != previous)
+	{
+		if(preempted)
+			previous->stats.involuntary_switches++;
+		else
+			previous->stats.voluntary_switches++;
+	}
+	switch_in(self, next, now);
+
+	//whatever is still queued here can be picked up by an idle carrier
+	if(self->ready_count > 0)
+		wake_idle_carrier();
+
+	if(previous == next)
+	{
+		spin_release(&self->lock);
+		return 0;
+	}
+
+	//save the context of the thread we just came out of and switch to the next thread
+	//context_switch returns here once the previous thread is scheduled again
+	trace(TRACE_SWITCH, next, trace_id(previous));
+	self->current = next;
+	self->previous = previous;
+	self->handoff = handoff;
+	previous->saved_errno = errno;
+	context_switch(&previous->sp, next->sp);
+	finish_switch();
+	errno = previous->saved_errno;
+	return 1;
+}
+
+void carrier_idle()
+{
+	//loop a carrier runs when it has nothing to do, entered holding the carrier's run queue lock like any thread
+	//switched to, and otherwise holding no lock while it looks for work
+	carrier* self = this_carrier();
+	//set once the carrier has counted itself idle, from then on whoever queues work wakes it
+	int parking = 0;
+	unsigned int seq = 0;
+
+	finish_switch();
+	while(1)
+	{
+		spin_acquire(&self->lock);
+		tcb* next = ready_dequeue(self);
+		if(next == NULL && carrier_count > 1)
+			next = steal_work(self);
+
+		if(next != NULL)
+		{
+			if(parking)
+				__atomic_sub_fetch(&idle_carriers, 1, __ATOMIC_SEQ_CST);
+			parking = 0;
+
+			trace(TRACE_SWITCH, next, TRACE_IDLE);
+			switch_in(self, next, clock_now());
+			next->status = RUNNING;
+			self->current = next;
+			self->previous = &self->idle;
+			self->handoff = 0;
+			context_switch(&self->idle.sp, next->sp);
+			finish_switch();
+			continue;
+		}
+		spin_release(&self->lock);
+
+		if(parking)
+		{
+			//still nothing after the last look, sleep until some carrier queues work
+			futex_wait(&work_seq, seq);
+			__atomic_sub_fetch(&idle_carriers, 1, __ATOMIC_SEQ_CST);
+			parking = 0;
+			//with fewer cores than carriers the waker may have just lost its core to us, likely with the runtime
+			//lock held or the rest of a batch to queue; it gets it back before we take a thread off it
+			syscall(SYS_sched_yield);
+			continue;
+		}
+
+		//nothing to run anywhere: with threads parked on I/O or timeouts pending, one idle carrier
+		//waits in epoll for them, until the next deadline
+		runtime_acquire();
+		int polled = (io_waiting > 0 || wheel_count > 0) && !poller_active;
+		if(polled)
+			reactor_poll(1);
+		runtime_drop();
+
+		//the others park until some carrier queues work, after one more look at the queues now that whoever
+		//queues work from here on wakes them
+		if(!polled)
+		{
+			__atomic_add_fetch(&idle_carriers, 1, __ATOMIC_SEQ_CST);
+			seq = __atomic_load_n(&work_seq, __ATOMIC_SEQ_CST);
+			parking = 1;
+		}
+	}
+}
+
+void* carrier_main(void* arg)
+{
+	//kernel thread body of carriers 1 and up, the idle loop runs on its own stack
+	carrier* self = arg;
+	local_carrier = self;
+	self->tid = syscall(SYS_gettid);
+	timer_start(self);
+
+	//the idle loop starts out like a thread switched to, preemption disabled and the run queue lock held
+	preempt_disable();
+	spin_acquire(&self->lock);
+	carrier_idle();
+	return NULL;
+}
+
+int kernel_thread_start(void* (*start_routine)(void*), void* arg)
+{
+	//the real pthread_create from libc, ours only makes green threads
+	static int (*kernel_thread_create)(pthread_t*, const pthread_attr_t*, void *(*)(void *), void*);
+	if(kernel_thread_create == NULL)
+		kernel_thread_create = dlsym(RTLD_NEXT, "pthread_create");
+	if(kernel_thread_create == NULL)
+		return EAGAIN;
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_t kernel_thread;
+	int error = kernel_thread_create(&kernel_thread, &attr, start_routine, arg);
+	pthread_attr_destroy(&attr);
+	return error;
+}
+
+void start_carriers(int count)
+{
+	while(carrier_count < count)
+	{
+		carrier* c = &carriers[carrier_count];
+		c->index = carrier_count;
+		c->current = &c->idle;
+		c->idle.index = -1;
+		if(trace_enabled)
+			c->trace_ring = malloc(TRACE_EVENTS * sizeof(trace_event));
+
+		if(kernel_thread_start(carrier_main, c) != 0)
+			break;
+
+		lock();
+		carrier_count++;
+		unlock();
+	}
+}
+
+void runtime_init()
+{
+	first = 0;
+
+	//carrier 0 is the kernel thread the process started on, running the main thread
+	carrier* self = &carriers[0];
+	self->tid = syscall(SYS_gettid);
+
+	//the main thread takes slot 0, so its id is 0
+	tcb* main_thread = slot_alloc();
+
+	//the main thread is the one running right now so it is not queued
+	main_thread->status = RUNNING;
+	main_thread->initialized = 1;
+	main_thread->priority = DEFAULT_PRIORITY;
+	main_thread->run_start = clock_now();
+	main_thread->state_since = main_thread->run_start;
+	self->current = main_thread;
+	//only now, malloc in slot_alloc above disables preemption on the carrier's current thread once there is one
+	local_carrier = self;
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	thread_count++;
+	//printf("MAIN THREAD CREATED\n");
+
+	//the main thread owns this kernel thread's stack, so carrier 0's idle loop gets a stack of its own
+	self->idle.index = -1;
+	//the idle loop and new threads start out with preemption disabled, inside the locks handed over by the switch to them
+	self->idle.preempt_disabled = 1;
+	self->idle.stack_size = STACK_SIZE;
+	self->idle.stack = stack_alloc(self->idle.stack_size);
+	self->idle.sp = initial_frame(self->idle.stack, self->idle.stack_size, carrier_idle);
+
+	//THREADS_TRACE=<file> records scheduler events from the start and exports them at exit
+	trace_path = getenv("THREADS_TRACE");
+	if(TRACE && trace_path != NULL)
+	{
+		trace_epoch = clock_now();
+		self->trace_ring = malloc(TRACE_EVENTS * sizeof(trace_event));
+		trace_enabled = 1;
+		atexit(trace_export_at_exit);
+	}
+
+	//one epoll instance serves every carrier, its eventfd lets a busy carrier interrupt the wait
+	reactor_fd = epoll_create1(EPOLL_CLOEXEC);
+	reactor_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	struct epoll_event wake;
+	wake.events = EPOLLIN;
+	wake.data.fd = reactor_wake_fd;
+	epoll_ctl(reactor_fd, EPOLL_CTL_ADD, reactor_wake_fd, &wake);
+
+	wheel_now = wheel_clock();
+
+	//initialize timer for thread preemption, it stays disarmed until a second thread is READY
+	timer();
+	timer_start(self);
+
+	stdio_start();
+
+	start_carriers(concurrency);
+}
+
+int pthread_setconcurrency(int new_level)
+{
+	//0 leaves the choice to the runtime, which runs one carrier per online core
+	if(new_level < 0)
+		return EINVAL;
+	if(new_level == 0)
+		new_level = sysconf(_SC_NPROCESSORS_ONLN);
+	if(new_level > MAX_CARRIERS)
+		return EAGAIN;
+
+	concurrency = new_level;
+
+	//carriers are only ever added, a running runtime starts the extra ones right away
+	if(!first)
+		start_carriers(concurrency);
+
+	return 0;
+}
+
+int pthread_getconcurrency()
+{
+	return concurrency;
+}
+
+int pthread_setschedparam(pthread_t thread, int policy, const struct sched_param* param)
+{
+	//real-time policies take priorities 1 to 99, the fair ones only 0
+	if(realtime(policy))
+	{
+		if(param->sched_priority < RT_PRIORITY_MIN || param->sched_priority > RT_PRIORITY_MAX)
+			return EINVAL;
+	}
+	else if(policy != SCHED_OTHER && policy != SCHED_BATCH && policy != SCHED_IDLE)
+		return EINVAL;
+	else if(param->sched_priority != 0)
+		return EINVAL;
+
+	lock();
+
+	tcb* target = tcb_from_id(thread);
+	if(target == NULL || target->status == EXITED)
+	{
+		unlock();
+		return ESRCH;
+	}
+
+	//a thread moves between READY and RUNNING, and between carriers, under run queue locks only; changes of policy
+	//are rare, so they hold all of them rather than chase the thread
+	run_lock_all();
+
+	//a READY thread is taken out of its run queue and put back into the one for its new policy
+	carrier* owner = target->status == READY ? target->owner : NULL;
+	if(owner != NULL)
+		ready_remove(target);
+
+	//a thread that lowers itself may leave something READY here that outranks it now
+	tcb* self = current_tcb();
+	int lowered = target == self && (realtime(self->policy)
+		? !realtime(policy) || rt_level(param->sched_priority) < self->priority
+		: policy == SCHED_IDLE && self->policy != SCHED_IDLE);
+
+	target->policy = policy;
+	target->sched_priority = param->sched_priority;
+	target->priority = realtime(policy) ? rt_level(param->sched_priority) : DEFAULT_PRIORITY;
+
+	if(owner != NULL)
+	{
+		if(!realtime(policy))
+			fair_place(owner, target);
+		queue_thread(owner, target);
+	}
+
+	//switch only when the caller should no longer be the one running here; a target READY on another carrier that
+	//now outranks what runs there gets that carrier's next tick brought forward
+	carrier* here = this_carrier();
+	int switch_needed = here != NULL && (lowered || (owner == here && outranks(target, self)));
+	if(!switch_needed && owner != NULL && owner != here && outranks(target, owner->current))
+		timer_advance(owner, clock_now());
+	run_unlock_all();
+
+	if(switch_needed)
+		schedule();
+
+	unlock();
+	return 0;
+}
+int pthread_getschedparam(pthread_t thread, int* policy, struct sched_param* param)
+{
+	lock();
+
+	tcb* target = tcb_from_id(thread);
+	if(target == NULL)
+	{
+		unlock();
+		return ESRCH;
+	}
+
+	*policy = target->policy;
+	param->sched_priority = target->sched_priority;
+
+	unlock();
+	return 0;
+}
+int pthread_setschedprio(pthread_t thread, int priority)
+{
+	int policy;
+	struct sched_param param;
+	int result = pthread_getschedparam(thread, &policy, &param);
+	if(result != 0)
+		return result;
+
+	param.sched_priority = priority;
+	return pthread_setschedparam(thread, policy, &param);
+}
+int pthread_getstats_np(pthread_t thread, thread_stats* stats)
+{
+	lock();
+
+	tcb* target = tcb_from_id(thread);
+	if(target == NULL)
+	{
+		unlock();
+		return ESRCH;
+	}
+
+	//the counters plus whatever the thread's current state has added since they were last updated, with the run
+	//queues held still so a switch doesn't move the thread between states halfway through
+	run_lock_all();
+	uint64_t now = clock_now();
+	*stats = target->stats;
+	if(target->status == RUNNING)
+		stats->cpu_ns += now - target->run_start;
+	else if(target->status == READY)
+		stats->ready_ns += now - target->state_since;
+	else if(target->status == BLOCKED)
+		stats->blocked_ns += now - target->state_since;
+	run_unlock_all();
+
+	unlock();
+	return 0;
+}
+int runtime_getstats_np(runtime_stats* stats)
+{
+	lock();
+	memcpy(stats->sched_latency, sched_latency, sizeof(sched_latency));
+	memcpy(stats->sem_wait, sem_wait_time, sizeof(sem_wait_time));
+	unlock();
+	return 0;
+}
+int pthread_join(pthread_t thread, void ** retval)
+{
+	return join(thread, retval, NULL);
+}
+int pthread_timedjoin_np(pthread_t thread, void ** retval, const struct timespec* abstime)
+{
+	if(abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000)
+		return EINVAL;
+
+	return join(thread, retval, abstime);
+}
+int join(pthread_t thread, void ** retval, const struct timespec* abstime)
+{
+	lock();
+
+	tcb* self = current_tcb();
+	//find the thread that we're going to wait for
+	tcb* target = tcb_from_id(thread);
+
+	if(target == NULL)
+	{
+		unlock();
+		return ESRCH;
+	}
+	if(target == self)
+	{
+		unlock();
+		return EDEADLK;
+	}
+	//a detached thread can't be joined, and only one thread can wait on each thread
+	if(target->detached || target->waiting_on_me != NULL)
+	{
+		unlock();
+		return EINVAL;
+	}
+
+	if(target->status != EXITED)
+	{
+		//a timed join gives up once the CLOCK_REALTIME deadline passes
+		if(abstime != NULL)
+		{
+			if(timeout_start(self, abstime, CLOCK_REALTIME, 1) < 0)
 			{
-				next_available = i;
-				break;
+				unlock();
+				return ETIMEDOUT;
 			}
+			self->join_target = target;
+		}
+
+		//make the current thread block on thread
+		self->status = BLOCKED;
+
+		//when pthread_exit is called, it can refer to this pointer to set this thread back to READY
+		target->waiting_on_me = self;
+		schedule();
+
+		//the timeout cleared waiting_on_me, so the thread can still be joined later
+		if(abstime != NULL && self->timed_out)
+		{
+			unlock();
+			return ETIMEDOUT;
+		}
+	}
+
+	if(retval != NULL)
+	{
+		*retval = target->retval;
+	}
+
+	//the thread has been joined, its slot can go to the next pthread_create
+	slot_release(target);
+
+	unlock();
+	return 0;
+}
+
+int pthread_detach(pthread_t thread)
+{
+	lock();
+
+	tcb* target = tcb_from_id(thread);
+
+	if(target == NULL)
+	{
+		unlock();
+		return ESRCH;
+	}
+	if(target->detached || target->waiting_on_me != NULL)
+	{
+		unlock();
+		return EINVAL;
+	}
+
+	//an exited thread is already off its stack, so only its slot is left to reclaim
+	if(target->status == EXITED)
+		slot_release(target);
+	else
+		target->detached = 1;
 
-		//set the new threads id = next thread_id, increment the thread id
-		threads[next_available].id = thread_id;
-		*thread = thread_id;
-		thread_id++;
+	unlock();
+	return 0;
+}
+
+void pthread_exit(void* retval)
+{
+	//thread-specific values are destroyed first, on this thread and outside the runtime lock
+	key_destroy_all(current_tcb());
+
+	lock();
+
+	tcb* self = current_tcb();
+
+	//mark the thread as EXITED
+	self->status = EXITED;
+	self->retval = retval;
+
+	//the stack is still in use here, finish_switch frees it once the next thread is running
+
+	//if the waiting on me pointer isn't null then there's a thread blocked on this one
+	if(self->waiting_on_me != NULL)
+	{
+		//so set that one equal to READY because this thread is exiting
+		ready_enqueue(self->waiting_on_me);
+		self->waiting_on_me = NULL;
+	}
+
+	//change the thread_count
+	thread_count--;
+
+	trace(TRACE_EXIT, self, retval);
+
+	schedule();
+
+	__builtin_unreachable();
+}
+
+void thread_start()
+{
+	//first code run on a new thread's stack, entered by the ret at the end of context_switch
+	//with the locks taken by whoever switched to us, and preemption disabled since thread_spawn
+	finish_switch();
+	tcb* self = current_tcb();
+	preempt_enable(self);
+	errno = 0;
+
+	pthread_exit(self->start_routine(self->arg));
+}
+
+pthread_t pthread_self()
+{
+	//set up first, so the original thread gets the id it keeps
+	if(first)
+		runtime_init();
+	return current_tcb()->id;
+}
+
+void** key_slot(tcb* thread, pthread_key_t key, int allocate)
+{
+	//where the thread keeps its value for key, NULL if it never set a key past the inline ones
+	if(key < KEYS_INLINE)
+		return &thread->specific[key];
+
+	if(thread->specific_more == NULL)
+	{
+		if(!allocate)
+			return NULL;
+		thread->specific_more = calloc(PTHREAD_KEYS_MAX - KEYS_INLINE, sizeof(void*));
+		if(thread->specific_more == NULL)
+			return NULL;
+	}
+	return &thread->specific_more[key - KEYS_INLINE];
+}
+
+int pthread_key_create(pthread_key_t* key, void (*destructor)(void*))
+{
+	lock();
+
+	pthread_key_t i;
+	for(i = 0; i < PTHREAD_KEYS_MAX && keys[i].used; i++)
+		;
+	if(i == PTHREAD_KEYS_MAX)
+	{
+		unlock();
+		return EAGAIN;
+	}
+
+	keys[i].used = 1;
+	keys[i].destructor = destructor;
+
+	//a reused key starts out NULL in every thread, whatever was set under the deleted one
+	int slot;
+	for(slot = 0; slot < slab_size; slot++)
+	{
+		void** value = key_slot(slot_tcb(slot), i, 0);
+		if(value != NULL)
+			*value = NULL;
+	}
+
+	unlock();
+	*key = i;
+	return 0;
+}
+
+int pthread_key_delete(pthread_key_t key)
+{
+	lock();
+
+	if(key >= PTHREAD_KEYS_MAX || !keys[key].used)
+	{
+		unlock();
+		return EINVAL;
+	}
+	//values left behind are not destroyed, as POSIX has it
+	keys[key].used = 0;
+
+	unlock();
+	return 0;
+}
+
+void* pthread_getspecific(pthread_key_t key)
+{
+	//no lock, the slots are only written by their own thread and by pthread_key_create;
+	//a library constructor may get here before any other call has set up the runtime
+	if(first)
+		runtime_init();
+	if(key < KEYS_INLINE)
+		return current_tcb()->specific[key];
+
+	void** value = key < PTHREAD_KEYS_MAX ? key_slot(current_tcb(), key, 0) : NULL;
+	return value != NULL ? *value : NULL;
+}
 
-		//allocate stack space for the new thread
-		threads[next_available].stack = malloc(STACK_SIZE);
+int pthread_setspecific(pthread_key_t key, const void* value)
+{
+	if(key >= PTHREAD_KEYS_MAX || !keys[key].used)
+		return EINVAL;
+
+	if(first)
+		runtime_init();
+	void** slot = key_slot(current_tcb(), key, 1);
+	if(slot == NULL)
+		return ENOMEM;
+	*slot = (void*) value;
+	return 0;
+}
+
+void key_destroy_all(tcb* self)
+{
+	//a destructor may set values again, so go over the keys up to PTHREAD_DESTRUCTOR_ITERATIONS times
+	int round;
+	for(round = 0; round < PTHREAD_DESTRUCTOR_ITERATIONS; round++)
+	{
+		int called = 0;
+		pthread_key_t key;
+		for(key = 0; key < PTHREAD_KEYS_MAX; key++)
+		{
+			//the keys past the inline ones only if the thread ever set one of them
+			if(key == KEYS_INLINE && self->specific_more == NULL)
+				break;
+
+			void** slot = key_slot(self, key, 0);
+			void (*destructor)(void*) = keys[key].destructor;
+			if(*slot == NULL || !keys[key].used || destructor == NULL)
+				continue;
+
+			void* value = *slot;
+			*slot = NULL;
+			destructor(value);
+			called = 1;
+		}
+		if(!called)
+			break;
+	}
+
+	//taken off the thread under the lock, pthread_key_create may be clearing a slot in it
+	lock();
+	void** more = self->specific_more;
+	self->specific_more = NULL;
+	unlock();
+	free(more);
+}
+
+int thread_spawn(pthread_t* thread, const pthread_attr_t* attr, void *(*start_routine) (void *), void* arg)
+{
+	//called with lock() held, queues the new thread READY without switching to it
+
+	//stack size comes from attr, the stack itself from the pool when one is free
+	size_t stack_size = stack_size_from_attr(attr);
+	void* stack = stack_alloc(stack_size);
+	tcb* new_thread = NULL;
+	if(stack != NULL)
+		new_thread = slot_alloc();
+
+	if(new_thread == NULL)
+	{
+		if(stack != NULL)
+			stack_release(stack, stack_size);
+		//out of tcb slots or stack mappings
+		return EAGAIN;
+	}
+
+	*thread = new_thread->id;
 
-		//using pointer p place the arg and pthread_exit onto the new threads stack
-		void * p = threads[next_available].stack;
-		p += STACK_SIZE - 4;
-		*((unsigned long int *)p) = (unsigned long int) arg;
-		p -= 4;
-		*((unsigned long int *)p) = (unsigned long int) pthread_exit_wrapper;
+	new_thread->stack = stack;
+	new_thread->stack_size = stack_size;
 
+	//build the frame the first context_switch into this thread will pop
+	new_thread->start_routine = start_routine;
+	new_thread->arg = arg;
+	new_thread->sp = initial_frame(stack, stack_size, thread_start);
 
-		//set the program counter of the new thread to the start_routine
-		threads[next_available].registers[0].__jmpbuf[JB_PC] = ptr_mangle((unsigned long int) start_routine);
-		threads[next_available].registers[0].__jmpbuf[JB_SP] = ptr_mangle((unsigned long int) p);
+	//threads created detached give their slot back as soon as they exit
+	int detach_state;
+	if(attr != NULL && pthread_attr_getdetachstate(attr, &detach_state) == 0)
+		new_thread->detached = detach_state == PTHREAD_CREATE_DETACHED;
 
-		//init
-		threads[next_available].waiting_on_me = NULL;
-		threads[next_available].initialized = 1;
-		threads[next_available].index = next_available;
-		threads[next_available].status = READY;
-		thread_count++;
+	//scheduling is inherited from the creating thread unless the attr sets it explicitly
+	//the creator's virtual runtime is brought up to now first, or a thread creating many others in one slice would
+	//give them all the value from its last switch and then find itself that slice behind every one of them
+	tcb* creator = current_tcb();
+	charge(creator, clock_now());
+	new_thread->policy = creator->policy;
+	new_thread->sched_priority = creator->sched_priority;
+	new_thread->vruntime = creator->vruntime;
+	int inherit;
+	struct sched_param param;
+	if(attr != NULL && pthread_attr_getinheritsched(attr, &inherit) == 0 && inherit == PTHREAD_EXPLICIT_SCHED
+		&& pthread_attr_getschedpolicy(attr, &new_thread->policy) == 0
+		&& pthread_attr_getschedparam(attr, &param) == 0)
+		new_thread->sched_priority = param.sched_priority;
+	new_thread->priority = realtime(new_thread->policy) ? rt_level(new_thread->sched_priority) : DEFAULT_PRIORITY;
+
+	//init
+	new_thread->initialized = 1;
+	new_thread->preempt_disabled = 1;
+	ready_enqueue(new_thread);
+	thread_count++;
+
+	trace(TRACE_CREATE, new_thread, creator->id);
+
+	return 0;
+}
+
+int pthread_create(pthread_t *thread,
+		const pthread_attr_t *attr,
+                void *(*start_routine) (void *), 
+                void *arg)
+{
+	//the main thread and the carriers are set up by the first lock()
+	lock();
 
-		printf("Created thread #%d.\n", *thread);
+	int error = thread_spawn(thread, attr, start_routine, arg);
 
+	//the creator keeps running unless it just made a thread that outranks it
+	if(error == 0 && outranks(tcb_from_id(*thread), current_tcb()))
 		schedule();
 
-		return 0;
-	}else{
-		return -1;
+	unlock();
+	return error;
+}
+
+int pthread_create_batch_np(pthread_t* threads, int count, const pthread_attr_t* attr,
+		void *(*start_routine) (void *), void** args)
+{
+	lock();
+
+	//all of them are queued before anything runs, at most one switch for the whole batch
+	int created;
+	int switch_needed = 0;
+	for(created = 0; created < count; created++)
+	{
+		if(thread_spawn(&threads[created], attr, start_routine, args != NULL ? args[created] : NULL) != 0)
+			break;
+		switch_needed |= outranks(tcb_from_id(threads[created]), current_tcb());
 	}
+
+	if(switch_needed)
+		schedule();
+
+	unlock();
+	return created;
 }
 
-static int ptr_demangle(int p)
+int sched_yield()
 {
-	unsigned int ret;
-	asm(
-	" movl %1, %%eax;\n"
-	" rorl $0x9, %%eax;"
-	" xorl %%gs:0x18, %%eax;"
-	" movl %%eax, %0;"
-	: "=r"(ret)
-	: "r"(p)
-	: "%eax"
-	);
-	return ret;
+	if(first)
+		runtime_init();
+
+	//only this carrier's run queue changes, the runtime lock is not needed
+	tcb* thread = preempt_disable();
+	carrier* self = this_carrier();
+	if(self == NULL)
+		return syscall(SYS_sched_yield);
+	spin_acquire(&self->lock);
+
+	//the caller goes behind the other READY threads: a real-time thread to the tail of its level,
+	//which queue_thread does anyway, and a fair thread past the one that has run the least
+	if(!realtime(thread->policy) && self->fair_heap != NULL && thread->vruntime <= self->fair_heap->vruntime)
+		thread->vruntime = self->fair_heap->vruntime + 1;
+
+	//not RUNNING, so reschedule neither keeps a SCHED_FIFO thread on nor counts the switch as a preemption
+	thread->status = READY;
+	reschedule(self, 0);
+
+	preempt_enable(thread);
+	return 0;
 }
 
-static int ptr_mangle(int p)
+//context_switch(save_sp, load_sp) pushes the callee-saved registers onto the current stack,
+//stores the stack pointer in *save_sp, loads load_sp and pops the next thread's registers.
+//the caller-saved registers are already spilled by the compiler around the call and the
+//signal mask is never touched, so there are no syscalls on the switch path.
+//on x86 the rounding and exception mask bits of the FP control words are callee-saved as well,
+//a thread that changed them with fesetround keeps them for itself
+#if defined(__x86_64__)
+
+//rbp, rbx, r12-r15 and a slot with mxcsr in its low and the x87 control word in its high half
+#define SAVED_REGISTERS 7
+
+asm(
+"	.text\n"
+"	.globl context_switch\n"
+"	.hidden context_switch\n"
+"	.type context_switch, @function\n"
+"context_switch:\n"
+"	pushq %rbp\n"
+"	pushq %rbx\n"
+"	pushq %r12\n"
+"	pushq %r13\n"
+"	pushq %r14\n"
+"	pushq %r15\n"
+"	subq $8, %rsp\n"
+"	stmxcsr (%rsp)\n"
+"	fnstcw 4(%rsp)\n"
+"	movq %rsp, (%rdi)\n"
+"	movq %rsi, %rsp\n"
+"	ldmxcsr (%rsp)\n"
+"	fldcw 4(%rsp)\n"
+"	addq $8, %rsp\n"
+"	popq %r15\n"
+"	popq %r14\n"
+"	popq %r13\n"
+"	popq %r12\n"
+"	popq %rbx\n"
+"	popq %rbp\n"
+"	ret\n"
+"	.size context_switch, .-context_switch\n"
+);
+
+#elif defined(__aarch64__)
+
+//x19-x30 and d8-d15 in a 160 byte frame, x30 (the return address) sits in slot 11
+#define SAVED_REGISTERS 20
+#define RETURN_SLOT 11
+
+asm(
+"	.text\n"
+"	.globl context_switch\n"
+"	.hidden context_switch\n"
+"	.type context_switch, %function\n"
+"context_switch:\n"
+"	sub sp, sp, #160\n"
+"	stp x19, x20, [sp, #0]\n"
+"	stp x21, x22, [sp, #16]\n"
+"	stp x23, x24, [sp, #32]\n"
+"	stp x25, x26, [sp, #48]\n"
+"	stp x27, x28, [sp, #64]\n"
+"	stp x29, x30, [sp, #80]\n"
+"	stp d8, d9, [sp, #96]\n"
+"	stp d10, d11, [sp, #112]\n"
+"	stp d12, d13, [sp, #128]\n"
+"	stp d14, d15, [sp, #144]\n"
+"	mov x2, sp\n"
+"	str x2, [x0]\n"
+"	mov sp, x1\n"
+"	ldp x19, x20, [sp, #0]\n"
+"	ldp x21, x22, [sp, #16]\n"
+"	ldp x23, x24, [sp, #32]\n"
+"	ldp x25, x26, [sp, #48]\n"
+"	ldp x27, x28, [sp, #64]\n"
+"	ldp x29, x30, [sp, #80]\n"
+"	ldp d8, d9, [sp, #96]\n"
+"	ldp d10, d11, [sp, #112]\n"
+"	ldp d12, d13, [sp, #128]\n"
+"	ldp d14, d15, [sp, #144]\n"
+"	add sp, sp, #160\n"
+"	ret\n"
+"	.size context_switch, .-context_switch\n"
+);
+
+#elif defined(__i386__)
+
+//ebp, ebx, esi, edi and a slot for the x87 control word, SSE may not be there to have an mxcsr
+#define SAVED_REGISTERS 5
+
+asm(
+"	.text\n"
+"	.globl context_switch\n"
+"	.hidden context_switch\n"
+"	.type context_switch, @function\n"
+"context_switch:\n"
+"	movl 4(%esp), %eax\n"
+"	movl 8(%esp), %edx\n"
+"	pushl %ebp\n"
+"	pushl %ebx\n"
+"	pushl %esi\n"
+"	pushl %edi\n"
+"	subl $4, %esp\n"
+"	fnstcw (%esp)\n"
+"	movl %esp, (%eax)\n"
+"	movl %edx, %esp\n"
+"	fldcw (%esp)\n"
+"	addl $4, %esp\n"
+"	popl %edi\n"
+"	popl %esi\n"
+"	popl %ebx\n"
+"	popl %ebp\n"
+"	ret\n"
+"	.size context_switch, .-context_switch\n"
+);
+
+#else
+#error "context_switch is not implemented for this architecture"
+#endif
+
+void* initial_frame(void* stack, size_t size, void (*entry)())
 {
-	unsigned int ret;
-	asm(" movl %1, %%eax;\n"
-	    " xorl %%gs:0x18, %%eax;"
-	    " roll $0x9, %%eax;"
-	    " movl %%eax, %0;"
-	: "=r"(ret)
-	: "r"(p)
-	: "%eax"
-	);
-	return ret;
+	//the top of the stack is rounded down to the 16 bytes the ABIs require at a call
+	uintptr_t* sp = (uintptr_t*) (((uintptr_t) stack + size) & ~(uintptr_t) 15);
+
+#if defined(__aarch64__)
+	//a zeroed register frame whose x30 makes the final ret jump into entry
+	sp -= SAVED_REGISTERS;
+	memset(sp, 0, SAVED_REGISTERS * sizeof(uintptr_t));
+	sp[RETURN_SLOT] = (uintptr_t) entry;
+#else
+	//fake return address for entry so it starts with the alignment of a called function
+	*--sp = 0;
+	//context_switch returns into entry
+	*--sp = (uintptr_t) entry;
+	//zeroed callee-saved registers for context_switch to pop
+	sp -= SAVED_REGISTERS;
+	memset(sp, 0, SAVED_REGISTERS * sizeof(uintptr_t));
+	//a zeroed control word would unmask every FP exception; a new thread inherits its creator's instead
+#if defined(__x86_64__)
+	asm volatile("stmxcsr %0" : "=m" (*(uint32_t*) sp));
+	asm volatile("fnstcw %0" : "=m" (*(uint16_t*) ((char*) sp + 4)));
+#else
+	asm volatile("fnstcw %0" : "=m" (*(uint16_t*) sp));
+#endif
+#endif
+
+	return sp;
 }
 
 /*
@@ -573,7 +5247,6 @@ main()
 	for(i = 0; i < 2; i++)
 	{
 		pthread_join(array[i], NULL);
-		print_threads_stderr();
 	}
 }
 */
\ No newline at end of file
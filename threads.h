@@ -0,0 +1,119 @@
+#ifndef THREADS_H
+#define THREADS_H
+
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+
+//extensions to the pthread API implemented by threads.c
+
+//errno is saved and restored for each green thread as it is switched out and in, but it lives in the TLS of the
+//carrier's kernel thread and glibc lets the compiler reuse its address within a function: a function that used
+//errno before a call that can block or be preempted may read the old carrier's errno after it. With one carrier
+//(pthread_setconcurrency(1)) there is only one errno; with more, such code should read errno through a function
+//that is not inlined
+
+//a thread gets a 32KB stack unless its attr asks for another size with pthread_attr_setstacksize; a size equal to
+//libc's default (pthread_getattr_default_np, from the stack rlimit) is indistinguishable from no size at all and
+//also gets 32KB
+
+//time slice a thread runs before it is preempted for another READY thread, 50ms by default,
+//EINVAL below 100us
+int pthread_setquantum_np(const struct timespec* quantum);
+int pthread_getquantum_np(struct timespec* quantum);
+
+//starts count threads running start_routine, with args[i] as the argument of the i-th or NULL when args is NULL,
+//and switches at most once after all of them are queued; returns how many were created, fewer than count when
+//the runtime ran out of stacks or thread slots
+int pthread_create_batch_np(pthread_t* threads, int count, const pthread_attr_t* attr,
+		void *(*start_routine) (void *), void** args);
+
+//bounded multi-producer multi-consumer channels of elem_size byte values, capacity 0 makes a send wait
+//for a receiver; values are copied in and out, a parked receiver gets a value copied straight from the sender
+typedef struct channel channel;
+channel* channel_create(size_t elem_size, size_t capacity);
+//EBUSY while threads are parked on it
+int channel_destroy(channel* ch);
+//0, or EPIPE once the channel is closed; a receive drains buffered values first and then gets a zeroed value
+int channel_send(channel* ch, const void* value);
+int channel_recv(channel* ch, void* value);
+//wakes every parked sender and receiver with EPIPE, EPIPE if already closed
+int channel_close(channel* ch);
+
+#define CHANNEL_SEND 1
+#define CHANNEL_RECV 2
+
+typedef struct
+{
+	channel* ch;
+	//CHANNEL_SEND or CHANNEL_RECV
+	int op;
+	//value sent, or where a received value is stored
+	void* value;
+	//set when the case completes, 0 or EPIPE as for channel_send and channel_recv
+	int result;
+} channel_case;
+
+//completes one of the cases and returns its index; without block, -1 when none can complete right away
+int channel_select(channel_case* cases, int count, int block);
+
+//task pool: fn(arg) runs on one of a fixed set of green worker threads, one per carrier, that steal
+//from each other's deques; tasks are tracked by the group they are spawned into, which starts out zeroed
+typedef struct
+{
+	long opaque[4];
+} task_group;
+#define TASK_GROUP_INITIALIZER {{0}}
+//EAGAIN if the pool's workers could not be started; a task spawned into a full deque runs before this returns
+int task_spawn(task_group* group, void (*fn)(void*), void* arg);
+//runs pool tasks until every task spawned into the group so far has finished
+void task_wait(task_group* group);
+
+//body runs on pieces of [begin, end) of grain iterations each, spread over the pool, and the call returns
+//once all of them are done; grain 0 picks a few pieces per worker
+void parallel_for(long begin, long end, long grain, void (*body)(long begin, long end, void* arg), void* arg);
+//result holds the identity of size bytes on entry: each piece's body accumulates into its own copy of it,
+//and the copies are combined into result in order of the pieces
+void parallel_reduce(long begin, long end, long grain, void* result, size_t size,
+		void (*body)(long begin, long end, void* partial, void* arg),
+		void (*combine)(void* result, const void* partial, void* arg), void* arg);
+
+//runs fn(arg) on one of the runtime's kernel helper threads while the calling green thread is parked, for calls
+//that block the kernel thread they run on and have no non-blocking form; returns what fn returned, with its errno;
+//open, stat, fsync, getaddrinfo and the other common file calls, and reads of the standard streams and of files
+//not in the page cache, go through it already, through stdin and fopen's streams too (fdopen's and popen's are
+//libc's own and still block); fn runs as the calling thread for pthread_self and thread-specific data, and may
+//lock mutexes and wake threads, but waiting on anything else of the runtime (a semaphore, condition, join, sleep
+//or channel) from fn aborts, since a helper has no carrier to park on
+long offload_call(long (*fn)(void* arg), void* arg);
+
+//per thread scheduler counters, times in nanoseconds
+typedef struct
+{
+	//time spent running, READY waiting for a carrier, and BLOCKED
+	uint64_t cpu_ns;
+	uint64_t ready_ns;
+	uint64_t blocked_ns;
+	//switches where the thread blocked, yielded or exited, and where it was preempted
+	uint64_t voluntary_switches;
+	uint64_t involuntary_switches;
+} thread_stats;
+
+//bucket i of a histogram counts samples from 2^i up to 2^(i+1) nanoseconds
+#define STATS_BUCKETS 64
+
+//runtime wide histograms, of the time threads wait READY before they run and of sem_wait blocking time
+typedef struct
+{
+	uint64_t sched_latency[STATS_BUCKETS];
+	uint64_t sem_wait[STATS_BUCKETS];
+} runtime_stats;
+
+//snapshots, valid for a thread until it is joined
+int pthread_getstats_np(pthread_t thread, thread_stats* stats);
+int runtime_getstats_np(runtime_stats* stats);
+
+//write the scheduler events recorded so far as Chrome/Perfetto trace JSON, needs THREADS_TRACE set
+int trace_export(const char* path);
+
+#endif
@@ -0,0 +1,1459 @@
+//benchmarks for threads.c against glibc's own pthreads, built once with the runtime and once without:
+//
+//	gcc -O2 -o bench_green threads_bench.c threads.c -ldl -lrt
+//	gcc -O2 -o bench_nptl threads_bench.c -lpthread
+//
+//	./bench_green [max threads] > green.json
+//	./bench_nptl [max threads] > nptl.json
+//
+//the echo benchmark runs its clients in a copy of the program started as
+//
+//	./bench_green --echo-client port connections rounds
+//
+//every result is printed as one JSON object per line,
+//{"runtime":"green","bench":"sem_uncontended","threads":1,"value":41000000,"unit":"ops_per_s"},
+//so runs from different releases can be diffed or loaded as they are
+
+#define _GNU_SOURCE
+//the setjmp benchmark jumps between stacks, which the fortified longjmp takes for a corrupted stack
+#undef _FORTIFY_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "threads.h"
+
+//only defined when threads.c is linked in, which tells the two builds apart
+#pragma weak pthread_getquantum_np
+#pragma weak pthread_setquantum_np
+#pragma weak channel_create
+#pragma weak channel_send
+#pragma weak channel_recv
+#pragma weak channel_destroy
+#pragma weak task_spawn
+#pragma weak task_wait
+#pragma weak parallel_reduce
+#pragma weak context_switch
+#pragma weak initial_frame
+
+//threads.c's switch primitive, measured on its own against setjmp and swapcontext
+void context_switch(void** save_sp, void* load_sp);
+void* initial_frame(void* stack, size_t size, void (*entry)());
+
+//how long each timed benchmark runs
+#define BENCH_NS 500000000L
+//threads kept alive at once for the memory measurement
+#define MEMORY_THREADS 1000
+//largest ring of threads yielding to each other in the switch scaling benchmark, from 2 up by factors of 10,
+//and the yields they share out at each size
+#define YIELD_RING_MAX 10000
+#define YIELD_RING_SWITCHES 2000000L
+//round trips between the main stack and a coroutine in the raw switch benchmarks, and the coroutine's stack
+#define COROUTINE_ROUNDS 5000000L
+#define COROUTINE_STACK (64 * 1024)
+//threads hammering one semaphore in the contended benchmark
+#define CONTENDERS 4
+//semaphore ping-pong: a token passed round a ring of threads, each waiting on a semaphore of its own, up to
+//SEM_PINGPONG_MAX threads and semaphores, and the handoffs made at each size
+#define SEM_PINGPONG_MAX 1000
+#define SEM_PINGPONG_HANDOFFS 1000000L
+//default upper end of the scalability sweep, the first argument overrides it
+#define SCALE_MAX 100000
+//values passed from producer to consumer in the message passing benchmarks, and the buffer they go through
+#define MESSAGES 1000000
+#define RING_SIZE 64
+//threads in the read-mostly table benchmark, one operation in WRITE_EVERY is a write
+#define TABLE_THREADS 4
+#define TABLE_SIZE 16
+#define WRITE_EVERY 64
+//threads and rounds in the barrier benchmark
+#define BARRIER_THREADS 8
+#define BARRIER_ROUNDS 20000
+//tiny work items fanned out in the task benchmark, and how many threads at a time without the pool
+#define ITEMS 1000000
+#define ITEM_BATCH 1000
+//malloc churn: generations of threads each allocating and freeing small blocks out of a working set of slots
+#define MALLOC_THREADS 16
+#define MALLOC_OPS 100000
+#define MALLOC_SLOTS 64
+//threads syncing small writes to disk while another one sleeps in TICK_NS steps and notes how late it wakes
+#define FSYNC_THREADS 4
+#define TICK_NS 1000000L
+//wakeup latency: a thread sleeping in TICK_NS steps next to CPU-bound hogs that never yield, at every quantum
+//in LATENCY_QUANTA (milliseconds, green only) and at the default one; at most LATENCY_SAMPLES wakeups a run
+#define LATENCY_HOGS_PER_CPU 2
+#define LATENCY_NS 1000000000L
+#define LATENCY_SAMPLES 1000
+#define LATENCY_QUANTA 4
+const long latency_quanta[LATENCY_QUANTA] = {1, 5, 20, 50};
+//idle cost: threads parked on a semaphore for IDLE_NS while the process's CPU time is measured
+#define IDLE_THREADS 100
+#define IDLE_NS 1000000000L
+//echo server: a thread per connection, each client sending ECHO_ROUNDS messages of ECHO_SIZE bytes and
+//waiting for them to come back; the server threads get a small stack in both runtimes
+#define ECHO_CONNECTIONS 10000
+#define ECHO_ROUNDS 10
+#define ECHO_SIZE 64
+#define ECHO_STACK (64 * 1024)
+//carrier scaling: CPU-bound threads per core sharing a fixed amount of work, yielding every SPIN_SLICE iterations
+#define SPINNERS_PER_CPU 8
+#define SPIN_WORK 400000000L
+#define SPIN_SLICE 100000
+
+const char* runtime_name;
+
+uint64_t now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void report(const char* bench, long threads, double value, const char* unit)
+{
+	printf("{\"runtime\":\"%s\",\"bench\":\"%s\",\"threads\":%ld,\"value\":%.2f,\"unit\":\"%s\"}\n",
+			runtime_name, bench, threads, value, unit);
+	fflush(stdout);
+}
+
+void report_error(const char* bench, long threads, long reached, int error)
+{
+	printf("{\"runtime\":\"%s\",\"bench\":\"%s\",\"threads\":%ld,\"reached\":%ld,\"error\":\"%s\"}\n",
+			runtime_name, bench, threads, reached, strerror(error));
+	fflush(stdout);
+}
+
+//resident and virtual size of the process in bytes
+void memory_usage(long* rss, long* vsz)
+{
+	long pages_total = 0, pages_resident = 0;
+	FILE* statm = fopen("/proc/self/statm", "r");
+	if(statm != NULL)
+	{
+		if(fscanf(statm, "%ld %ld", &pages_total, &pages_resident) != 2)
+			pages_total = pages_resident = 0;
+		fclose(statm);
+	}
+
+	long page = sysconf(_SC_PAGESIZE);
+	*rss = pages_resident * page;
+	*vsz = pages_total * page;
+}
+
+//yield ping-pong: two threads pass a turn back and forth, each handoff is one switch
+volatile int turn;
+volatile int stop;
+volatile long switches;
+
+void* pingpong(void* arg)
+{
+	int me = (int)(long) arg;
+	while(!__atomic_load_n(&stop, __ATOMIC_ACQUIRE))
+	{
+		if(__atomic_load_n(&turn, __ATOMIC_ACQUIRE) != me)
+		{
+			sched_yield();
+			continue;
+		}
+		switches++;
+		__atomic_store_n(&turn, 1 - me, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+void bench_switch()
+{
+	pthread_t threads[2];
+	turn = 0;
+	stop = 0;
+	switches = 0;
+
+	uint64_t start = now();
+	pthread_create(&threads[0], NULL, pingpong, (void*) 0L);
+	pthread_create(&threads[1], NULL, pingpong, (void*) 1L);
+
+	struct timespec run = {BENCH_NS / 1000000000L, BENCH_NS % 1000000000L};
+	nanosleep(&run, NULL);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+
+	pthread_join(threads[0], NULL);
+	pthread_join(threads[1], NULL);
+	uint64_t elapsed = now() - start;
+
+	if(switches > 0)
+		report("yield_pingpong", 2, (double) elapsed / switches, "ns_per_switch");
+	else
+		report_error("yield_pingpong", 2, 0, EAGAIN);
+}
+
+//yield ring: every thread yields in turn, each yield is a switch to the next READY thread; picking the next one
+//doesn't depend on how many are queued, what grows with the count is cache misses on their stacks and tcbs.
+//The threads wait on ring_go until all of them exist
+sem_t ring_go;
+long ring_yields;
+
+void* ring_yielder(void* arg)
+{
+	sem_wait(&ring_go);
+	long i;
+	for(i = 0; i < ring_yields; i++)
+		sched_yield();
+	return arg;
+}
+
+void bench_switch_scaling()
+{
+	pthread_t* threads = malloc(YIELD_RING_MAX * sizeof(pthread_t));
+	sem_init(&ring_go, 0, 0);
+	long count;
+	for(count = 2; count <= YIELD_RING_MAX; count = count == 2 ? 10 : count * 10)
+	{
+		ring_yields = YIELD_RING_SWITCHES / count;
+		long created;
+		int error = 0;
+		for(created = 0; created < count; created++)
+			if((error = pthread_create(&threads[created], NULL, ring_yielder, NULL)) != 0)
+				break;
+
+		uint64_t start = now();
+		long i;
+		for(i = 0; i < created; i++)
+			sem_post(&ring_go);
+		for(i = 0; i < created; i++)
+			pthread_join(threads[i], NULL);
+		uint64_t elapsed = now() - start;
+
+		if(error != 0)
+		{
+			report_error("yield_ring", count, created, error);
+			break;
+		}
+		report("yield_ring", count, (double) elapsed / (ring_yields * count), "ns_per_switch");
+	}
+	sem_destroy(&ring_go);
+	free(threads);
+}
+
+//raw switches: the main stack and a coroutine hand control back and forth with no scheduler in between,
+//through context_switch, through setjmp/longjmp (what threads.c used before) and through swapcontext,
+//which also sets the signal mask on every switch. The coroutine loops until the program exits
+void* native_main_sp;
+void* native_coroutine_sp;
+jmp_buf jump_main, jump_coroutine;
+ucontext_t context_main, context_coroutine;
+
+void native_coroutine()
+{
+	while(1)
+		context_switch(&native_coroutine_sp, native_main_sp);
+}
+
+//started by swapcontext from bench_raw_switch, it then only moves by longjmp
+void jump_coroutine_main()
+{
+	if(setjmp(jump_coroutine) == 0)
+		swapcontext(&context_coroutine, &context_main);
+	while(1)
+		if(setjmp(jump_coroutine) == 0)
+			longjmp(jump_main, 1);
+}
+
+void swap_coroutine()
+{
+	while(1)
+		swapcontext(&context_coroutine, &context_main);
+}
+
+void raw_switch_report(const char* bench, uint64_t start)
+{
+	report(bench, 2, (double)(now() - start) / (2 * COROUTINE_ROUNDS), "ns_per_switch");
+}
+
+void bench_raw_switch()
+{
+	long i;
+	uint64_t start;
+	if(context_switch != NULL)
+	{
+		void* stack = malloc(COROUTINE_STACK);
+		native_coroutine_sp = initial_frame(stack, COROUTINE_STACK, native_coroutine);
+		start = now();
+		for(i = 0; i < COROUTINE_ROUNDS; i++)
+			context_switch(&native_main_sp, native_coroutine_sp);
+		raw_switch_report("switch_native", start);
+	}
+
+	getcontext(&context_coroutine);
+	context_coroutine.uc_stack.ss_sp = malloc(COROUTINE_STACK);
+	context_coroutine.uc_stack.ss_size = COROUTINE_STACK;
+	context_coroutine.uc_link = NULL;
+	makecontext(&context_coroutine, jump_coroutine_main, 0);
+	swapcontext(&context_main, &context_coroutine);
+	start = now();
+	for(i = 0; i < COROUTINE_ROUNDS; i++)
+		if(setjmp(jump_main) == 0)
+			longjmp(jump_coroutine, 1);
+	raw_switch_report("switch_setjmp", start);
+
+	makecontext(&context_coroutine, swap_coroutine, 0);
+	start = now();
+	for(i = 0; i < COROUTINE_ROUNDS; i++)
+		swapcontext(&context_main, &context_coroutine);
+	raw_switch_report("switch_swapcontext", start);
+}
+
+void* nothing(void* arg)
+{
+	return arg;
+}
+
+void bench_create_join()
+{
+	long count = 0;
+	uint64_t start = now();
+	uint64_t elapsed;
+
+	//in batches, so reading the clock doesn't dominate
+	do
+	{
+		int i;
+		for(i = 0; i < 100; i++)
+		{
+			pthread_t thread;
+			int error = pthread_create(&thread, NULL, nothing, NULL);
+			if(error != 0)
+			{
+				report_error("create_join", 1, count, error);
+				return;
+			}
+			pthread_join(thread, NULL);
+			count++;
+		}
+		elapsed = now() - start;
+	}
+	while(elapsed < BENCH_NS);
+
+	report("create_join", 1, count * 1e9 / elapsed, "ops_per_s");
+}
+
+void bench_sem_uncontended()
+{
+	sem_t sem;
+	sem_init(&sem, 0, 0);
+
+	long count = 0;
+	uint64_t start = now();
+	uint64_t elapsed;
+	do
+	{
+		int i;
+		for(i = 0; i < 10000; i++)
+		{
+			sem_post(&sem);
+			sem_wait(&sem);
+		}
+		count += 10000;
+		elapsed = now() - start;
+	}
+	while(elapsed < BENCH_NS);
+
+	sem_destroy(&sem);
+	//a post and a wait count as one operation each
+	report("sem_uncontended", 1, 2 * count * 1e9 / elapsed, "ops_per_s");
+}
+
+//critical sections: a sem_trywait on an empty semaphore does nothing but enter and leave the runtime, next to the
+//sigprocmask pair every lock() and unlock() used to cost
+void bench_critical_section()
+{
+	sem_t sem;
+	sem_init(&sem, 0, 0);
+	long count = 0;
+	uint64_t start = now();
+	uint64_t elapsed;
+	do
+	{
+		int i;
+		for(i = 0; i < 10000; i++)
+			sem_trywait(&sem);
+		count += 10000;
+		elapsed = now() - start;
+	}
+	while(elapsed < BENCH_NS);
+	sem_destroy(&sem);
+	report("sem_trywait_empty", 1, count * 1e9 / elapsed, "ops_per_s");
+
+	sigset_t alarm, old;
+	sigemptyset(&alarm);
+	sigaddset(&alarm, SIGALRM);
+	count = 0;
+	start = now();
+	do
+	{
+		int i;
+		for(i = 0; i < 10000; i++)
+		{
+			sigprocmask(SIG_BLOCK, &alarm, &old);
+			sigprocmask(SIG_SETMASK, &old, NULL);
+		}
+		count += 10000;
+		elapsed = now() - start;
+	}
+	while(elapsed < BENCH_NS);
+	report("sigprocmask_pair", 1, count * 1e9 / elapsed, "ops_per_s");
+}
+
+sem_t contended;
+volatile long contended_ops[CONTENDERS];
+
+void* contender(void* arg)
+{
+	long me = (long) arg;
+	while(!__atomic_load_n(&stop, __ATOMIC_ACQUIRE))
+	{
+		sem_wait(&contended);
+		contended_ops[me]++;
+		sem_post(&contended);
+	}
+	return NULL;
+}
+
+void bench_sem_contended()
+{
+	pthread_t threads[CONTENDERS];
+	sem_init(&contended, 0, 1);
+	stop = 0;
+
+	uint64_t start = now();
+	long i;
+	for(i = 0; i < CONTENDERS; i++)
+	{
+		contended_ops[i] = 0;
+		pthread_create(&threads[i], NULL, contender, (void*) i);
+	}
+
+	struct timespec run = {BENCH_NS / 1000000000L, BENCH_NS % 1000000000L};
+	nanosleep(&run, NULL);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+
+	long count = 0;
+	for(i = 0; i < CONTENDERS; i++)
+	{
+		pthread_join(threads[i], NULL);
+		count += contended_ops[i];
+	}
+	uint64_t elapsed = now() - start;
+
+	sem_destroy(&contended);
+	report("sem_contended", CONTENDERS, 2 * count * 1e9 / elapsed, "ops_per_s");
+}
+
+//semaphore ping-pong: thread i waits on pingpong_sems[i] and posts pingpong_sems[i + 1], so every handoff is
+//a post that wakes a blocked thread and a wait that blocks; two threads make the classic ping-pong
+sem_t* pingpong_sems;
+long pingpong_size;
+long pingpong_rounds;
+
+void* pingpong_member(void* arg)
+{
+	long me = (long) arg;
+	long i;
+	for(i = 0; i < pingpong_rounds; i++)
+	{
+		sem_wait(&pingpong_sems[me]);
+		sem_post(&pingpong_sems[(me + 1) % pingpong_size]);
+	}
+	return NULL;
+}
+
+void bench_sem_pingpong()
+{
+	pthread_t* threads = malloc(SEM_PINGPONG_MAX * sizeof(pthread_t));
+	pingpong_sems = malloc(SEM_PINGPONG_MAX * sizeof(sem_t));
+	long count;
+	for(count = 2; count <= SEM_PINGPONG_MAX; count = count == 2 ? 10 : count * 10)
+	{
+		pingpong_rounds = SEM_PINGPONG_HANDOFFS / count;
+		long i;
+		for(i = 0; i < count; i++)
+			sem_init(&pingpong_sems[i], 0, 0);
+		long created;
+		int error = 0;
+		for(created = 0; created < count; created++)
+			if((error = pthread_create(&threads[created], NULL, pingpong_member, (void*) created)) != 0)
+				break;
+		//if not all of them could be started the ones that were close the ring, so they still finish
+		pingpong_size = created;
+
+		uint64_t start = now();
+		sem_post(&pingpong_sems[0]);
+		for(i = 0; i < created; i++)
+			pthread_join(threads[i], NULL);
+		uint64_t elapsed = now() - start;
+		for(i = 0; i < count; i++)
+			sem_destroy(&pingpong_sems[i]);
+
+		if(error != 0)
+		{
+			report_error("sem_pingpong", count, created, error);
+			break;
+		}
+		report("sem_pingpong", count, (double) elapsed / (pingpong_rounds * count), "ns_per_handoff");
+	}
+	free(pingpong_sems);
+	free(threads);
+}
+
+//the hand-built equivalent of a channel: a ring guarded by a semaphore each for free slots,
+//filled slots and the ring itself
+long ring[RING_SIZE];
+long ring_in, ring_out;
+sem_t ring_free, ring_used, ring_lock;
+
+void* ring_producer(void* arg)
+{
+	long i;
+	for(i = 0; i < MESSAGES; i++)
+	{
+		sem_wait(&ring_free);
+		sem_wait(&ring_lock);
+		ring[ring_in++ % RING_SIZE] = i;
+		sem_post(&ring_lock);
+		sem_post(&ring_used);
+	}
+	return NULL;
+}
+
+void* ring_consumer(void* arg)
+{
+	long i, sum = 0;
+	for(i = 0; i < MESSAGES; i++)
+	{
+		sem_wait(&ring_used);
+		sem_wait(&ring_lock);
+		sum += ring[ring_out++ % RING_SIZE];
+		sem_post(&ring_lock);
+		sem_post(&ring_free);
+	}
+	return (void*) sum;
+}
+
+void* channel_producer(void* arg)
+{
+	long i;
+	for(i = 0; i < MESSAGES; i++)
+		channel_send(arg, &i);
+	return NULL;
+}
+
+void* channel_consumer(void* arg)
+{
+	long i, value, sum = 0;
+	for(i = 0; i < MESSAGES; i++)
+	{
+		channel_recv(arg, &value);
+		sum += value;
+	}
+	return (void*) sum;
+}
+
+//runs one producer and one consumer to completion, messages per second or 0 if the values got mixed up
+double message_rate(void* (*producer)(void*), void* (*consumer)(void*), void* arg)
+{
+	pthread_t threads[2];
+	void* sum;
+
+	uint64_t start = now();
+	pthread_create(&threads[0], NULL, consumer, arg);
+	pthread_create(&threads[1], NULL, producer, arg);
+	pthread_join(threads[1], NULL);
+	pthread_join(threads[0], &sum);
+	uint64_t elapsed = now() - start;
+
+	if((long) sum != (long) MESSAGES * (MESSAGES - 1) / 2)
+		return 0;
+	return MESSAGES * 1e9 / elapsed;
+}
+
+void bench_messages()
+{
+	ring_in = ring_out = 0;
+	sem_init(&ring_free, 0, RING_SIZE);
+	sem_init(&ring_used, 0, 0);
+	sem_init(&ring_lock, 0, 1);
+	report("sem_ring", 2, message_rate(ring_producer, ring_consumer, NULL), "msgs_per_s");
+	sem_destroy(&ring_free);
+	sem_destroy(&ring_used);
+	sem_destroy(&ring_lock);
+
+	//channels only exist in the green runtime
+	if(channel_create == NULL)
+		return;
+
+	channel* buffered = channel_create(sizeof(long), RING_SIZE);
+	report("channel_buffered", 2, message_rate(channel_producer, channel_consumer, buffered), "msgs_per_s");
+	channel_destroy(buffered);
+
+	channel* unbuffered = channel_create(sizeof(long), 0);
+	report("channel_unbuffered", 2, message_rate(channel_producer, channel_consumer, unbuffered), "msgs_per_s");
+	channel_destroy(unbuffered);
+}
+
+//read-mostly shared table, behind a pthread_rwlock or the classic readers-writer pair of semaphores
+//where the first reader in locks writers out and the last one out lets them back in
+long table[TABLE_SIZE];
+volatile long table_ops[TABLE_THREADS];
+pthread_rwlock_t table_rwlock;
+sem_t table_write, table_readers_lock;
+long table_readers;
+
+void table_read_sem()
+{
+	sem_wait(&table_readers_lock);
+	if(++table_readers == 1)
+		sem_wait(&table_write);
+	sem_post(&table_readers_lock);
+}
+
+void table_unread_sem()
+{
+	sem_wait(&table_readers_lock);
+	if(--table_readers == 0)
+		sem_post(&table_write);
+	sem_post(&table_readers_lock);
+}
+
+long table_use(long op)
+{
+	long i, sum = 0;
+	if(op % WRITE_EVERY == 0)
+		for(i = 0; i < TABLE_SIZE; i++)
+			table[i]++;
+	else
+		for(i = 0; i < TABLE_SIZE; i++)
+			sum += table[i];
+	return sum;
+}
+
+void* table_rwlock_user(void* arg)
+{
+	long me = (long) arg;
+	long op;
+	for(op = 0; !__atomic_load_n(&stop, __ATOMIC_ACQUIRE); op++)
+	{
+		if(op % WRITE_EVERY == 0)
+			pthread_rwlock_wrlock(&table_rwlock);
+		else
+			pthread_rwlock_rdlock(&table_rwlock);
+		table_use(op);
+		pthread_rwlock_unlock(&table_rwlock);
+		table_ops[me]++;
+	}
+	return NULL;
+}
+
+void* table_sem_user(void* arg)
+{
+	long me = (long) arg;
+	long op;
+	for(op = 0; !__atomic_load_n(&stop, __ATOMIC_ACQUIRE); op++)
+	{
+		int writing = op % WRITE_EVERY == 0;
+		if(writing)
+			sem_wait(&table_write);
+		else
+			table_read_sem();
+		table_use(op);
+		if(writing)
+			sem_post(&table_write);
+		else
+			table_unread_sem();
+		table_ops[me]++;
+	}
+	return NULL;
+}
+
+double table_rate(void* (*user)(void*))
+{
+	pthread_t threads[TABLE_THREADS];
+	stop = 0;
+
+	uint64_t start = now();
+	long i;
+	for(i = 0; i < TABLE_THREADS; i++)
+	{
+		table_ops[i] = 0;
+		pthread_create(&threads[i], NULL, user, (void*) i);
+	}
+
+	struct timespec run = {BENCH_NS / 1000000000L, BENCH_NS % 1000000000L};
+	nanosleep(&run, NULL);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+
+	long count = 0;
+	for(i = 0; i < TABLE_THREADS; i++)
+	{
+		pthread_join(threads[i], NULL);
+		count += table_ops[i];
+	}
+	return count * 1e9 / (now() - start);
+}
+
+void bench_table()
+{
+	pthread_rwlock_init(&table_rwlock, NULL);
+	report("rwlock_table", TABLE_THREADS, table_rate(table_rwlock_user), "ops_per_s");
+	pthread_rwlock_destroy(&table_rwlock);
+
+	sem_init(&table_write, 0, 1);
+	sem_init(&table_readers_lock, 0, 1);
+	table_readers = 0;
+	report("sem_rwlock_table", TABLE_THREADS, table_rate(table_sem_user), "ops_per_s");
+	sem_destroy(&table_write);
+	sem_destroy(&table_readers_lock);
+}
+
+//phase loop: every thread waits for all the others each round, on a pthread_barrier or on a barrier
+//built from a semaphore per thread that the last one to arrive posts
+pthread_barrier_t phase_barrier;
+sem_t phase_lock;
+sem_t phase_gate[BARRIER_THREADS];
+int phase_arrived;
+
+void* phase_pthread(void* arg)
+{
+	int round;
+	for(round = 0; round < BARRIER_ROUNDS; round++)
+		pthread_barrier_wait(&phase_barrier);
+	return NULL;
+}
+
+void* phase_sem(void* arg)
+{
+	long me = (long) arg;
+	int round;
+	for(round = 0; round < BARRIER_ROUNDS; round++)
+	{
+		sem_wait(&phase_lock);
+		if(++phase_arrived < BARRIER_THREADS)
+		{
+			sem_post(&phase_lock);
+			sem_wait(&phase_gate[me]);
+			continue;
+		}
+
+		phase_arrived = 0;
+		sem_post(&phase_lock);
+		int i;
+		for(i = 0; i < BARRIER_THREADS; i++)
+			if(i != me)
+				sem_post(&phase_gate[i]);
+	}
+	return NULL;
+}
+
+double phase_rate(void* (*phase)(void*))
+{
+	pthread_t threads[BARRIER_THREADS];
+	uint64_t start = now();
+	long i;
+	for(i = 0; i < BARRIER_THREADS; i++)
+		pthread_create(&threads[i], NULL, phase, (void*) i);
+	for(i = 0; i < BARRIER_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	return BARRIER_ROUNDS * 1e9 / (now() - start);
+}
+
+void bench_barrier()
+{
+	pthread_barrier_init(&phase_barrier, NULL, BARRIER_THREADS);
+	report("barrier", BARRIER_THREADS, phase_rate(phase_pthread), "rounds_per_s");
+	pthread_barrier_destroy(&phase_barrier);
+
+	int i;
+	sem_init(&phase_lock, 0, 1);
+	for(i = 0; i < BARRIER_THREADS; i++)
+		sem_init(&phase_gate[i], 0, 0);
+	phase_arrived = 0;
+	report("sem_barrier", BARRIER_THREADS, phase_rate(phase_sem), "rounds_per_s");
+	sem_destroy(&phase_lock);
+	for(i = 0; i < BARRIER_THREADS; i++)
+		sem_destroy(&phase_gate[i]);
+}
+
+//fan-out: ITEMS tiny work items as pool tasks, as a parallel_reduce, and as one thread per item
+long items_done;
+
+void item_task(void* arg)
+{
+	__atomic_add_fetch(&items_done, 1, __ATOMIC_RELAXED);
+}
+
+void* item_thread(void* arg)
+{
+	__atomic_add_fetch(&items_done, 1, __ATOMIC_RELAXED);
+	return arg;
+}
+
+void item_sum(long begin, long end, void* partial, void* arg)
+{
+	long i;
+	for(i = begin; i < end; i++)
+		*(long*) partial += i;
+}
+
+void item_combine(void* result, const void* partial, void* arg)
+{
+	*(long*) result += *(const long*) partial;
+}
+
+void bench_tasks()
+{
+	static pthread_t threads[ITEM_BATCH];
+	long i, j;
+	items_done = 0;
+	uint64_t start = now();
+	for(i = 0; i < ITEMS; i += ITEM_BATCH)
+	{
+		for(j = 0; j < ITEM_BATCH; j++)
+		{
+			int error = pthread_create(&threads[j], NULL, item_thread, NULL);
+			if(error != 0)
+			{
+				report_error("thread_per_item", ITEM_BATCH, i + j, error);
+				while(j > 0)
+					pthread_join(threads[--j], NULL);
+				return;
+			}
+		}
+		for(j = 0; j < ITEM_BATCH; j++)
+			pthread_join(threads[j], NULL);
+	}
+	report("thread_per_item", ITEM_BATCH, ITEMS * 1e9 / (now() - start), "items_per_s");
+
+	//the task pool only exists in the green runtime
+	if(task_spawn == NULL)
+		return;
+
+	task_group items = TASK_GROUP_INITIALIZER;
+	items_done = 0;
+	start = now();
+	for(i = 0; i < ITEMS; i++)
+		task_spawn(&items, item_task, NULL);
+	task_wait(&items);
+	uint64_t elapsed = now() - start;
+	if(items_done == ITEMS)
+		report("tasks", pthread_getconcurrency(), ITEMS * 1e9 / elapsed, "items_per_s");
+
+	long sum = 0;
+	start = now();
+	parallel_reduce(0, ITEMS, 1, &sum, sizeof(long), item_sum, item_combine, NULL);
+	elapsed = now() - start;
+	if(sum == (long) ITEMS * (ITEMS - 1) / 2)
+		report("parallel_reduce", pthread_getconcurrency(), ITEMS * 1e9 / elapsed, "items_per_s");
+}
+
+//malloc churn: each thread frees a random slot when it is full and fills it with 16 to 1024 bytes when it is empty
+void* malloc_churn(void* arg)
+{
+	void* slots[MALLOC_SLOTS] = {NULL};
+	unsigned long seed = (unsigned long) arg * 2654435761UL + 1;
+	int i;
+	for(i = 0; i < MALLOC_OPS; i++)
+	{
+		seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+		int slot = (seed >> 33) % MALLOC_SLOTS;
+		if(slots[slot] != NULL)
+		{
+			free(slots[slot]);
+			slots[slot] = NULL;
+		}
+		else
+		{
+			slots[slot] = malloc(16 + (seed >> 40) % 1009);
+			*(char*) slots[slot] = 1;
+		}
+	}
+	for(i = 0; i < MALLOC_SLOTS; i++)
+		free(slots[i]);
+	return arg;
+}
+
+void bench_malloc()
+{
+	pthread_t threads[MALLOC_THREADS];
+	long ops = 0;
+	long generation = 0;
+	uint64_t start = now();
+	uint64_t elapsed;
+
+	//a fresh generation of threads each round, so caches keep being torn down and rebuilt
+	do
+	{
+		int i;
+		for(i = 0; i < MALLOC_THREADS; i++)
+		{
+			int error = pthread_create(&threads[i], NULL, malloc_churn, (void*)(generation * MALLOC_THREADS + i));
+			if(error != 0)
+			{
+				report_error("malloc_churn", MALLOC_THREADS, i, error);
+				while(i > 0)
+					pthread_join(threads[--i], NULL);
+				return;
+			}
+		}
+		for(i = 0; i < MALLOC_THREADS; i++)
+			pthread_join(threads[i], NULL);
+		ops += MALLOC_THREADS * MALLOC_OPS;
+		generation++;
+		elapsed = now() - start;
+	}
+	while(elapsed < BENCH_NS);
+
+	report("malloc_churn", MALLOC_THREADS, ops * 1e9 / elapsed, "ops_per_s");
+}
+
+//blocking calls: every fsync holds a kernel thread until the disk answers, which must not hold up the others
+volatile long fsyncs;
+
+void* fsync_loop(void* arg)
+{
+	char path[] = "/tmp/threads_bench_XXXXXX";
+	int fd = mkstemp(path);
+	if(fd < 0)
+		return NULL;
+	unlink(path);
+
+	while(!__atomic_load_n(&stop, __ATOMIC_ACQUIRE))
+	{
+		if(write(fd, path, sizeof(path)) < 0 || fsync(fd) < 0)
+			break;
+		__atomic_add_fetch(&fsyncs, 1, __ATOMIC_RELAXED);
+	}
+	close(fd);
+	return arg;
+}
+
+void bench_blocking()
+{
+	pthread_t threads[FSYNC_THREADS];
+	fsyncs = 0;
+	stop = 0;
+	int i;
+	for(i = 0; i < FSYNC_THREADS; i++)
+		pthread_create(&threads[i], NULL, fsync_loop, NULL);
+
+	uint64_t start = now();
+	uint64_t late = 0;
+	while(now() - start < BENCH_NS)
+	{
+		uint64_t before = now();
+		struct timespec tick = {0, TICK_NS};
+		nanosleep(&tick, NULL);
+		uint64_t slept = now() - before;
+		if(slept > TICK_NS && slept - TICK_NS > late)
+			late = slept - TICK_NS;
+	}
+	uint64_t elapsed = now() - start;
+
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+	for(i = 0; i < FSYNC_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	report("fsync", FSYNC_THREADS, fsyncs * 1e9 / elapsed, "ops_per_s");
+	report("tick_late_max", FSYNC_THREADS, late, "ns");
+}
+
+//wakeup latency: how late each TICK_NS sleep ends, the hogs spin until the sleeper is done
+//the hogs and the sleeper first switch to hog_policy and sleeper_policy, sleeper_error is why the sleeper couldn't
+uint64_t lateness[LATENCY_SAMPLES];
+long samples;
+int hog_policy, sleeper_policy;
+int sleeper_error;
+
+//the lowest priority of policy, 0 for the fair ones
+int set_policy(int policy)
+{
+	struct sched_param param = {sched_get_priority_min(policy)};
+	return pthread_setschedparam(pthread_self(), policy, &param);
+}
+
+void* hog(void* arg)
+{
+	set_policy(hog_policy);
+	volatile unsigned long hash = (unsigned long) arg;
+	while(!__atomic_load_n(&stop, __ATOMIC_ACQUIRE))
+		hash = hash * 6364136223846793005UL + 1442695040888963407UL;
+	return NULL;
+}
+
+void* sleeper(void* arg)
+{
+	samples = 0;
+	sleeper_error = set_policy(sleeper_policy);
+	if(sleeper_error != 0)
+	{
+		__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+		return arg;
+	}
+	uint64_t start = now();
+	for(samples = 0; samples < LATENCY_SAMPLES && now() - start < LATENCY_NS; samples++)
+	{
+		uint64_t before = now();
+		struct timespec tick = {0, TICK_NS};
+		nanosleep(&tick, NULL);
+		uint64_t slept = now() - before;
+		lateness[samples] = slept > TICK_NS ? slept - TICK_NS : 0;
+	}
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+	return arg;
+}
+
+int compare_lateness(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+	return x < y ? -1 : x > y;
+}
+
+//runs the sleeper next to hogs threads, with the policies given, and reports the 99th percentile and the worst
+//of its lateness
+void sleep_lateness(const char* bench, int hogs, int hogs_run_as, int sleeper_runs_as)
+{
+	pthread_t threads[hogs + 1];
+	stop = 0;
+	hog_policy = hogs_run_as;
+	sleeper_policy = sleeper_runs_as;
+	long i;
+	for(i = 0; i < hogs; i++)
+		pthread_create(&threads[i], NULL, hog, (void*) i);
+	pthread_create(&threads[hogs], NULL, sleeper, NULL);
+	for(i = 0; i <= hogs; i++)
+		pthread_join(threads[i], NULL);
+
+	if(sleeper_error != 0)
+	{
+		report_error(bench, hogs + 1, hogs, sleeper_error);
+		return;
+	}
+	qsort(lateness, samples, sizeof(lateness[0]), compare_lateness);
+	char name[64];
+	snprintf(name, sizeof(name), "%s_p99", bench);
+	report(name, hogs + 1, lateness[samples * 99 / 100], "ns");
+	snprintf(name, sizeof(name), "%s_max", bench);
+	report(name, hogs + 1, lateness[samples - 1], "ns");
+}
+
+void bench_latency(int cpus)
+{
+	int hogs = LATENCY_HOGS_PER_CPU * cpus;
+	sleep_lateness("sleep_late", hogs, SCHED_OTHER, SCHED_OTHER);
+
+	//the same interactive thread when the hogs are marked as background work, and when it is marked real-time,
+	//which needs privileges under nptl
+	sleep_lateness("interactive_late_idle_hogs", hogs, SCHED_IDLE, SCHED_OTHER);
+	sleep_lateness("interactive_late_batch_hogs", hogs, SCHED_BATCH, SCHED_OTHER);
+	sleep_lateness("interactive_late_fifo", hogs, SCHED_OTHER, SCHED_FIFO);
+
+	//only the green runtime has a quantum to set
+	struct timespec saved;
+	if(pthread_setquantum_np == NULL || pthread_getquantum_np(&saved) != 0)
+		return;
+	int i;
+	for(i = 0; i < LATENCY_QUANTA; i++)
+	{
+		struct timespec slice = {0, latency_quanta[i] * 1000000L};
+		pthread_setquantum_np(&slice);
+		char bench[64];
+		snprintf(bench, sizeof(bench), "sleep_late_quantum_%ldms", latency_quanta[i]);
+		sleep_lateness(bench, hogs, SCHED_OTHER, SCHED_OTHER);
+	}
+	pthread_setquantum_np(&saved);
+}
+
+//carrier scaling: the same CPU-bound work at 1, 2, ... carriers, which should take close to 1/n the time at n
+long spin_share;
+
+void* spinner(void* arg)
+{
+	volatile unsigned long hash = (unsigned long) arg;
+	long i;
+	for(i = 1; i <= spin_share; i++)
+	{
+		hash = hash * 6364136223846793005UL + 1442695040888963407UL;
+		if(i % SPIN_SLICE == 0)
+			sched_yield();
+	}
+	return NULL;
+}
+
+void bench_carriers(int cpus)
+{
+	//concurrency only grows, so this runs before main hands out every core; nptl runs on all of them anyway
+	int carriers = pthread_getquantum_np != NULL ? 1 : cpus;
+	long count = (long) SPINNERS_PER_CPU * cpus;
+	pthread_t* threads = malloc(count * sizeof(pthread_t));
+	spin_share = SPIN_WORK / count;
+
+	for(; carriers <= cpus; carriers++)
+	{
+		pthread_setconcurrency(carriers);
+		uint64_t start = now();
+		long i;
+		for(i = 0; i < count; i++)
+			pthread_create(&threads[i], NULL, spinner, (void*) i);
+		for(i = 0; i < count; i++)
+			pthread_join(threads[i], NULL);
+		uint64_t elapsed = now() - start;
+		report("carrier_scaling", carriers, spin_share * count * 1e9 / elapsed, "iterations_per_s");
+	}
+	free(threads);
+}
+
+//echo server: one thread accepts and starts a thread per connection, which echoes until the client hangs up
+int echo_listener;
+pthread_attr_t echo_attr;
+volatile long echo_active;
+
+void* echo_connection(void* arg)
+{
+	int fd = (int)(long) arg;
+	char buf[ECHO_SIZE];
+	ssize_t done;
+	while((done = read(fd, buf, sizeof(buf))) > 0)
+		if(write(fd, buf, done) != done)
+			break;
+	close(fd);
+	__atomic_sub_fetch(&echo_active, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+void* echo_acceptor(void* arg)
+{
+	int fd;
+	while((fd = accept(echo_listener, NULL, NULL)) >= 0)
+	{
+		pthread_t thread;
+		__atomic_add_fetch(&echo_active, 1, __ATOMIC_RELAXED);
+		if(pthread_create(&thread, &echo_attr, echo_connection, (void*)(long) fd) != 0)
+		{
+			close(fd);
+			__atomic_sub_fetch(&echo_active, 1, __ATOMIC_RELAXED);
+		}
+	}
+	return NULL;
+}
+
+//the clients' side, run in a process of its own so each side gets the whole fd limit: opens the connections,
+//then has one message in flight on every one of them per round; prints how many connected and the time the rounds took
+int echo_client(int port, long count, int rounds)
+{
+	int* fds = malloc(count * sizeof(int));
+	struct sockaddr_in server;
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons(port);
+	server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	long connected;
+	for(connected = 0; connected < count; connected++)
+	{
+		fds[connected] = socket(AF_INET, SOCK_STREAM, 0);
+		if(fds[connected] < 0 || connect(fds[connected], (struct sockaddr*) &server, sizeof(server)) < 0)
+			break;
+	}
+
+	char message[ECHO_SIZE] = "echo";
+	uint64_t start = now();
+	int round;
+	long i;
+	for(round = 0; round < rounds; round++)
+	{
+		for(i = 0; i < connected; i++)
+			if(write(fds[i], message, sizeof(message)) != sizeof(message))
+				return 1;
+		for(i = 0; i < connected; i++)
+		{
+			char reply[ECHO_SIZE];
+			size_t got = 0;
+			ssize_t done;
+			while(got < sizeof(reply) && (done = read(fds[i], reply + got, sizeof(reply) - got)) > 0)
+				got += done;
+			if(got < sizeof(reply))
+				return 1;
+		}
+	}
+	printf("%ld %llu\n", connected, (unsigned long long)(now() - start));
+	return 0;
+}
+
+void raise_fd_limit()
+{
+	struct rlimit files;
+	if(getrlimit(RLIMIT_NOFILE, &files) == 0)
+	{
+		files.rlim_cur = files.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &files);
+	}
+}
+
+void bench_echo(const char* self)
+{
+	raise_fd_limit();
+	echo_listener = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in address;
+	socklen_t size = sizeof(address);
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(echo_listener, (struct sockaddr*) &address, sizeof(address)) < 0 || listen(echo_listener, SOMAXCONN) < 0
+			|| getsockname(echo_listener, (struct sockaddr*) &address, &size) < 0)
+	{
+		report_error("echo", ECHO_CONNECTIONS, 0, errno);
+		close(echo_listener);
+		return;
+	}
+
+	pthread_attr_init(&echo_attr);
+	pthread_attr_setdetachstate(&echo_attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&echo_attr, ECHO_STACK);
+	echo_active = 0;
+	pthread_t acceptor;
+	pthread_create(&acceptor, NULL, echo_acceptor, NULL);
+
+	//the clients' result comes back on a pipe, read before the wait so the server threads keep running meanwhile
+	char port[16], count[16], rounds[16];
+	snprintf(port, sizeof(port), "%d", ntohs(address.sin_port));
+	snprintf(count, sizeof(count), "%d", ECHO_CONNECTIONS);
+	snprintf(rounds, sizeof(rounds), "%d", ECHO_ROUNDS);
+	char* argv[] = {(char*) self, "--echo-client", port, count, rounds, NULL};
+	int results[2];
+	pid_t client = -1;
+	if(pipe(results) == 0)
+	{
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		posix_spawn_file_actions_adddup2(&actions, results[1], 1);
+		posix_spawn_file_actions_addclose(&actions, results[0]);
+		if(posix_spawn(&client, self, &actions, NULL, argv, NULL) != 0)
+			client = -1;
+		posix_spawn_file_actions_destroy(&actions);
+		close(results[1]);
+	}
+
+	char line[64] = "";
+	size_t got = 0;
+	ssize_t done;
+	while(client > 0 && got < sizeof(line) - 1 && (done = read(results[0], line + got, sizeof(line) - 1 - got)) > 0)
+		got += done;
+	close(results[0]);
+	if(client > 0)
+		waitpid(client, NULL, 0);
+
+	//the hung up connections' threads finish, and the acceptor is woken out of accept
+	shutdown(echo_listener, SHUT_RDWR);
+	pthread_join(acceptor, NULL);
+	close(echo_listener);
+	while(__atomic_load_n(&echo_active, __ATOMIC_ACQUIRE) > 0)
+		sched_yield();
+	pthread_attr_destroy(&echo_attr);
+
+	long connected = 0;
+	unsigned long long elapsed = 0;
+	if(sscanf(line, "%ld %llu", &connected, &elapsed) != 2 || elapsed == 0)
+	{
+		report_error("echo", ECHO_CONNECTIONS, connected, EIO);
+		return;
+	}
+	if(connected < ECHO_CONNECTIONS)
+		report_error("echo_connections", ECHO_CONNECTIONS, connected, EMFILE);
+	report("echo", connected, connected * ECHO_ROUNDS * 1e9 / elapsed, "echoes_per_s");
+}
+
+//threads for the memory and scalability runs park on this until released
+sem_t go;
+
+void* parked(void* arg)
+{
+	sem_wait(&go);
+	return arg;
+}
+
+//starts count parked threads, returns how many were created and the first error in *error
+long park_threads(pthread_t* threads, long count, int* error)
+{
+	long i;
+	*error = 0;
+	for(i = 0; i < count; i++)
+	{
+		*error = pthread_create(&threads[i], NULL, parked, NULL);
+		if(*error != 0)
+			break;
+	}
+	return i;
+}
+
+void release_threads(pthread_t* threads, long count)
+{
+	long i;
+	for(i = 0; i < count; i++)
+		sem_post(&go);
+	for(i = 0; i < count; i++)
+		pthread_join(threads[i], NULL);
+}
+
+void bench_memory()
+{
+	pthread_t* threads = malloc(MEMORY_THREADS * sizeof(pthread_t));
+	sem_init(&go, 0, 0);
+
+	long rss_before, vsz_before, rss_after, vsz_after;
+	memory_usage(&rss_before, &vsz_before);
+
+	int error;
+	long created = park_threads(threads, MEMORY_THREADS, &error);
+	//give every thread the chance to run up to its sem_wait, so its stack is actually touched
+	sched_yield();
+	struct timespec settle = {0, 50000000L};
+	nanosleep(&settle, NULL);
+	memory_usage(&rss_after, &vsz_after);
+
+	release_threads(threads, created);
+	sem_destroy(&go);
+	free(threads);
+
+	if(error != 0)
+	{
+		report_error("memory", MEMORY_THREADS, created, error);
+		return;
+	}
+	report("memory_rss", MEMORY_THREADS, (double)(rss_after - rss_before) / created, "bytes_per_thread");
+	report("memory_vsz", MEMORY_THREADS, (double)(vsz_after - vsz_before) / created, "bytes_per_thread");
+}
+
+//idle cost: CPU time the process burns per second of wall time with nothing but parked threads, which a tick
+//that keeps firing with nobody to switch to would show
+void bench_idle()
+{
+	pthread_t threads[IDLE_THREADS];
+	sem_init(&go, 0, 0);
+	int error;
+	long created = park_threads(threads, IDLE_THREADS, &error);
+	struct timespec settle = {0, 50000000L};
+	nanosleep(&settle, NULL);
+
+	struct timespec before, after;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &before);
+	struct timespec idle = {IDLE_NS / 1000000000L, IDLE_NS % 1000000000L};
+	nanosleep(&idle, NULL);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &after);
+
+	release_threads(threads, created);
+	sem_destroy(&go);
+
+	if(error != 0)
+	{
+		report_error("idle_cpu", IDLE_THREADS, created, error);
+		return;
+	}
+	double cpu = (after.tv_sec - before.tv_sec) * 1e9 + (after.tv_nsec - before.tv_nsec);
+	report("idle_cpu", IDLE_THREADS, cpu * 1e9 / IDLE_NS, "cpu_ns_per_s");
+}
+
+//create count parked threads, release and join them all, per thread cost of the whole round
+void bench_scale(long max)
+{
+	pthread_t* threads = malloc(max * sizeof(pthread_t));
+	sem_init(&go, 0, 0);
+
+	//2, 10, 100, ... and max itself
+	long count = 2;
+	while(1)
+	{
+		uint64_t start = now();
+		int error;
+		long created = park_threads(threads, count, &error);
+		release_threads(threads, created);
+		uint64_t elapsed = now() - start;
+
+		//past the first failure the larger counts would fail too
+		if(error != 0)
+		{
+			report_error("scale", count, created, error);
+			break;
+		}
+		report("scale", count, (double) elapsed / count, "ns_per_thread");
+
+		if(count >= max)
+			break;
+		count = count == 2 ? 10 : count * 10;
+		if(count > max)
+			count = max;
+	}
+
+	sem_destroy(&go);
+	free(threads);
+}
+
+int main(int argc, char** argv)
+{
+	if(argc == 5 && strcmp(argv[1], "--echo-client") == 0)
+	{
+		raise_fd_limit();
+		return echo_client(atoi(argv[2]), atol(argv[3]), atoi(argv[4]));
+	}
+
+	long max = SCALE_MAX;
+	if(argc > 1)
+		max = atol(argv[1]);
+	if(max < 2)
+	{
+		fprintf(stderr, "usage: %s [max threads, at least 2]\n", argv[0]);
+		return 1;
+	}
+
+	runtime_name = pthread_getquantum_np != NULL ? "green" : "nptl";
+
+	//both runtimes get every online core, the green one otherwise runs a single carrier
+	int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	report("cpus", 0, cpus, "cores");
+	bench_carriers(cpus);
+	pthread_setconcurrency(cpus);
+
+	bench_raw_switch();
+	bench_switch();
+	bench_switch_scaling();
+	bench_create_join();
+	bench_sem_uncontended();
+	bench_critical_section();
+	bench_sem_contended();
+	bench_sem_pingpong();
+	bench_messages();
+	bench_table();
+	bench_barrier();
+	bench_tasks();
+	bench_malloc();
+	bench_blocking();
+	bench_latency(cpus);
+	bench_echo("/proc/self/exe");
+	bench_memory();
+	bench_idle();
+	bench_scale(max);
+
+	return 0;
+}
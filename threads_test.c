@@ -0,0 +1,1340 @@
+//behaviour tests for threads.c, run with one carrier and then with several:
+//
+//	gcc -O2 -o threads_test threads_test.c threads.c -ldl -lrt -lm
+//
+//	./threads_test [carriers]
+//
+//without an argument the program runs itself once with 1 carrier and once with TEST_CARRIERS or the online
+//cores, whichever is more, each in a child it kills if it hangs; a line is printed per test and the exit
+//status is the number of failures. The second child runs with scheduler tracing on (THREADS_TRACE)
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fenv.h>
+#include <malloc.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "threads.h"
+
+//carriers of the second run, at least this many even on a machine with fewer cores
+#define TEST_CARRIERS 4
+//seconds a run gets before it is killed as hung
+#define TEST_TIMEOUT 120
+//threads and iterations most tests use
+#define WORKERS 8
+#define ROUNDS 20000
+
+int run_carriers;
+int failures = 0;
+const char* test_name;
+
+#define check(condition) do { if(!(condition)) fail(#condition, __LINE__); } while(0)
+
+void fail(const char* condition, int line)
+{
+	__atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+	printf("FAIL %s, %d carriers: %s, line %d\n", test_name, run_carriers, condition, line);
+	fflush(stdout);
+}
+
+//errno read and set through a call, so the address can't be one the caller looked up on another carrier, see threads.h
+__attribute__((noinline)) int last_error()
+{
+	asm volatile("");
+	return errno;
+}
+
+__attribute__((noinline)) void set_error(int error)
+{
+	asm volatile("");
+	errno = error;
+}
+
+uint64_t now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+//absolute CLOCK_REALTIME deadline ns from now
+struct timespec deadline(long ns)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += ns;
+	ts.tv_sec += ts.tv_nsec / 1000000000L;
+	ts.tv_nsec %= 1000000000L;
+	return ts;
+}
+
+//starts count threads running fn with their index as the argument and joins them
+void run_threads(int count, void* (*fn)(void*))
+{
+	pthread_t threads[count];
+	long i;
+	for(i = 0; i < count; i++)
+		check(pthread_create(&threads[i], NULL, fn, (void*) i) == 0);
+	for(i = 0; i < count; i++)
+		pthread_join(threads[i], NULL);
+}
+
+void* plus_one(void* arg)
+{
+	return (char*) arg + 1;
+}
+
+sem_t detached_done;
+
+void* detached_thread(void* arg)
+{
+	sem_post(&detached_done);
+	return arg;
+}
+
+void test_create_join()
+{
+	pthread_t threads[100];
+	long i;
+	for(i = 0; i < 100; i++)
+		check(pthread_create(&threads[i], NULL, plus_one, (void*) i) == 0);
+	for(i = 0; i < 100; i++)
+	{
+		void* result;
+		check(pthread_join(threads[i], &result) == 0);
+		check(result == (void*)(i + 1));
+	}
+	//a joined thread's id is stale
+	check(pthread_join(threads[0], NULL) == ESRCH);
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	sem_init(&detached_done, 0, 0);
+	for(i = 0; i < 100; i++)
+	{
+		pthread_t thread;
+		check(pthread_create(&thread, &attr, detached_thread, NULL) == 0);
+	}
+	for(i = 0; i < 100; i++)
+		sem_wait(&detached_done);
+	sem_destroy(&detached_done);
+	pthread_attr_destroy(&attr);
+}
+
+//batches: every thread of a batch gets its own argument, and a batch without arguments passes NULL
+#define BATCH 100
+
+void test_batch()
+{
+	pthread_t threads[BATCH];
+	void* args[BATCH];
+	long i;
+	for(i = 0; i < BATCH; i++)
+		args[i] = (void*) (i * 2);
+	check(pthread_create_batch_np(threads, BATCH, NULL, plus_one, args) == BATCH);
+	for(i = 0; i < BATCH; i++)
+	{
+		void* result;
+		check(pthread_join(threads[i], &result) == 0 && result == (void*) (i * 2 + 1));
+	}
+
+	check(pthread_create_batch_np(threads, BATCH, NULL, plus_one, NULL) == BATCH);
+	for(i = 0; i < BATCH; i++)
+	{
+		void* result;
+		check(pthread_join(threads[i], &result) == 0 && result == (void*) 1);
+	}
+	check(pthread_create_batch_np(threads, 0, NULL, plus_one, NULL) == 0);
+}
+
+//a thread asked for more than the runtime's default gets it; not libc's own default, which a set attr can't be told from
+#define BIG_STACK (4 << 20)
+#define STACK_USED (200 * 1024)
+
+void* use_stack(void* arg)
+{
+	volatile char frame[STACK_USED];
+	memset((char*) frame, 1, sizeof(frame));
+	return (void*)(long) frame[STACK_USED - 1];
+}
+
+void test_stack_size()
+{
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	check(pthread_attr_setstacksize(&attr, BIG_STACK) == 0);
+	pthread_t thread;
+	void* result = NULL;
+	check(pthread_create(&thread, &attr, use_stack, NULL) == 0);
+	pthread_join(thread, &result);
+	check(result == (void*) 1L);
+	pthread_attr_destroy(&attr);
+}
+
+//semaphores: a ring passed through by two producers and two consumers
+#define RING 16
+long ring[RING];
+long ring_in, ring_out, ring_sum;
+sem_t ring_free, ring_used, ring_lock;
+
+void* ring_producer(void* arg)
+{
+	long i;
+	for(i = 1; i <= ROUNDS; i++)
+	{
+		sem_wait(&ring_free);
+		sem_wait(&ring_lock);
+		ring[ring_in++ % RING] = i;
+		sem_post(&ring_lock);
+		sem_post(&ring_used);
+	}
+	return NULL;
+}
+
+void* ring_consumer(void* arg)
+{
+	long i;
+	for(i = 0; i < ROUNDS; i++)
+	{
+		sem_wait(&ring_used);
+		sem_wait(&ring_lock);
+		ring_sum += ring[ring_out++ % RING];
+		sem_post(&ring_lock);
+		sem_post(&ring_free);
+	}
+	return NULL;
+}
+
+void* ring_user(void* arg)
+{
+	return (long) arg % 2 == 0 ? ring_producer(arg) : ring_consumer(arg);
+}
+
+void test_semaphore()
+{
+	ring_in = ring_out = ring_sum = 0;
+	sem_init(&ring_free, 0, RING);
+	sem_init(&ring_used, 0, 0);
+	sem_init(&ring_lock, 0, 1);
+	run_threads(4, ring_user);
+	check(ring_sum == 2L * ROUNDS * (ROUNDS + 1) / 2);
+
+	int value;
+	sem_getvalue(&ring_free, &value);
+	check(value == RING);
+	check(sem_trywait(&ring_used) == -1 && last_error() == EAGAIN);
+	struct timespec soon = deadline(10000000L);
+	uint64_t start = now();
+	check(sem_timedwait(&ring_used, &soon) == -1 && last_error() == ETIMEDOUT);
+	check(now() - start >= 9000000L);
+
+	sem_destroy(&ring_free);
+	sem_destroy(&ring_used);
+	sem_destroy(&ring_lock);
+}
+
+//mutexes: every thread adds to a counter under the lock
+pthread_mutex_t counter_lock = PTHREAD_MUTEX_INITIALIZER;
+long counter;
+
+void* count_up(void* arg)
+{
+	int i;
+	for(i = 0; i < ROUNDS; i++)
+	{
+		pthread_mutex_lock(&counter_lock);
+		long seen = counter;
+		//a thread switched out here would make another's increment get lost without the lock
+		if(i % 1000 == 0)
+			sched_yield();
+		counter = seen + 1;
+		pthread_mutex_unlock(&counter_lock);
+	}
+	return NULL;
+}
+
+pthread_mutex_t held;
+
+void* try_held(void* arg)
+{
+	check(pthread_mutex_trylock(&held) == EBUSY);
+	return NULL;
+}
+
+void test_mutex()
+{
+	counter = 0;
+	run_threads(WORKERS, count_up);
+	check(counter == (long) WORKERS * ROUNDS);
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&held, &attr);
+	check(pthread_mutex_lock(&held) == 0);
+	check(pthread_mutex_lock(&held) == 0);
+	run_threads(1, try_held);
+	check(pthread_mutex_unlock(&held) == 0);
+	check(pthread_mutex_unlock(&held) == 0);
+	check(pthread_mutex_unlock(&held) == EPERM);
+	pthread_mutex_destroy(&held);
+
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+	pthread_mutex_init(&held, &attr);
+	check(pthread_mutex_lock(&held) == 0);
+	check(pthread_mutex_lock(&held) == EDEADLK);
+	check(pthread_mutex_unlock(&held) == 0);
+	pthread_mutex_destroy(&held);
+	pthread_mutexattr_destroy(&attr);
+}
+
+//condition variables: a one slot mailbox, and a broadcast that has to reach every waiter
+pthread_mutex_t box_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t box_empty = PTHREAD_COND_INITIALIZER;
+pthread_cond_t box_full = PTHREAD_COND_INITIALIZER;
+long box, box_sum;
+int box_has;
+
+void* box_user(void* arg)
+{
+	int producer = (long) arg % 2 == 0;
+	long i;
+	for(i = 1; i <= ROUNDS; i++)
+	{
+		pthread_mutex_lock(&box_lock);
+		while(box_has == producer)
+			pthread_cond_wait(producer ? &box_empty : &box_full, &box_lock);
+		if(producer)
+			box = i;
+		else
+			box_sum += box;
+		box_has = producer;
+		pthread_cond_signal(producer ? &box_full : &box_empty);
+		pthread_mutex_unlock(&box_lock);
+	}
+	return NULL;
+}
+
+pthread_cond_t gate = PTHREAD_COND_INITIALIZER;
+int gate_open, gate_waiting;
+//timeout of half the waiters, which passes while the opener still holds the mutex after its broadcast
+#define GATE_TIMEOUT 100000000L
+
+void* gate_waiter(void* arg)
+{
+	pthread_mutex_lock(&box_lock);
+	gate_waiting++;
+	while(!gate_open)
+	{
+		if((long) arg % 2 == 0)
+			pthread_cond_wait(&gate, &box_lock);
+		else
+		{
+			struct timespec later = deadline(GATE_TIMEOUT);
+			int result = pthread_cond_timedwait(&gate, &box_lock, &later);
+			check(result == 0 || (result == ETIMEDOUT && !gate_open));
+		}
+	}
+	pthread_mutex_unlock(&box_lock);
+	return NULL;
+}
+
+void* gate_opener(void* arg)
+{
+	//every other thread is queued on the condition before it opens
+	while(__atomic_load_n(&gate_waiting, __ATOMIC_RELAXED) < WORKERS - 1)
+		sched_yield();
+	pthread_mutex_lock(&box_lock);
+	gate_open = 1;
+	pthread_cond_broadcast(&gate);
+	usleep(2 * GATE_TIMEOUT / 1000);
+	pthread_mutex_unlock(&box_lock);
+	return NULL;
+}
+
+void* gate_user(void* arg)
+{
+	return (long) arg == 0 ? gate_opener(arg) : gate_waiter(arg);
+}
+
+void test_cond()
+{
+	box_has = 0;
+	box_sum = 0;
+	run_threads(2, box_user);
+	check(box_sum == (long) ROUNDS * (ROUNDS + 1) / 2);
+
+	gate_open = gate_waiting = 0;
+	run_threads(WORKERS, gate_user);
+
+	//a timeout hands the mutex back all the same
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+	pthread_mutex_t checked;
+	pthread_mutex_init(&checked, &attr);
+	pthread_mutex_lock(&checked);
+	struct timespec soon = deadline(10000000L);
+	check(pthread_cond_timedwait(&gate, &checked, &soon) == ETIMEDOUT);
+	check(pthread_mutex_unlock(&checked) == 0);
+	pthread_mutex_destroy(&checked);
+	pthread_mutexattr_destroy(&attr);
+}
+
+//channels: two senders and two receivers over a buffered and an unbuffered channel
+channel* pipe_channel;
+long channel_sum;
+
+void* channel_user(void* arg)
+{
+	long i, value;
+	for(i = 1; i <= ROUNDS; i++)
+	{
+		if((long) arg % 2 == 0)
+			check(channel_send(pipe_channel, &i) == 0);
+		else
+		{
+			check(channel_recv(pipe_channel, &value) == 0);
+			__atomic_add_fetch(&channel_sum, value, __ATOMIC_RELAXED);
+		}
+	}
+	return NULL;
+}
+
+channel* left;
+channel* right;
+
+void* select_sender(void* arg)
+{
+	long value = (long) arg;
+	channel_send(value == 1 ? left : right, &value);
+	return NULL;
+}
+
+void* close_later(void* arg)
+{
+	usleep(10000);
+	channel_close(arg);
+	return NULL;
+}
+
+void test_channels()
+{
+	size_t capacity;
+	for(capacity = 0; capacity <= 8; capacity += 8)
+	{
+		pipe_channel = channel_create(sizeof(long), capacity);
+		channel_sum = 0;
+		run_threads(4, channel_user);
+		check(channel_sum == 2L * ROUNDS * (ROUNDS + 1) / 2);
+		check(channel_destroy(pipe_channel) == 0);
+	}
+
+	//select gets each value once, from whichever channel has one
+	left = channel_create(sizeof(long), 0);
+	right = channel_create(sizeof(long), 0);
+	long a = 0, b = 0;
+	channel_case cases[2] = {{left, CHANNEL_RECV, &a, 0}, {right, CHANNEL_RECV, &b, 0}};
+	check(channel_select(cases, 2, 0) == -1);
+	pthread_t senders[2];
+	pthread_create(&senders[0], NULL, select_sender, (void*) 1L);
+	pthread_create(&senders[1], NULL, select_sender, (void*) 2L);
+	int first = channel_select(cases, 2, 1);
+	int second = channel_select(cases, 2, 1);
+	check(first != second && a == 1 && b == 2);
+	pthread_join(senders[0], NULL);
+	pthread_join(senders[1], NULL);
+
+	//a close wakes a parked receiver, buffered values are still received after it
+	pthread_t closer;
+	pthread_create(&closer, NULL, close_later, left);
+	check(channel_recv(left, &a) == EPIPE && a == 0);
+	pthread_join(closer, NULL);
+	check(channel_send(left, &a) == EPIPE);
+	channel_destroy(left);
+	channel_destroy(right);
+
+	channel* buffered = channel_create(sizeof(long), 2);
+	a = 7;
+	channel_send(buffered, &a);
+	channel_close(buffered);
+	check(channel_recv(buffered, &b) == 0 && b == 7);
+	check(channel_recv(buffered, &b) == EPIPE);
+	channel_destroy(buffered);
+}
+
+//rwlocks: readers never see a writer inside, writers never see anyone else
+pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+int table_readers, table_writers;
+
+void* table_user(void* arg)
+{
+	int i;
+	for(i = 0; i < ROUNDS / 10; i++)
+	{
+		if((long) arg % 4 == 0)
+		{
+			pthread_rwlock_wrlock(&table_lock);
+			check(__atomic_add_fetch(&table_writers, 1, __ATOMIC_SEQ_CST) == 1);
+			check(__atomic_load_n(&table_readers, __ATOMIC_SEQ_CST) == 0);
+			sched_yield();
+			__atomic_sub_fetch(&table_writers, 1, __ATOMIC_SEQ_CST);
+		}
+		else
+		{
+			pthread_rwlock_rdlock(&table_lock);
+			__atomic_add_fetch(&table_readers, 1, __ATOMIC_SEQ_CST);
+			check(__atomic_load_n(&table_writers, __ATOMIC_SEQ_CST) == 0);
+			sched_yield();
+			__atomic_sub_fetch(&table_readers, 1, __ATOMIC_SEQ_CST);
+		}
+		pthread_rwlock_unlock(&table_lock);
+	}
+	return NULL;
+}
+
+void test_rwlock()
+{
+	run_threads(WORKERS, table_user);
+
+	check(pthread_rwlock_rdlock(&table_lock) == 0);
+	check(pthread_rwlock_tryrdlock(&table_lock) == 0);
+	check(pthread_rwlock_trywrlock(&table_lock) == EBUSY);
+	pthread_rwlock_unlock(&table_lock);
+	pthread_rwlock_unlock(&table_lock);
+	check(pthread_rwlock_unlock(&table_lock) == EPERM);
+}
+
+//barriers: nobody leaves a round before everyone arrived, and one thread per round is the serial one
+#define BARRIER_ROUNDS 1000
+pthread_barrier_t phase;
+int arrived[BARRIER_ROUNDS];
+int serial[BARRIER_ROUNDS];
+
+void* phase_user(void* arg)
+{
+	int round;
+	for(round = 0; round < BARRIER_ROUNDS; round++)
+	{
+		__atomic_add_fetch(&arrived[round], 1, __ATOMIC_RELAXED);
+		if(pthread_barrier_wait(&phase) == PTHREAD_BARRIER_SERIAL_THREAD)
+			__atomic_add_fetch(&serial[round], 1, __ATOMIC_RELAXED);
+		check(__atomic_load_n(&arrived[round], __ATOMIC_RELAXED) == WORKERS);
+	}
+	return NULL;
+}
+
+void test_barrier()
+{
+	memset(arrived, 0, sizeof(arrived));
+	memset(serial, 0, sizeof(serial));
+	pthread_barrier_init(&phase, NULL, WORKERS);
+	run_threads(WORKERS, phase_user);
+	int round;
+	for(round = 0; round < BARRIER_ROUNDS; round++)
+		check(serial[round] == 1);
+	check(pthread_barrier_destroy(&phase) == 0);
+}
+
+//thread-specific data: one key stored inline in the tcb and one past them, each with a destructor
+#define KEYS 40
+pthread_key_t specific_keys[KEYS];
+int destroyed;
+
+void key_destructor(void* value)
+{
+	__atomic_add_fetch(&destroyed, 1, __ATOMIC_RELAXED);
+}
+
+void* key_user(void* arg)
+{
+	check(pthread_getspecific(specific_keys[0]) == NULL);
+	pthread_setspecific(specific_keys[0], (char*) arg + 1);
+	pthread_setspecific(specific_keys[KEYS - 1], (char*) arg + 2);
+	sched_yield();
+	check(pthread_getspecific(specific_keys[0]) == (char*) arg + 1);
+	check(pthread_getspecific(specific_keys[KEYS - 1]) == (char*) arg + 2);
+	return NULL;
+}
+
+void test_keys()
+{
+	int i;
+	for(i = 0; i < KEYS; i++)
+		check(pthread_key_create(&specific_keys[i], key_destructor) == 0);
+	destroyed = 0;
+	run_threads(WORKERS, key_user);
+	check(destroyed == 2 * WORKERS);
+	for(i = 0; i < KEYS; i++)
+		check(pthread_key_delete(specific_keys[i]) == 0);
+}
+
+//task pool: every index is visited once, also by loops nested in loops, and reductions come out exact
+#define ITEMS 1000000
+#define OUTER 64
+#define INNER 1000
+char marks[ITEMS];
+long task_count;
+
+void mark(long begin, long end, void* arg)
+{
+	long i;
+	for(i = begin; i < end; i++)
+		marks[i]++;
+}
+
+void mark_inner(long begin, long end, void* arg)
+{
+	long row = (long) arg;
+	long i;
+	for(i = begin; i < end; i++)
+		marks[row * INNER + i]++;
+}
+
+void mark_outer(long begin, long end, void* arg)
+{
+	//a frame of some size, a few of them stacked up by a thread helping with unrelated tasks overflow its stack
+	volatile char frame[2048];
+	frame[0] = 0;
+	long row;
+	for(row = begin; row < end; row++)
+	{
+		parallel_for(0, INNER, 10, mark_inner, (void*) row);
+		//read back after the nested loop, so the frame stays live across it
+		marks[row * INNER] += frame[0];
+	}
+}
+
+void* nest_from_thread(void* arg)
+{
+	parallel_for(0, OUTER, 1, mark_outer, NULL);
+	return NULL;
+}
+
+void sum(long begin, long end, void* partial, void* arg)
+{
+	long i;
+	for(i = begin; i < end; i++)
+		*(long*) partial += i;
+}
+
+void add(void* result, const void* partial, void* arg)
+{
+	*(long*) result += *(const long*) partial;
+}
+
+void count_task(void* arg)
+{
+	__atomic_add_fetch(&task_count, 1, __ATOMIC_RELAXED);
+}
+
+int marked_once(long count)
+{
+	long i;
+	for(i = 0; i < count; i++)
+		if(marks[i] != 1)
+			return 0;
+	return 1;
+}
+
+void test_parallel()
+{
+	long grain;
+	for(grain = 0; grain <= 1000; grain += 1000)
+	{
+		memset(marks, 0, sizeof(marks));
+		parallel_for(0, ITEMS, grain, mark, NULL);
+		check(marked_once(ITEMS));
+	}
+
+	memset(marks, 0, sizeof(marks));
+	parallel_for(0, OUTER, 1, mark_outer, NULL);
+	check(marked_once(OUTER * INNER));
+
+	//nested loops from a thread with the default stack, which the pool's tasks must not pile onto
+	memset(marks, 0, sizeof(marks));
+	pthread_t nester;
+	pthread_create(&nester, NULL, nest_from_thread, NULL);
+	pthread_join(nester, NULL);
+	check(marked_once(OUTER * INNER));
+
+	long total = 0;
+	parallel_reduce(0, ITEMS, 0, &total, sizeof(long), sum, add, NULL);
+	check(total == (long) ITEMS * (ITEMS - 1) / 2);
+
+	task_group group = TASK_GROUP_INITIALIZER;
+	task_count = 0;
+	int i;
+	for(i = 0; i < ROUNDS; i++)
+		check(task_spawn(&group, count_task, NULL) == 0);
+	task_wait(&group);
+	check(task_count == ROUNDS);
+}
+
+//allocator: small blocks handed over a channel are freed by whichever thread and carrier receives them, every
+//other one from an offload helper, so some are always freed on another kernel thread than they came from
+#define BLOCKS 2000
+channel* handoff;
+long crossed;
+
+long free_block(void* block)
+{
+	if(((long*) block)[0] != gettid())
+		__atomic_add_fetch(&crossed, 1, __ATOMIC_RELAXED);
+	free(block);
+	return 0;
+}
+
+void* alloc_producer()
+{
+	int i;
+	for(i = 0; i < BLOCKS; i++)
+	{
+		size_t size = 16 + (i * 37) % 1000;
+		long* block = malloc(size);
+		check(block != NULL && malloc_usable_size(block) >= size);
+		block[0] = gettid();
+		block[1] = size;
+		memset(block + 2, size & 0xff, size - 2 * sizeof(long));
+		check(channel_send(handoff, &block) == 0);
+		if(i % 16 == 0)
+			sched_yield();
+	}
+	return NULL;
+}
+
+void* alloc_consumer()
+{
+	int i;
+	for(i = 0; i < BLOCKS; i++)
+	{
+		long* block;
+		check(channel_recv(handoff, &block) == 0);
+		size_t size = block[1];
+		unsigned char* bytes = (unsigned char*)(block + 2);
+		size_t j;
+		for(j = 0; j < size - 2 * sizeof(long); j++)
+			if(bytes[j] != (size & 0xff))
+				break;
+		check(j == size - 2 * sizeof(long));
+		if(i % 2 == 0)
+			free_block(block);
+		else
+			offload_call(free_block, block);
+	}
+	return NULL;
+}
+
+void* alloc_user(void* arg)
+{
+	return (long) arg % 2 == 0 ? alloc_producer() : alloc_consumer();
+}
+
+void test_alloc()
+{
+	handoff = channel_create(sizeof(long*), 64);
+	crossed = 0;
+	run_threads(WORKERS, alloc_user);
+	channel_destroy(handoff);
+	check(crossed >= BLOCKS / 2);
+}
+
+//offload: calls that block a kernel thread run on a helper while the caller is parked
+long failing_call(void* arg)
+{
+	errno = ENOENT;
+	return (long) arg;
+}
+
+//an offloaded call runs as its caller, and can take a mutex another thread holds and wake a parked thread
+pthread_key_t offload_key;
+pthread_mutex_t offload_mutex = PTHREAD_MUTEX_INITIALIZER;
+sem_t offload_woken;
+
+long as_caller(void* arg)
+{
+	pthread_mutex_lock(&offload_mutex);
+	pthread_mutex_unlock(&offload_mutex);
+	sem_post(&offload_woken);
+	return pthread_equal(pthread_self(), *(pthread_t*) arg) && pthread_getspecific(offload_key) == arg;
+}
+
+void* hold_offload_mutex(void* arg)
+{
+	pthread_mutex_lock(&offload_mutex);
+	usleep(20000);
+	pthread_mutex_unlock(&offload_mutex);
+	sem_wait(&offload_woken);
+	return NULL;
+}
+
+//a kernel thread the runtime did not start, like one a library made, still has an id and thread-specific data
+int foreign_ok;
+
+void* run_foreign(void* arg)
+{
+	pthread_t self = pthread_self();
+	int ok = pthread_equal(self, pthread_self()) && !pthread_equal(self, *(pthread_t*) arg)
+		&& pthread_getspecific(offload_key) == NULL && pthread_setspecific(offload_key, &self) == 0
+		&& pthread_getspecific(offload_key) == &self;
+	__atomic_store_n(&foreign_ok, ok ? 1 : -1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+void test_offload()
+{
+	set_error(0);
+	check(offload_call(failing_call, (void*) 42L) == 42 && last_error() == ENOENT);
+
+	pthread_t self = pthread_self();
+	pthread_key_create(&offload_key, NULL);
+	pthread_setspecific(offload_key, &self);
+	sem_init(&offload_woken, 0, 0);
+	pthread_t holder;
+	pthread_create(&holder, NULL, hold_offload_mutex, NULL);
+	usleep(1000);
+	check(offload_call(as_caller, &self) == 1);
+	pthread_join(holder, NULL);
+	sem_destroy(&offload_woken);
+
+	int (*kernel_thread_create)(pthread_t*, const pthread_attr_t*, void* (*)(void*), void*) = dlsym(RTLD_NEXT, "pthread_create");
+	pthread_attr_t detached;
+	pthread_attr_init(&detached);
+	pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+	pthread_t foreign;
+	foreign_ok = 0;
+	check(kernel_thread_create != NULL && kernel_thread_create(&foreign, &detached, run_foreign, &self) == 0);
+	while(__atomic_load_n(&foreign_ok, __ATOMIC_ACQUIRE) == 0)
+		usleep(1000);
+	check(foreign_ok == 1);
+	check(pthread_getspecific(offload_key) == &self);
+	pthread_attr_destroy(&detached);
+	pthread_key_delete(offload_key);
+
+	char path[] = "/tmp/threads_test_XXXXXX";
+	int fd = mkstemp(path);
+	check(fd >= 0);
+	close(fd);
+
+	fd = open(path, O_WRONLY | O_TRUNC);
+	check(fd >= 0);
+	check(write(fd, "offload", 7) == 7);
+	check(fsync(fd) == 0);
+	close(fd);
+
+	struct stat info;
+	check(stat(path, &info) == 0 && info.st_size == 7);
+	char buf[8] = "";
+	fd = open(path, O_RDONLY);
+	check(pread(fd, buf, 7, 0) == 7 && strcmp(buf, "offload") == 0);
+	close(fd);
+	check(unlink(path) == 0);
+	check(stat(path, &info) == -1 && last_error() == ENOENT);
+
+	//a directory opened without a mode, an unnamed file with one
+	fd = open("/tmp", O_RDONLY | O_DIRECTORY);
+	check(fd >= 0);
+	close(fd);
+	fd = open("/tmp", O_TMPFILE | O_RDWR, 0600);
+	if(fd >= 0)
+	{
+		check(fstat(fd, &info) == 0 && (info.st_mode & 0777) == 0600);
+		close(fd);
+	}
+
+	struct addrinfo hints, *result;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags = AI_NUMERICHOST;
+	hints.ai_socktype = SOCK_STREAM;
+	check(getaddrinfo("127.0.0.1", "80", &hints, &result) == 0);
+	freeaddrinfo(result);
+}
+
+//stdio: scanf on an empty pipe and fopen of a fifo nobody opened for writing park only their own thread
+int fifo_ready;
+
+void* scan_stdin(void* arg)
+{
+	int value = 0;
+	check(scanf("%d", &value) == 1 && value == 42);
+	return NULL;
+}
+
+void* read_fifo(void* arg)
+{
+	char line[16] = "";
+	FILE* in = fopen((const char*) arg, "r");
+	check(in != NULL && fileno(in) >= 0);
+	check(fgets(line, sizeof(line), in) != NULL && strcmp(line, "fifo\n") == 0);
+	fclose(in);
+	return NULL;
+}
+
+//meanwhile the calling thread still gets its sleeps and switches on the same carrier
+void keep_going()
+{
+	int i;
+	for(i = 0; i < 10; i++)
+	{
+		usleep(1000);
+		sched_yield();
+	}
+}
+
+void test_stdio()
+{
+	int saved = dup(STDIN_FILENO);
+	int ends[2];
+	check(pipe(ends) == 0);
+	dup2(ends[0], STDIN_FILENO);
+	close(ends[0]);
+	check(fileno(stdin) == STDIN_FILENO);
+
+	pthread_t reader;
+	pthread_create(&reader, NULL, scan_stdin, NULL);
+	keep_going();
+	check(write(ends[1], "42\n", 3) == 3);
+	pthread_join(reader, NULL);
+	close(ends[1]);
+	dup2(saved, STDIN_FILENO);
+	close(saved);
+	clearerr(stdin);
+
+	char path[] = "/tmp/threads_test_fifo_XXXXXX";
+	check(mkdtemp(path) != NULL);
+	char fifo[sizeof(path) + 8];
+	snprintf(fifo, sizeof(fifo), "%s/fifo", path);
+	check(mkfifo(fifo, 0600) == 0);
+	pthread_create(&reader, NULL, read_fifo, fifo);
+	keep_going();
+	FILE* out = fopen(fifo, "w");
+	check(out != NULL && fputs("fifo\n", out) >= 0);
+	fclose(out);
+	pthread_join(reader, NULL);
+	unlink(fifo);
+	rmdir(path);
+}
+
+//reactor: a stream of bytes between two threads parked on a socket pair, and green sleeps
+#define STREAM_BYTES (1 << 20)
+int stream[2];
+
+void* stream_writer(void* arg)
+{
+	static char chunk[4096];
+	long sent;
+	for(sent = 0; sent < STREAM_BYTES; sent += sizeof(chunk))
+		check(write(stream[0], chunk, sizeof(chunk)) == sizeof(chunk));
+	close(stream[0]);
+	return NULL;
+}
+
+void* stream_reader(void* arg)
+{
+	char chunk[1000];
+	long received = 0;
+	ssize_t done;
+	while((done = read(stream[1], chunk, sizeof(chunk))) > 0)
+		received += done;
+	check(done == 0 && received == STREAM_BYTES);
+	close(stream[1]);
+	return NULL;
+}
+
+void* stream_user(void* arg)
+{
+	return (long) arg == 0 ? stream_writer(arg) : stream_reader(arg);
+}
+
+void test_io()
+{
+	check(socketpair(AF_UNIX, SOCK_STREAM, 0, stream) == 0);
+	run_threads(2, stream_user);
+
+	uint64_t start = now();
+	usleep(10000);
+	check(now() - start >= 10000000L);
+}
+
+//errno: every thread keeps its own across switches and carriers, and the runtime's calls set the caller's
+#define REFUSED 200
+struct sockaddr_in refusing;
+
+void* keep_errno(void* arg)
+{
+	int i;
+	for(i = 0; i < ROUNDS / 100; i++)
+	{
+		set_error(1000 + (long) arg);
+		if(i % 2 == 0)
+			sched_yield();
+		else
+			usleep(100);
+		check(last_error() == 1000 + (long) arg);
+	}
+	return NULL;
+}
+
+void* connect_refused(void* arg)
+{
+	int i;
+	for(i = 0; i < REFUSED; i++)
+	{
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		check(connect(fd, (struct sockaddr*) &refusing, sizeof(refusing)) == -1);
+		check(last_error() == ECONNREFUSED);
+		close(fd);
+	}
+	return NULL;
+}
+
+void* errno_user(void* arg)
+{
+	return (long) arg % 2 == 0 ? keep_errno(arg) : connect_refused(arg);
+}
+
+void test_errno()
+{
+	//a bound socket that doesn't listen refuses connections
+	int bound = socket(AF_INET, SOCK_STREAM, 0);
+	socklen_t size = sizeof(refusing);
+	memset(&refusing, 0, sizeof(refusing));
+	refusing.sin_family = AF_INET;
+	refusing.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	check(bind(bound, (struct sockaddr*) &refusing, sizeof(refusing)) == 0);
+	getsockname(bound, (struct sockaddr*) &refusing, &size);
+	run_threads(2 * WORKERS, errno_user);
+	close(bound);
+}
+
+//floating point: each thread keeps the rounding mode it set while others round another way on its carrier
+const int rounding[] = {FE_TONEAREST, FE_UPWARD, FE_DOWNWARD, FE_TOWARDZERO};
+double rounded_third[4];
+volatile double one = 1.0, three = 3.0;
+
+void* keep_rounding(void* arg)
+{
+	int mode = (long) arg % 4;
+	check(fesetround(rounding[mode]) == 0);
+	int i;
+	for(i = 0; i < ROUNDS / 100; i++)
+	{
+		if(i % 2 == 0)
+			sched_yield();
+		else
+			usleep(100);
+		//the x87 control word says what fegetround returns, mxcsr how the division rounds
+		check(fegetround() == rounding[mode]);
+		check(one / three == rounded_third[mode]);
+	}
+	return NULL;
+}
+
+void test_fp_control()
+{
+	int mode;
+	for(mode = 0; mode < 4; mode++)
+	{
+		fesetround(rounding[mode]);
+		rounded_third[mode] = one / three;
+	}
+	fesetround(FE_TONEAREST);
+	check(rounded_third[1] != rounded_third[2]);
+
+	run_threads(WORKERS, keep_rounding);
+	check(fegetround() == FE_TONEAREST);
+}
+
+//preemption: a thread spinning on a flag only sees it set if the setter gets a carrier meanwhile
+volatile int flag;
+
+void* spin_user(void* arg)
+{
+	if((long) arg == 0)
+		while(!flag)
+			;
+	else
+		flag = 1;
+	return NULL;
+}
+
+void test_preempt()
+{
+	flag = 0;
+	run_threads(2, spin_user);
+}
+
+//time slice: a spinner on one carrier gives way to the thread it waits for after a short slice, not the default
+#define SHORT_SLICE 1000000L
+
+void test_quantum()
+{
+	struct timespec saved, slice = {0, SHORT_SLICE}, tiny = {0, 1000};
+	check(pthread_getquantum_np(&saved) == 0 && saved.tv_sec * 1000000000L + saved.tv_nsec > 20 * SHORT_SLICE);
+	check(pthread_setquantum_np(&tiny) == EINVAL);
+	check(pthread_setquantum_np(&slice) == 0);
+	struct timespec now_set;
+	check(pthread_getquantum_np(&now_set) == 0 && now_set.tv_sec == 0 && now_set.tv_nsec == SHORT_SLICE);
+
+	//the setter either runs first or gets the carrier back within a few short slices
+	flag = 0;
+	uint64_t start = now();
+	run_threads(2, spin_user);
+	check(now() - start < 10 * SHORT_SLICE);
+
+	check(pthread_setquantum_np(&saved) == 0);
+}
+
+//scheduling parameters: the caller switches only when the change leaves it outranked by a thread READY on its carrier
+int started;
+
+void* note_start(void* arg)
+{
+	__atomic_store_n(&started, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+int set_policy(pthread_t thread, int policy, int priority)
+{
+	struct sched_param param = {priority};
+	return pthread_setschedparam(thread, policy, &param);
+}
+
+void test_sched()
+{
+	pthread_t thread;
+
+	//a READY thread moved to another fair policy waits its turn
+	started = 0;
+	check(pthread_create(&thread, NULL, note_start, NULL) == 0);
+	check(set_policy(thread, SCHED_BATCH, 0) == 0);
+	check(run_carriers > 1 || started == 0);
+	pthread_join(thread, NULL);
+	check(started == 1);
+
+	//one raised above the caller runs before the call returns
+	started = 0;
+	check(pthread_create(&thread, NULL, note_start, NULL) == 0);
+	check(set_policy(thread, SCHED_FIFO, 10) == 0);
+	check(run_carriers > 1 || started == 1);
+	pthread_join(thread, NULL);
+
+	//and so does one the caller lowers itself below
+	check(set_policy(pthread_self(), SCHED_FIFO, 20) == 0);
+	started = 0;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	struct sched_param param = {10};
+	pthread_attr_setschedparam(&attr, &param);
+	check(pthread_create(&thread, &attr, note_start, NULL) == 0);
+	check(run_carriers > 1 || started == 0);
+	check(set_policy(pthread_self(), SCHED_OTHER, 0) == 0);
+	check(run_carriers > 1 || started == 1);
+	pthread_join(thread, NULL);
+	pthread_attr_destroy(&attr);
+
+	int policy;
+	check(pthread_getschedparam(pthread_self(), &policy, &param) == 0 && policy == SCHED_OTHER);
+	check(set_policy(pthread_self(), SCHED_FIFO, 0) == EINVAL);
+	check(set_policy(pthread_self(), SCHED_OTHER, 1) == EINVAL);
+}
+
+//statistics: a thread that slept, spun and yielded is charged for each, and sem_wait blocking shows up runtime wide
+#define NAP 10000000L
+sem_t stats_done, stats_release;
+
+void* nap_and_spin(void* arg)
+{
+	usleep(NAP / 1000);
+	uint64_t start = now();
+	while(now() - start < NAP)
+		;
+	sched_yield();
+	sem_post(&stats_done);
+	sem_wait(&stats_release);
+	return NULL;
+}
+
+void test_stats()
+{
+	runtime_stats before, after;
+	check(runtime_getstats_np(&before) == 0);
+
+	sem_init(&stats_done, 0, 0);
+	sem_init(&stats_release, 0, 0);
+	pthread_t thread;
+	check(pthread_create(&thread, NULL, nap_and_spin, NULL) == 0);
+	sem_wait(&stats_done);
+	usleep(1000);
+
+	thread_stats stats;
+	check(pthread_getstats_np(thread, &stats) == 0);
+	check(stats.blocked_ns >= NAP && stats.cpu_ns >= NAP);
+	check(stats.voluntary_switches >= 2);
+	sem_post(&stats_release);
+	pthread_join(thread, NULL);
+	check(pthread_getstats_np(thread, &stats) == ESRCH);
+	sem_destroy(&stats_done);
+	sem_destroy(&stats_release);
+
+	check(runtime_getstats_np(&after) == 0);
+	uint64_t latency = 0, blocking = 0;
+	int i;
+	for(i = 0; i < STATS_BUCKETS; i++)
+	{
+		latency += after.sched_latency[i] - before.sched_latency[i];
+		blocking += after.sem_wait[i] - before.sem_wait[i];
+	}
+	check(latency > 0 && blocking >= 1);
+	//the wait for the thread's post lasted over the nap, so a bucket from 2^23ns up counted it
+	uint64_t long_waits = 0;
+	for(i = 23; i < STATS_BUCKETS; i++)
+		long_waits += after.sem_wait[i] - before.sem_wait[i];
+	check(long_waits >= 1);
+}
+
+//tracing: an export is Chrome trace JSON, with the threads just created in it when tracing is on
+void test_trace()
+{
+	run_threads(WORKERS, plus_one);
+
+	char path[] = "/tmp/threads_test_XXXXXX";
+	int fd = mkstemp(path);
+	check(fd >= 0);
+	close(fd);
+	check(trace_export(path) == 0);
+
+	struct stat info;
+	check(stat(path, &info) == 0);
+	char* json = malloc(info.st_size + 1);
+	FILE* in = fopen(path, "r");
+	check(in != NULL && fread(json, 1, info.st_size, in) == (size_t) info.st_size);
+	json[info.st_size] = 0;
+	fclose(in);
+	unlink(path);
+
+	const char header[] = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+	check(strncmp(json, header, sizeof(header) - 1) == 0);
+	check(info.st_size > 3 && strcmp(json + info.st_size - 3, "]}\n") == 0);
+	if(getenv("THREADS_TRACE") != NULL)
+		check(strstr(json, "\"name\":\"create\"") != NULL && strstr(json, "\"ph\":\"X\"") != NULL);
+	free(json);
+}
+
+typedef struct
+{
+	const char* name;
+	void (*run)();
+} test;
+
+const test tests[] = {
+	{"create_join", test_create_join},
+	{"batch", test_batch},
+	{"stack_size", test_stack_size},
+	{"semaphore", test_semaphore},
+	{"mutex", test_mutex},
+	{"cond", test_cond},
+	{"channels", test_channels},
+	{"rwlock", test_rwlock},
+	{"barrier", test_barrier},
+	{"keys", test_keys},
+	{"parallel", test_parallel},
+	{"alloc", test_alloc},
+	{"offload", test_offload},
+	{"stdio", test_stdio},
+	{"io", test_io},
+	{"errno", test_errno},
+	{"fp_control", test_fp_control},
+	{"preempt", test_preempt},
+	{"quantum", test_quantum},
+	{"sched", test_sched},
+	{"stats", test_stats},
+	{"trace", test_trace},
+};
+
+int run_tests()
+{
+	pthread_setconcurrency(run_carriers);
+	unsigned int i;
+	for(i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+	{
+		test_name = tests[i].name;
+		int before = failures;
+		tests[i].run();
+		if(failures == before)
+			printf("ok %s, %d carriers\n", test_name, run_carriers);
+		fflush(stdout);
+	}
+	//an exit status only holds 8 bits
+	return failures < 255 ? failures : 255;
+}
+
+//runs the tests in a child with the given number of carriers, returns its failures
+int run_child(const char* self, int count)
+{
+	char argument[16];
+	snprintf(argument, sizeof(argument), "%d", count);
+	pid_t pid = fork();
+	if(pid == 0)
+	{
+		execl(self, self, argument, (char*) NULL);
+		_exit(127);
+	}
+	if(pid < 0)
+		return 1;
+
+	int status;
+	int waited;
+	for(waited = 0; waited < TEST_TIMEOUT * 10; waited++)
+	{
+		if(waitpid(pid, &status, WNOHANG) == pid)
+		{
+			if(WIFEXITED(status))
+				return WEXITSTATUS(status);
+			printf("FAIL %d carriers: killed by signal %d\n", count, WTERMSIG(status));
+			return 1;
+		}
+		usleep(100000);
+	}
+	kill(pid, SIGKILL);
+	waitpid(pid, &status, 0);
+	printf("FAIL %d carriers: still running after %d seconds\n", count, TEST_TIMEOUT);
+	return 1;
+}
+
+int main(int argc, char** argv)
+{
+	if(argc > 1)
+	{
+		run_carriers = atoi(argv[1]);
+		return run_tests();
+	}
+
+	//the children start from nothing, the runtime is never set up in this process
+	int cores = sysconf(_SC_NPROCESSORS_ONLN);
+	fflush(stdout);
+	int failed = run_child("/proc/self/exe", 1);
+	setenv("THREADS_TRACE", "/dev/null", 1);
+	failed += run_child("/proc/self/exe", cores > TEST_CARRIERS ? cores : TEST_CARRIERS);
+	printf("%s, %d failures\n", failed == 0 ? "passed" : "FAILED", failed);
+	return failed;
+}